@@ -0,0 +1,142 @@
+#ifndef ATOM_H
+#define ATOM_H
+// *****************************************************************************
+// atom.h                                                             XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Interned text for names and operators
+//
+//     Each distinct text is stored once in a global table, so that atoms
+//     compare by pointer and carry a precomputed hash. An atom reads like
+//     a constant std::string, so most code using names needs no change.
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "base.h"
+#include <iostream>
+#include <utility>
+
+XL_BEGIN
+
+struct Atom
+// ----------------------------------------------------------------------------
+//   A handle on an interned text
+// ----------------------------------------------------------------------------
+{
+    typedef std::pair<const text, ulong> Entry; // Text and its hash
+
+public:
+    Atom(): entry(Empty())                              {}
+    Atom(const text &t): entry(Intern(t))               {}
+    Atom(kstring t): entry(Intern(t))                   {}
+    Atom &operator=(const text &t)      { entry = Intern(t); return *this; }
+    Atom &operator=(kstring t)          { entry = Intern(t); return *this; }
+
+    // Access to the text and its hash
+    operator const text &() const       { return entry->first; }
+    const text &        Text() const    { return entry->first; }
+    ulong               Hash() const    { return entry->second; }
+
+    // Read-only subset of the std::string interface
+    size_t              length() const  { return entry->first.length(); }
+    size_t              size() const    { return entry->first.size(); }
+    bool                empty() const   { return entry->first.empty(); }
+    kstring             c_str() const   { return entry->first.c_str(); }
+    kstring             data() const    { return entry->first.data(); }
+    char operator[](size_t i) const     { return entry->first[i]; }
+    text::const_iterator begin() const  { return entry->first.begin(); }
+    text::const_iterator end() const    { return entry->first.end(); }
+    text substr(size_t p, size_t n = text::npos) const
+    {
+        return entry->first.substr(p, n);
+    }
+    size_t find(const text &t, size_t p = 0) const
+    {
+        return entry->first.find(t, p);
+    }
+    size_t find(char c, size_t p = 0) const
+    {
+        return entry->first.find(c, p);
+    }
+
+    // Comparisons between atoms only compare pointers
+    bool operator==(const Atom &o) const { return entry == o.entry; }
+    bool operator!=(const Atom &o) const { return entry != o.entry; }
+    bool operator==(const text &t) const { return entry->first == t; }
+    bool operator!=(const text &t) const { return entry->first != t; }
+    bool operator==(kstring t) const    { return entry->first == t; }
+    bool operator!=(kstring t) const    { return entry->first != t; }
+    bool operator<(const Atom &o) const { return Text() < o.Text(); }
+    bool operator>(const Atom &o) const { return Text() > o.Text(); }
+    bool operator<=(const Atom &o) const { return !(*this > o); }
+    bool operator>=(const Atom &o) const { return !(*this < o); }
+
+    static ulong        Hash(const text &t);
+    static size_t       Count();
+
+private:
+    static const Entry *Intern(const text &t);
+    static const Entry *Empty();
+    const Entry *       entry;
+};
+
+
+inline bool operator==(const text &t, const Atom &a)   { return a == t; }
+inline bool operator!=(const text &t, const Atom &a)   { return a != t; }
+inline bool operator==(kstring t, const Atom &a)       { return a == t; }
+inline bool operator!=(kstring t, const Atom &a)       { return a != t; }
+inline text operator+(const Atom &a, const Atom &b)
+{
+    return a.Text() + b.Text();
+}
+inline text operator+(const Atom &a, const text &t)    { return a.Text() + t; }
+inline text operator+(const text &t, const Atom &a)    { return t + a.Text(); }
+inline text operator+(const Atom &a, kstring t)        { return a.Text() + t; }
+inline text operator+(kstring t, const Atom &a)        { return t + a.Text(); }
+inline text operator+(const Atom &a, char c)           { return a.Text() + c; }
+inline text operator+(char c, const Atom &a)           { return c + a.Text(); }
+inline std::ostream &operator<<(std::ostream &out, const Atom &a)
+{
+    return out << a.Text();
+}
+
+
+// Atoms the evaluators check for on every infix, compared by pointer
+extern const Atom xl_atom_semicolon;            // ;
+extern const Atom xl_atom_newline;              // \n
+extern const Atom xl_atom_is;                   // is
+extern const Atom xl_atom_as;                   // as
+extern const Atom xl_atom_colon;                // :
+extern const Atom xl_atom_assign;               // :=
+extern const Atom xl_atom_comma;                // ,
+extern const Atom xl_atom_dot;                  // .
+extern const Atom xl_atom_when;                 // when
+extern const Atom xl_atom_matching;             // matching
+
+XL_END
+
+#endif // ATOM_H
@@ -39,13 +39,18 @@
 //   All bytecode operations are represented by an instance of the 'Op'
 //   class, which has a virtual member 'Run' taking a 'Data' argument.
 //
-//   The 'Data' argument is an array of Tree_p represented by a pointer.
+//   The 'Data' argument is an array of FrameSlot represented by a pointer.
 //   Local values are stored at positive offsets, input arguments and
 //   closure data at negative offsets.
 //    [0]       : Self / result
 //    [1]       : Evaluation context (more precisely, the Scope for it)
 //    [2..N]    : Local variables, temporaries, output slots
 //    [-1..-M]  : Input arguments, captured values (closure)
+//
+//   Activation records are carved out of a per-thread FrameStack.
+//   Slots are not reference counted: the garbage collector scans
+//   live frames as roots, so calls and returns do not allocate and
+//   do not touch reference counts.
 
 #include "tree.h"
 #include "context.h"
@@ -53,6 +58,7 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
 
 XL_BEGIN
@@ -62,11 +68,93 @@ struct Code;                   // A sequence of operations
 struct Procedure;              // Internal representation of functions
 struct CallOp;                 // A call operation
 struct CodeBuilder;            // Code generator
+struct Instr;                  // Flat encoding of an operation
 typedef std::vector<Op *> Ops; // Sequence of operations
+typedef std::vector<Instr> Instrs; // Flat instruction array
 typedef std::map<Tree *, int>  TreeIDs;
 typedef std::map<Tree *, Op *> TreeOps;
 typedef std::vector<int>       ParmOrder;
-typedef Tree_p *               Data;
+struct FrameSlot;              // Slot in an activation record
+struct FrameStack;             // Per-thread stack of activation records
+typedef FrameSlot *            Data;
+
+
+
+// ============================================================================
+//
+//     Activation records
+//
+// ============================================================================
+
+struct FrameSlot
+// ----------------------------------------------------------------------------
+//   A slot in an activation record, not reference counted
+// ----------------------------------------------------------------------------
+//   Storing a tree only marks it in use for the current GC cycle.
+//   It is then kept alive by the FrameStack roots until the frame is popped.
+{
+    FrameSlot(Tree *tree = nullptr): tree(tree) { TypeAllocator::InUse(tree); }
+    FrameSlot &operator=(Tree *t)
+    {
+        tree = (Tree *) TypeAllocator::InUse(t);
+        return *this;
+    }
+    operator Tree *() const             { return tree; }
+    Tree *operator->() const            { return tree; }
+
+public:
+    Tree *tree;
+};
+
+
+struct FrameStack
+// ----------------------------------------------------------------------------
+//   Per-thread stack of activation records for bytecode procedures
+// ----------------------------------------------------------------------------
+//   Frames are allocated in blocks that never move, so that a Data pointer
+//   remains valid while deeper calls grow the stack.
+{
+    enum { BLOCK_SLOTS = 4096 };
+    struct Block
+    {
+        FrameSlot *     base;
+        FrameSlot *     top;
+        FrameSlot *     limit;
+    };
+    typedef std::vector<Block> Blocks;
+
+public:
+    FrameStack();
+    ~FrameStack();
+
+    static FrameStack & Current();
+    Data                Push(uint size);
+    void                Pop(Data frame);
+    void                Roots(std::set<Tree *> &roots);
+
+private:
+    Data                Grow(uint size);
+
+private:
+    Blocks              blocks;
+    uint                current;
+};
+
+
+struct Frame
+// ----------------------------------------------------------------------------
+//   An activation record on the current thread's frame stack
+// ----------------------------------------------------------------------------
+{
+    Frame(uint size)
+        : stack(FrameStack::Current()), base(stack.Push(size)) {}
+    ~Frame()                            { stack.Pop(base); }
+    operator Data()                     { return base; }
+
+private:
+    FrameStack &        stack;
+    Data                base;
+};
 
 
 
@@ -121,6 +209,50 @@ public:
 };
 
 
+struct Instr
+// ----------------------------------------------------------------------------
+//   Compact encoding of an Op, executed by a direct-threaded loop
+// ----------------------------------------------------------------------------
+//   The 'Op' graph is what CodeBuilder generates. Once the code is complete,
+//   it is flattened into a contiguous array of 'Instr', where 'a' and 'b'
+//   are operand indices in the data frame, and 'success' and 'fail' are
+//   indices in the same array. Ops without a flat encoding are 'GENERIC',
+//   and are executed by calling their virtual 'Run' member.
+{
+    enum Opcode
+    {
+        EXIT,                   // Return from the current code
+        GENERIC,                // Call op->Run(data)
+        CONST,                  // Result = op->value
+        SELF,                   // No-op, result is already self
+        VALUE,                  // Result = data[a]
+        STORE,                  // data[a] = result
+        CLEAR,                  // data[a..b] = nullptr
+        EVAL,                   // Evaluate code at b once, cache in data[a]
+        CALL,                   // Call op->target with out area at a
+        TYPECHECK,              // Result = typecheck data[a] as data[b]
+        MATCH_NATURAL,          // Check result is natural op->ref
+        MATCH_REAL,             // Check result is real op->ref
+        MATCH_TEXT,             // Check result is text op->ref
+        MATCH_NAME,             // Check data[a] and data[b] are equal
+        WHEN,                   // Check data[a] is true
+
+        // Superinstructions generated by CodeBuilder::Optimize
+        CONST_STORE,            // Result = data[a] = op->value
+        EVAL_TYPECHECK,         // EVAL, then typecheck data[a] as op->type
+        EVAL_MATCH_NATURAL,     // EVAL, then check result is natural op->ref
+        EVAL_MATCH_REAL,        // EVAL, then check result is real op->ref
+        EVAL_MATCH_TEXT,        // EVAL, then check result is text op->ref
+        NUM_OPCODES
+    };
+
+    Opcode              opcode;
+    int                 a, b;
+    uint                success, fail;
+    Op *                op;
+};
+
+
 struct Code : public Op, Info
 // ----------------------------------------------------------------------------
 //    A sequence of operations (may be local evaluation code in a function)
@@ -130,6 +262,8 @@ struct Code : public Op, Info
     Tree_p              self;
     Op *                ops;
     Ops                 instrs;
+    Instrs              code;
+    uint                entry;
 public:
     Code(Context *, Tree *self);
     Code(Context *, Tree *self, Op *instr);
@@ -138,8 +272,12 @@ public:
     virtual Op *        Run(Data data);
 
     void                SetOps(Op **ops, Ops *instr, uint outId);
+    void                Linearize();
+    void                Execute(Data data, uint pc);
+    Tree *              EvalOnce(Data data, Instr *instr);
     virtual void        Dump(std::ostream &out);
     static void         Dump(std::ostream &out, Op *ops, Ops &instrs);
+    static void         Dump(std::ostream &out, uint entry, Instrs &code);
     static text         Ref(Op *op, text sep, text set, text null);
     virtual uint        Inputs()        { return 0; }
     virtual uint        Locals()        { return 0; }
@@ -166,7 +304,6 @@ public:
     virtual kstring     OpID()          { return "function"; }
 
     uint                Closures()      { return captured.size(); }
-    Tree_p *            ClosureData()   { return &captured[0]; }
     uint                OffsetSize()    { return Inputs() + Closures(); }
     uint                FrameSize()     { return 2 + OffsetSize() + Locals(); }
 };
@@ -231,6 +368,17 @@ public:
     void        Success();
     void        InstructionsSuccess(uint oldNumEvals);
 
+    // Optimization of the generated code
+    void        Optimize();
+    void        RemoveLabels();
+    bool        Superinstructions();
+    bool        Peephole();
+    bool        LiveIDs(Ops &ops, std::set<int> &live);
+    uint        Predecessors(Op *op);
+    Op *        Predecessor(Op *op);
+    void        Replace(Op *from, Op *to);
+    void        Remove(Op *op);
+
 public:
     Op *        ops;            // List of operations to evaluate that tree
     Op **       lastOp;         // Last operation being written to
@@ -251,11 +399,50 @@ public:
     Ops         instrs;         // All instructions
     TreeOps     subexprs;       // Code generated for sub-expressions
     ParmOrder   parms;          // Indices for parameters
+    ParmOrder   opcodeIDs;      // Indices read by builtin opcodes
     bool        defer;          // Deferred evaluation
 };
 
 
 
+// ============================================================================
+//
+//    Frame stack inline functions
+//
+// ============================================================================
+
+inline Data FrameStack::Push(uint size)
+// ----------------------------------------------------------------------------
+//   Allocate a cleared frame with the given number of slots
+// ----------------------------------------------------------------------------
+{
+    Block &block = blocks[current];
+    if (block.top + size > block.limit)
+        return Grow(size);
+    Data frame = block.top;
+    block.top += size;
+    for (Data slot = frame; slot < block.top; slot++)
+        slot->tree = nullptr;
+    return frame;
+}
+
+
+inline void FrameStack::Pop(Data frame)
+// ----------------------------------------------------------------------------
+//   Release a frame and all frames allocated after it
+// ----------------------------------------------------------------------------
+{
+    while (frame < blocks[current].base || frame >= blocks[current].limit)
+    {
+        XL_ASSERT(current > 0 && "Popping a frame not on this stack");
+        blocks[current].top = blocks[current].base;
+        current--;
+    }
+    blocks[current].top = frame;
+}
+
+
+
 // ============================================================================
 //
 //    Functions returning specific items in a data scope
@@ -312,7 +499,7 @@ inline Tree *DataArg(Data data, uint index)
 //    Return the Nth input argument
 // ----------------------------------------------------------------------------
 {
-    return data[~index];
+    return data[~(int) index];
 }
 
 
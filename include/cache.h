@@ -0,0 +1,82 @@
+#ifndef CACHE_H
+#define CACHE_H
+// *****************************************************************************
+// cache.h                                                            XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     On-disk cache of parsed source files
+//
+//     Each source file has one entry in the cache directory, holding its
+//     parse tree as a flat tree image that is mapped back on the next run.
+//     An entry is only used if its stamp matches the source contents, the
+//     syntax and options used for parsing, and the version of the image.
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "base.h"
+#include "tree.h"
+#include "scanner.h"
+#include "syntax.h"
+
+
+XL_BEGIN
+
+struct ModuleCache
+// ----------------------------------------------------------------------------
+//   Save and reload parse trees keyed by the source they were parsed from
+// ----------------------------------------------------------------------------
+{
+    ModuleCache(text directory, Positions &positions);
+
+    // Lookup and update entries for a source file with the given contents,
+    // parsed with a syntax identified by its stamp before parsing
+    Tree *              Load(text file, const text &source, ulonglong syntax);
+    bool                Store(text file, const text &source, ulonglong syntax,
+                              Tree *tree);
+
+    static text         DefaultDirectory();
+
+    // Stamps identifying how a file was processed
+    static ulonglong    BuildStamp();
+    static ulonglong    SyntaxStamp(Syntax &syntax);
+    static ulonglong    Mix(ulonglong hash, const text &value);
+    static ulonglong    Mix(ulonglong hash, ulonglong value);
+
+private:
+    text                Entry(text file);
+    ulonglong           Stamp(text file, const text &source, ulonglong syntax);
+    bool                CreateDirectory();
+
+private:
+    text                directory;
+    Positions &         positions;
+};
+
+XL_END
+
+RECORDER_DECLARE(module_cache);
+
+#endif // CACHE_H
@@ -194,6 +194,7 @@ XL_BEGIN
 // ============================================================================
 
 struct Context;                                 // Execution context
+struct LookupCache;                             // Lookup inline cache
 
 // Give names to components of a symbol table
 typedef Prefix                          Scope;
@@ -211,6 +212,10 @@ typedef std::map<Tree_p, eval_fn>       code_map;
 
 #define REWRITE_NAME            "\n"
 #define REWRITE_CHILDREN_NAME   ";"
+#define SCOPE_INDEX_DEPTH       8       // Rewrite depth creating an index
+#define SCOPE_INDEX_MIN_SIZE    64      // Initial number of index entries
+#define LOOKUP_CACHE_DEPTH      4       // Rewrite depth worth caching
+#define LOOKUP_CACHE_ENTRIES    4       // Scopes cached per call site
 
 
 // ============================================================================
@@ -295,7 +300,8 @@ public:
                                      Tree *form, Infix *decl, void *info);
     Tree *              Lookup(Tree *what,
                                lookup_fn lookup, void *info,
-                               bool recurse=true);
+                               bool recurse=true,
+                               LookupCache *cache=nullptr);
     Rewrite *           Reference(Tree *form, bool recurse=true);
     Tree *              DeclaredPattern(Tree *form);
     Tree *              Bound(Tree *form,bool recurse=true);
@@ -325,10 +331,84 @@ public:
 public:
     Scope_p             symbols;
     static uint         hasRewritesForKind;
+    static uint         generation;
     GARBAGE_COLLECT(Context);
 };
 
 
+// ============================================================================
+//
+//    Hash index for large scopes
+//
+// ============================================================================
+
+struct ScopeIndex : Info
+// ----------------------------------------------------------------------------
+//   Open-addressing hash index of the names declared in a large scope
+// ----------------------------------------------------------------------------
+//   The index is attached to a scope by Context::Enter when the rewrite
+//   tree for that scope gets deep, and is then kept up to date by Enter.
+//   Only declarations of plain names are indexed, using a hash of the
+//   full name. Other patterns are still looked up in the rewrite tree.
+{
+    struct Entry
+    {
+        ulong           hash;           // Full hash of the name
+        Name *          name;           // Name being declared
+        Infix *         decl;           // Declaration, nullptr if ambiguous
+    };
+    typedef std::vector<Entry> Entries;
+
+    ScopeIndex(Scope *scope);
+
+    Entry *             Find(Name *name);
+    void                Add(Name *name, Infix *decl);
+
+private:
+    void                Insert(ulong hash, Name *name, Infix *decl);
+    void                Grow();
+
+private:
+    Entries             entries;
+    uint                count;
+};
+
+
+
+struct LookupCache : Info
+// ----------------------------------------------------------------------------
+//   Inline cache of the lookup candidates for a given call site
+// ----------------------------------------------------------------------------
+//   For each deep scope where 'what' was looked up, this remembers the
+//   declarations whose hash matched, in lookup order, so that the next
+//   lookup only has to try them. The local rewrite tree only grows by
+//   filling nil slots, so an entry remains valid as long as the nil slot
+//   that ended the walk is still nil. The Context::generation counter
+//   catches the rare cases where a whole table is replaced.
+{
+    struct Entry
+    {
+        Scope_p         scope;          // Scope the candidates come from
+        Tree_p          last;           // Children holding the final slot
+        Tree_p *        slot;           // Nil slot that ended the walk
+        uint            generation;     // Context generation when cached
+        RewriteList     candidates;     // Matching declarations, in order
+    };
+    typedef std::vector<Entry> Entries;
+
+    LookupCache(): entries(), next(0) {}
+
+    Entry *             Find(Scope *scope);
+    void                Add(Scope *scope, Tree *last, Tree_p *slot,
+                            RewriteList &candidates);
+
+private:
+    Entries             entries;
+    uint                next;
+};
+
+
+
 // ============================================================================
 //
 //    Meaning adapters - Make it more explicit what happens in code
@@ -537,7 +617,7 @@ inline bool IsTypeAnnotation(Infix *infix)
 //   Check if an infix is a type annotation
 // ----------------------------------------------------------------------------
 {
-    return infix->name == ":" || infix->name == "as";
+    return infix->name == xl_atom_colon || infix->name == xl_atom_as;
 }
 
 
@@ -558,7 +638,7 @@ inline bool IsAssignment(Infix *infix)
 //   Check if an infix is an assignment
 // ----------------------------------------------------------------------------
 {
-    return infix->name == ":=";
+    return infix->name == xl_atom_assign;
 }
 
 
@@ -579,7 +659,7 @@ inline bool IsDefinition(Infix *infix)
 //   Check if an infix is a constant declaration
 // ----------------------------------------------------------------------------
 {
-    return infix->name == "is";
+    return infix->name == xl_atom_is;
 }
 
 
@@ -644,7 +724,7 @@ inline bool IsSequence(Infix *infix)
 //   Check if an infix represents a sequence, i.e. "A;B" or newline
 // ----------------------------------------------------------------------------
 {
-    return infix->name == ";" || infix->name == "\n";
+    return infix->name == xl_atom_semicolon || infix->name == xl_atom_newline;
 }
 
 
@@ -665,7 +745,7 @@ inline bool IsCommaList(Infix *infix)
 //    Check if the infix is a comma operator
 // ----------------------------------------------------------------------------
 {
-    return infix->name == ",";
+    return infix->name == xl_atom_comma;
 }
 
 
@@ -686,7 +766,7 @@ inline bool IsPatternCondition(Infix *infix)
 //   Check if an infix marks a condition
 // ----------------------------------------------------------------------------
 {
-    return infix->name == "when";
+    return infix->name == xl_atom_when;
 }
 
 
@@ -708,7 +788,7 @@ inline bool IsPatternMatchingType(Prefix *prefix)
 // ----------------------------------------------------------------------------
 {
     if (Name *matching = prefix->left->AsName())
-        if (matching->value == "matching")
+        if (matching->value == xl_atom_matching)
             return true;
     return false;
 }
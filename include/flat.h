@@ -0,0 +1,200 @@
+#ifndef FLAT_H
+#define FLAT_H
+// *****************************************************************************
+// flat.h                                                             XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Compact, read-only representation of parsed source trees
+//
+//     A flat tree stores all the nodes of a source in a single array,
+//     children before parents, so that each subtree occupies a contiguous
+//     range of nodes. Nodes refer to each other and to a shared text table
+//     by index. Regular Tree nodes are only built when a subtree is
+//     materialized, and they are built once per flat node. Comments are
+//     kept with the nodes they belong to, other info attached to the
+//     original trees is not preserved.
+//
+//     Since nodes only contain indexes, a flat tree can be written to a
+//     file and mapped back in memory to be used in place.
+//
+//     A flat tree built with sharing keeps a single node for a tree that
+//     is reachable from several parents, so that graphs such as scopes
+//     are rebuilt with the same structure. Subtrees are then no longer
+//     contiguous, and materialization starts from the first node. A tree
+//     can also be written as an alias, typically a name, so that it can be
+//     bound to an existing tree when reading.
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "base.h"
+#include "tree.h"
+#include "scanner.h"
+#include "parser.h"
+
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+
+XL_BEGIN
+
+struct FlatTree
+// ----------------------------------------------------------------------------
+//   A contiguous array of tree nodes, with lazy materialization
+// ----------------------------------------------------------------------------
+{
+    enum { NONE = ~0U };
+    enum { FLAT_MAGIC = 0x464C5458, FLAT_VERSION = 2 };
+    enum { SHARED = 1 };                // Header flags
+
+    struct Node
+    {
+        ulong           tag;            // Position and kind, as in Tree::tag
+        union
+        {
+            ulonglong   natural;        // NATURAL value
+            double      real;           // REAL value
+            uint        ref[3];         // Children and text indexes
+        };
+    };
+    // Layout of ref[] for the other kinds:
+    //    TEXT                  value, opening, closing (texts)
+    //    NAME                  value (text)
+    //    BLOCK                 child (node), opening, closing (texts)
+    //    PREFIX, POSTFIX       left, right (nodes)
+    //    INFIX                 left, right (nodes), name (text)
+
+    // File layout: Header, nodes, text references, comments, text data.
+    // Values are in native byte order, so a file written on a host with
+    // a different byte order is rejected because of the magic number.
+    struct Header
+    {
+        uint            magic;          // FLAT_MAGIC
+        uint            version;        // FLAT_VERSION
+        uint            nodes;          // Number of nodes
+        uint            texts;          // Number of texts
+        uint            root;           // Index of the root node
+        uint            source;         // Text index of the source file name
+        uint            comments;       // Number of comments
+        uint            flags;          // SHARED
+        ulonglong       textBytes;      // Size of the text data
+        ulonglong       sourceSize;     // Extent of positions in the source
+        ulonglong       stamp;          // Identifies what the image came from
+    };
+    struct TextRef
+    {
+        uint            offset;         // Offset in text data
+        uint            length;         // Length of the text
+    };
+    struct Comment
+    {
+        uint            node;           // Node the comment is attached to
+        uint            value;          // Text index of the comment
+        uint            after;          // Comes after the node if non-zero
+    };
+
+    typedef std::vector<Node>           Nodes;
+    typedef std::unordered_map<text, uint> TextIndex;
+    typedef std::vector<const text *>   Texts;  // Keys in the TextIndex
+    typedef std::vector<Tree_p>         Trees;
+    typedef std::vector<Comment>        Comments;
+    typedef std::unordered_map<Tree *, uint> Added;
+    typedef std::vector<Atom>           Atoms;
+
+public:
+    FlatTree(bool shared = false);
+    FlatTree(Tree *source, bool shared = false);
+    ~FlatTree();
+
+    // Building the flat tree
+    uint                Add(Tree *tree);
+    uint                AddText(const text &value);
+    uint                Alias(Tree *tree, Tree *as);
+
+    // Writing and reading the packed file format
+    bool                Write(std::ostream &out, Positions &positions,
+                              ulonglong stamp = 0);
+    ulonglong           Stamp()         { return header ? header->stamp : 0; }
+    static FlatTree *   Map(text file, Positions &positions);
+    static FlatTree *   Read(const text &image, Positions &positions);
+
+    // Materializing regular trees
+    Tree *              Materialize(uint node);
+    Tree *              Materialize()   { return Materialize(root); }
+    bool                IsMaterialized(uint node);
+    void                Bind(uint node, Tree *tree);
+
+    // Read-only access without materializing
+    uint                Root()                  { return root; }
+    void                SetRoot(uint n)         { root = n; }
+    kind                Kind(uint n);
+    TreePosition        Position(uint n);
+    uint                Left(uint n);
+    uint                Right(uint n);
+    text                Value(uint n);
+    uint                First(uint n);
+    bool                IsShared();
+
+    // Statistics
+    size_t              NodeCount();
+    size_t              TextCount();
+    size_t              CommentCount();
+    size_t              Size();
+
+private:
+    const Node &        At(uint n);
+    text                TextAt(uint t);
+    Atom                AtomAt(uint t);
+    const Comment *     CommentsAt(uint first);
+    void                AddComments(uint node, CommentsInfo *info);
+    bool                Attach(kstring image, size_t size, bool mapped);
+    void                Relocate(Positions &positions);
+
+private:
+    Nodes               nodes;
+    TextIndex           textIndex;
+    Texts               texts;
+    Trees               trees;
+    Atoms               atoms;          // Interned texts, built lazily
+    Comments            comments;       // Ordered by node
+    Added               added;          // Nodes for shared trees
+    bool                shared;
+    uint                root;
+
+    // When using a packed file image
+    kstring             image;
+    size_t              imageSize;
+    bool                mapped;         // Mapped from file, not allocated
+    const Header *      header;
+    const Node *        imageNodes;
+    const TextRef *     imageTexts;
+    const Comment *     imageComments;
+    kstring             imageData;
+    TreePosition        base;           // Offset added to image positions
+};
+
+XL_END
+
+RECORDER_DECLARE(flat);
+
+#endif // FLAT_H
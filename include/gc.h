@@ -15,6 +15,12 @@
 //     to a GCPtr by the next cycle are an error, which is flagged
 //     in debug mode.
 //
+//     When built with XL_DEFERRED_REFCOUNT, GCPtr does not update counts
+//     directly, but logs the updates in a per-thread log. A release that
+//     matches a recent acquire cancels it, which elides the counting for
+//     short-lived temporaries. The log is reconciled when it fills up,
+//     when the thread exits, and during garbage collection. Other threads
+//     must reconcile their log before the collector runs.
 //
 //
 // *****************************************************************************
@@ -97,6 +103,12 @@ struct TypeAllocator
     typedef volatile Chunk *Chunk_vp;
     typedef std::vector<Chunk_vp> Chunks;
 
+    struct Magazine
+    {
+        Chunk_vp            head;           // Free items cached by a thread
+        uint                count;          // Number of items in magazine
+    };
+
 public:
     TypeAllocator(kstring name, uint objectSize);
     virtual ~TypeAllocator();
@@ -110,16 +122,28 @@ public:
 
     static void         Acquire(void *ptr);
     static void         Release(void *ptr);
+    static void         IncrementCount(Chunk_vp chunk);
+    static uint         DecrementCount(Chunk_vp chunk);
     static uint         RefCount(void *ptr);
     static bool         IsGarbageCollected(void *ptr);
     static bool         IsAllocated(void *ptr);
     static void *       InUse(void *ptr);
     static void         UpdateInUseRange(Chunk_vp chunk);
     static void         ScheduleDelete(Chunk_vp);
-    bool                CheckLeakedPointers();
+    bool                CheckLeakedPointers(uint &budget);
     bool                Sweep();
+    uint                ReleaseFreeChunks();
     void                ResetStatistics();
 
+    Magazine *          ThreadMagazine();
+    void                RefillMagazine(Magazine &magazine);
+    void                FlushMagazine(Magazine &magazine, uint count);
+    static void         FlushThreadMagazines();
+#ifdef XL_DEFERRED_REFCOUNT
+    static void         ReconcileRefCounts();
+    static bool         PendingRefCounts();
+#endif // XL_DEFERRED_REFCOUNT
+
     void *operator new(size_t size) NEW_THROW;
     void operator delete(void *ptr);
 
@@ -131,6 +155,28 @@ public:
         ALLOCATED       = 0,            // Just allocated
         IN_USE          = 1             // Set if already marked this time
     };
+    enum MagazineSizes
+    {
+        MAGAZINE_BATCH  = 64,           // Items moved to/from shared list
+        MAX_MAGAZINES   = 64            // Allocators with per-thread cache
+    };
+    enum RefCountLogBits
+    {
+        LOG_SIZE        = 4096,         // Entries in RefCountLog
+        LOG_RELEASE     = 1,            // Entry is a release
+        LOG_WINDOW      = 8             // Entries searched to elide pairs
+    };
+
+#ifdef XL_DEFERRED_REFCOUNT
+    struct RefCountLog
+    {
+        uint                count;          // Number of logged updates
+        uintptr_t           entries[LOG_SIZE]; // Low bit for release
+    };
+#endif // XL_DEFERRED_REFCOUNT
+
+protected:
+    void                GrowFreeList();
 
 public:
     struct Listener
@@ -145,6 +191,9 @@ public:
     bool CanDelete(void *object);
 
 protected:
+#ifdef XL_DEFERRED_REFCOUNT
+    static thread_local RefCountLog refCountLog;
+#endif // XL_DEFERRED_REFCOUNT
     GarbageCollector *  gc;
     kstring             name;
     Atomic<uint>        locked;
@@ -157,6 +206,7 @@ protected:
     Atomic<uint>        available;
     Atomic<uint>        freedCount;
 
+    uint                index;
     uint                chunkSize;
     uint                objectSize;
     uint                alignedSize;
@@ -164,6 +214,13 @@ protected:
     uint                scannedCount;
     uint                collectedCount;
     uint                totalCount;
+    uint                releasedCount;  // Chunks returned to the system
+
+    char *              scanLow;        // In-use range for current scan
+    char *              scanHigh;
+    char *              scanNext;       // Where to resume the current scan
+    uint                scanChunk;
+    bool                scanning;
 
     friend struct GarbageCollector;
 
@@ -173,6 +230,7 @@ public:
     static void *       lowestAllocatorAddress;
     static void *       highestAllocatorAddress;
     static Atomic<uint> finalizing;
+    static bool         concurrent;     // Sweeper threads are running
 } __attribute__((aligned(16)));
 
 
@@ -324,6 +382,12 @@ struct GarbageCollector
     static bool                 Running()       { return gc->running; }
     static bool                 SafePoint();
     static bool                 Sweep();
+    static void                 StartSweepers();
+    static void                 StopSweepers();
+    static void                 StartThreads();
+    static void                 StopThreads();
+    static void                 MustSweep();
+    static void                 WakeSweepers();
 
     static void *               DebugPointer(void *ptr);
 
@@ -332,23 +396,32 @@ struct GarbageCollector
                                            uint &availableBytes,
                                            uint &freedBytes,
                                            uint &scannedBytes,
-                                           uint &collectedBytes);
+                                           uint &collectedBytes,
+                                           uint &releasedBytes);
     void                        PrintStatistics();
     void                        Register(TypeAllocator *a);
 
 private:
     // Collection happens at SafePoint, you can't trigger it manually.
-    bool                        Collect();
+    bool                        Collect(bool complete = false);
 
 private:
+    struct Sweeper;
     typedef std::vector<TypeAllocator *> Allocators;
     typedef TypeAllocator::Listeners     Listeners;
+    typedef std::vector<Sweeper *>       Sweepers;
 
     static GarbageCollector *   gc;
 
     Allocators                  allocators;
+    Sweepers                    sweepers;
     Atomic<uint>                mustRun;
+    Atomic<uint>                mustSweep;      // Deletions for sweepers
     Atomic<uint>                running;
+    uint                        scanIndex;      // Allocator being scanned
+    bool                        sweptInCycle;   // Objects freed this cycle
+
+    friend struct TypeAllocator;
 };
 
 
@@ -444,8 +517,16 @@ inline void TypeAllocator::Acquire(void *pointer)
         XL_ASSERT (((intptr_t) pointer & CHUNKALIGN_MASK) == 0);
         XL_ASSERT (IsAllocated(pointer));
 
+#ifdef XL_DEFERRED_REFCOUNT
+        // Log the increment, it will be applied by ReconcileRefCounts
+        RefCountLog &log = refCountLog;
+        if (log.count >= LOG_SIZE)
+            ReconcileRefCounts();
+        log.entries[log.count++] = (uintptr_t) pointer;
+#else
         Chunk_vp chunk = ((Chunk_vp) pointer) - 1;
-        ++chunk->count;
+        IncrementCount(chunk);
+#endif // XL_DEFERRED_REFCOUNT
     }
 }
 
@@ -461,15 +542,61 @@ inline void TypeAllocator::Release(void *pointer)
         XL_ASSERT (((intptr_t) pointer & CHUNKALIGN_MASK) == 0);
         XL_ASSERT (IsAllocated(pointer));
 
+#ifdef XL_DEFERRED_REFCOUNT
+        // A release matching a recent acquire cancels it, e.g. temporaries
+        RefCountLog &log = refCountLog;
+        uintptr_t *last = log.entries + log.count;
+        uintptr_t *first = log.entries;
+        if (log.count > LOG_WINDOW)
+            first = last - LOG_WINDOW;
+        for (uintptr_t *entry = last; entry > first; )
+        {
+            if (*--entry == (uintptr_t) pointer)
+            {
+                *entry = 0;
+                while (log.count && !log.entries[log.count-1])
+                    log.count--;
+                return;
+            }
+        }
+
+        // Otherwise, log the decrement
+        if (log.count >= LOG_SIZE)
+            ReconcileRefCounts();
+        log.entries[log.count++] = (uintptr_t) pointer | LOG_RELEASE;
+#else
         Chunk_vp chunk = ((Chunk_vp) pointer) - 1;
         XL_ASSERT(chunk->count);
-        uint count = --chunk->count;
-        if (!count)
+        if (!DecrementCount(chunk))
             ScheduleDelete(chunk);
+#endif // XL_DEFERRED_REFCOUNT
     }
 }
 
 
+inline void TypeAllocator::IncrementCount(Chunk_vp chunk)
+// ----------------------------------------------------------------------------
+//   Increment the reference count, atomically if sweeper threads run
+// ----------------------------------------------------------------------------
+{
+    if (concurrent)
+        Atomic<uint>::Add(chunk->count, 1);
+    else
+        ++chunk->count;
+}
+
+
+inline uint TypeAllocator::DecrementCount(Chunk_vp chunk)
+// ----------------------------------------------------------------------------
+//   Decrement the reference count and return the new count
+// ----------------------------------------------------------------------------
+{
+    if (concurrent)
+        return Atomic<uint>::Sub(chunk->count, 1) - 1;
+    return --chunk->count;
+}
+
+
 inline uint TypeAllocator::RefCount(void *pointer)
 // ----------------------------------------------------------------------------
 //   Return reference count for given pointer
@@ -632,9 +759,21 @@ inline bool GarbageCollector::SafePoint()
 {
     if (gc->mustRun)
         return gc->Collect();
+    if (gc->mustSweep)
+        WakeSweepers();
     return false;
 }
 
+
+inline void GarbageCollector::MustSweep()
+// ----------------------------------------------------------------------------
+//    Record that sweeper threads have work, they are woken at a safe point
+// ----------------------------------------------------------------------------
+{
+    if (!gc->mustSweep)
+        gc->mustSweep |= 1U;
+}
+
 XL_END
 
 #endif // GC_H
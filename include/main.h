@@ -60,6 +60,7 @@ XL_BEGIN
 
 struct Serializer;
 struct Deserializer;
+struct ModuleCache;
 struct Compiler;
 
 
@@ -111,7 +112,11 @@ struct Main
     int                 ParseOptions();
     int                 LoadFiles();
     virtual int         LoadFile(text file, text modname="");
+    Tree *              ParseFile(text file, Syntax &syntax, Errors &errors);
+    int                 LoadTree(text file, Tree *tree, text modname="");
     int                 Run();
+    bool                LoadSnapshot();
+    bool                SaveSnapshot(SourceFile &builtins);
 
     // Error checking
     void                Log(Error &e)   { errors->Log(e); }
@@ -146,6 +151,7 @@ public:
     source_names        file_names;
     Deserializer *      reader;
     Serializer   *      writer;
+    ModuleCache *       cache;
     Evaluator *         evaluator;
 };
 
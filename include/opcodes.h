@@ -401,7 +401,7 @@ XL_END
 #define XL_SCOPE        DataScope(data)
 #define XL_SELF         DataSelf(data)
 #define POSITION        (XL_SELF->Position())
-#define AS_INT(x)       (new Natural((x), POSITION))
+#define AS_INT(x)       (Natural::Make((x), POSITION))
 #define AS_REAL(x)      (new Real((x), POSITION))
 #define AS_BOOL(x)      ((x) ? xl_true : xl_false)
 #define AS_TEXT(x)      (new Text(x, POSITION))
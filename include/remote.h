@@ -47,10 +47,15 @@ const uint XL_DEFAULT_PORT = 1205;
 int     xl_tell(Scope *, text host, Tree *body);
 Tree_p  xl_ask(Scope *, text host, Tree *body);
 Tree_p  xl_invoke(Scope *, text host, Tree *body);
+ulong   xl_ask_async(Scope *, text host, Tree *body);
+Tree_p  xl_wait(Scope *, ulong handle);
+Tree_p  xl_wait_all(Scope *, Tree *handles);
+ulong   xl_wait_any(Scope *, Tree *handles);
 int     xl_reply(Scope *, Tree *body);
 Tree_p  xl_listen_received();
 Tree_p  xl_listen_hook(Tree *body);
 int     xl_listen(Scope *, uint forking, uint port = XL_DEFAULT_PORT);
+int     xl_listen_pool(Scope *, uint workers, uint port = XL_DEFAULT_PORT);
 
 XL_END
 
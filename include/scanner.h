@@ -8,8 +8,8 @@
 //
 //     Interface for the XL scanner
 //
-//
-//
+//     The scanner works on a memory buffer holding the whole input, which
+//     is mapped directly from source files when possible.
 //
 //
 //
@@ -106,6 +106,7 @@
 */
 
 #include "base.h"
+#include "atomic.h"
 #include <recorder/recorder.h>
 #include <string>
 #include <vector>
@@ -151,11 +152,17 @@ struct Positions
 // ----------------------------------------------------------------------------
 //    Records the positions of various scanners
 // ----------------------------------------------------------------------------
+//    Each file reserves a range for its size when opened, so that files
+//    can be scanned concurrently by different threads. Files are kept in
+//    an append-only table ordered by position, which is searched without
+//    locking. Each file has an index of line starts, built from the data
+//    being scanned, or by reading the file the first time it is needed.
 {
-                        Positions(): positions(), current_position(0) {}
-                        ~Positions() {}
+                        Positions();
+                        ~Positions();
 
-    ulong               OpenFile(text name);
+    ulong               OpenFile(text name, ulong size = 0,
+                                 kstring data = nullptr);
     void                CloseFile (ulong pos);
 
     void                GetFile(ulong pos, text *file, ulong *offset);
@@ -163,14 +170,33 @@ struct Positions
                                 ulong *column, text *source);
 
 private:
-    struct Range
+    struct Lines
     {
-        Range(ulong s, text f): start(s), file(f) {}
-        ulong   start;
-        text    file;
+        std::vector<uint>       starts; // Offset of lines after the first
+        ulong                   size;   // Size of the file
     };
-    std::vector<Range>  positions;
-    ulong               current_position;
+    struct File
+    {
+        File(text name, ulong size, Lines *lines)
+            : start(0), size(size), name(name), lines(lines) {}
+        ~File()                 { delete lines.Get(); }
+        ulong                   start;
+        ulong                   size;
+        text                    name;
+        Atomic<Lines *>         lines;
+    };
+    typedef Atomic<File *>      Slot;
+    enum { FIRST_SEGMENT = 64, SEGMENTS = 32 };
+
+    Slot *              SlotAt(uint index, bool create = false);
+    File *              Find(ulong pos);
+    Lines *             LinesOf(File *file);
+    static Lines *      LineStarts(kstring data, ulong size);
+
+private:
+    Atomic<Slot *>      segments[SEGMENTS]; // Each twice the previous one
+    Atomic<uint>        count;              // Number of published files
+    Atomic<ulong>       closed;             // Highest position closed
 };
 
 
@@ -203,7 +229,7 @@ public:
 
     // Access to location information
     uint        Indent()                { return indent; }
-    void        SetPosition(ulong pos)  { position = pos; }
+    void        SetPosition(ulong pos);
     ulong       Position()              { return position; }
     bool        HadSpaceBefore()        { return hadSpaceBefore; }
     bool        HadSpaceAfter()         { return hadSpaceAfter; }
@@ -213,14 +239,25 @@ public:
     void        CloseParen(uint old);
 
     // Get input of the scanner
-    std::istream & Input()              { return input; }
     Positions    & InputPositions()     { return positions; }
     Errors       & InputErrors()        { return errors; }
     Syntax       & InputSyntax()        { return syntax; }
 
+private:
+    // Reading the input buffer
+    int            Get();
+    void           Unget();
+    int            Peek();
+    void           ReadStream(std::istream &input);
+    bool           MapFile(kstring name);
+
 private:
     Syntax &       syntax;
-    std::istream & input;
+    kstring        cursor;          // Next character in the input buffer
+    kstring        limit;           // End of the input buffer
+    text           contents;        // Input buffer when read from a stream
+    size_t         mappedSize;      // Size of the input if the file is mapped
+    bool           hitEOF;          // Tried to read past the end of input
     text           tokenText;
     text           textValue;
     double         realValue;
@@ -238,7 +275,6 @@ private:
     bool           settingIndent;
     bool           hadSpaceBefore;
     bool           hadSpaceAfter;
-    bool           mustDeleteInput;
 };
 
 XL_END
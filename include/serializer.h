@@ -8,8 +8,9 @@
 //
 //     A couple of classes used to serialize and read-back XL trees
 //
-//
-//
+//     Both can work on a stream or directly on memory. The serializer
+//     builds its output in a buffer, which is written to the stream in
+//     large chunks. The deserializer reads bytes from memory when possible.
 //
 //
 //
@@ -41,6 +42,8 @@
 #include "tree.h"
 #include "action.h"
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
 
 XL_BEGIN
@@ -61,19 +64,21 @@ enum SerializationTag
 };
 
 
-typedef std::map<text, longlong>        text_map;
-typedef std::map<longlong, text>        text_ids;
+typedef std::unordered_map<text, longlong> text_map;
+typedef std::vector<text>               text_ids;       // Index is id - 1
 
 
 struct Serializer
 // ----------------------------------------------------------------------------
-//    Serialize a tree to a stream
+//    Serialize a tree to a stream or to a memory buffer
 // ----------------------------------------------------------------------------
 {
     typedef Tree *value_type;
+    enum { FLUSH_SIZE = 64 * 1024 };    // Size of chunks written to stream
 
     Serializer(std::ostream &out);
-    ~Serializer() {}
+    Serializer(text &buffer);
+    ~Serializer() { Flush(); }
 
     // Serialization of the canonical nodes
     Tree *      Do(Natural *what);
@@ -87,24 +92,32 @@ struct Serializer
     Tree *      DoChild(Tree *child);
     Tree *      Do(Tree *what);
 
-    bool        IsValid()       { return out.good(); }
+    bool        IsValid()       { return !out || out->good(); }
+    void        Flush();
 
     static void Write(std::ostream &out, Tree *tree)
     {
         Serializer s(out);
         tree->Do(s);
     }
+    static void Write(text &buffer, Tree *tree)
+    {
+        Serializer s(buffer);
+        tree->Do(s);
+    }
 
 public:
     // Writing data (low level)
     void        WriteSigned(longlong);
     void        WriteUnsigned(ulonglong);
     void        WriteReal(double);
-    void        WriteText(text);
+    void        WriteText(const text &);
     void        WriteChild(Tree *child);
 
 protected:
-    std::ostream &      out;
+    std::ostream *      out;            // Null when writing to memory only
+    text                local;          // Buffer when writing to a stream
+    text &              buffer;
     text_map            texts;
 };
 
@@ -115,17 +128,23 @@ struct Deserializer
 // ----------------------------------------------------------------------------
 {
     Deserializer(std::istream &in, TreePosition pos = Tree::NOWHERE);
+    Deserializer(kstring data, size_t size, TreePosition pos = Tree::NOWHERE);
     ~Deserializer();
 
     // Deserialize a tree from the input and return it, or return NULL
     Tree *      ReadTree();
-    bool        IsValid()       { return in.good(); }
+    bool        IsValid()       { return valid; }
 
     static Tree *Read(std::istream &in)
     {
         Deserializer d(in);
         return d.ReadTree();
     }
+    static Tree *Read(kstring data, size_t size)
+    {
+        Deserializer d(data, size);
+        return d.ReadTree();
+    }
 
 public:
     // Reading low-level data
@@ -135,7 +154,19 @@ public:
     text        ReadText();
 
 protected:
-    std::istream &      in;
+    byte        ReadByte()
+    {
+        if (next < last)
+            return *next++;
+        return ReadByteFromStream();
+    }
+    byte        ReadByteFromStream();
+
+protected:
+    std::istream *      in;             // Null when reading from memory
+    const byte *        next;           // Next byte to read from memory
+    const byte *        last;           // End of the memory being read
+    bool                valid;
     TreePosition        pos;
     text_ids            texts;
 };
@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+// *****************************************************************************
+// snapshot.h                                                         XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Snapshot of the global scope once builtins have been loaded
+//
+//     A snapshot records the scope where builtins were evaluated and the
+//     builtins source. Restoring it replaces loading builtins.xl and
+//     processing its declarations. Opcodes are still entered as usual,
+//     in the scope that encloses the restored one. Trees that the runtime
+//     knows by address, such as 'nil' or 'natural', are bound back to
+//     the existing globals by name.
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "base.h"
+#include "tree.h"
+#include "scanner.h"
+#include "context.h"
+
+
+XL_BEGIN
+
+struct Snapshot
+// ----------------------------------------------------------------------------
+//   Write and restore the global scope
+// ----------------------------------------------------------------------------
+{
+    static bool         Write(text file, ulonglong stamp, Positions &positions,
+                              Scope *scope, Tree *source);
+    static bool         Read(text file, ulonglong stamp, Positions &positions,
+                             Scope *parent, Scope_p &scope, Tree_p &source);
+    static ulonglong    Stamp(text builtins);
+};
+
+XL_END
+
+RECORDER_DECLARE(snapshot);
+
+#endif // SNAPSHOT_H
@@ -40,6 +40,7 @@
 // *****************************************************************************
 
 #include "base.h"
+#include "atom.h"
 #include "gc.h"
 #include "info.h"
 #include <map>
@@ -221,6 +222,10 @@ struct Natural : Tree
     value_t  value;
     operator value_t()         { return value; }
 
+    // Computed values, shared between callers for small values
+    enum { SMALL_NEGATIVE = 128, SMALL_COUNT = 1024 + SMALL_NEGATIVE };
+    static Natural *    Make(value_t i, TreePosition pos = NOWHERE);
+
     GARBAGE_COLLECT(Natural);
 };
 
@@ -252,7 +257,7 @@ struct Text : Tree
     typedef Text self_t;
     typedef text value_t;
 
-    Text(value_t t, text open="\"", text close="\"", TreePosition pos=NOWHERE):
+    Text(value_t t, Atom open="\"", Atom close="\"", TreePosition pos=NOWHERE):
         Tree(TEXT, pos), value(t), opening(open), closing(close) {}
     Text(value_t t, TreePosition pos):
         Tree(TEXT, pos), value(t), opening(textQuote), closing(textQuote) {}
@@ -260,8 +265,8 @@ struct Text : Tree
         Tree(TEXT, t),
         value(t->value), opening(t->opening), closing(t->closing) {}
     value_t             value;
-    text                opening, closing;
-    static text         textQuote, charQuote;
+    Atom                opening, closing;
+    static Atom         textQuote, charQuote;
     operator value_t()  { return value; }
     bool IsCharacter()  { return (opening == "'" &&
                                   closing == "'" &&
@@ -278,7 +283,7 @@ struct Name : Tree
 {
     static const kind KIND = NAME;
     typedef Name self_t;
-    typedef text value_t;
+    typedef Atom value_t;
 
     Name(value_t n, TreePosition pos = NOWHERE):
         Tree(NAME, pos), value(n) {}
@@ -310,7 +315,7 @@ struct Block : Tree
     typedef Block       self_t;
     typedef Block *     value_t;
 
-    Block(Tree *c, text open, text close, TreePosition pos = NOWHERE):
+    Block(Tree *c, Atom open, Atom close, TreePosition pos = NOWHERE):
         Tree(BLOCK, pos), child(c), opening(open), closing(close) {}
     Block(Block *b, Tree *ch):
         Tree(BLOCK, b),
@@ -330,8 +335,8 @@ struct Block : Tree
         return nullptr;
     }
     Tree_p              child;
-    text                opening, closing;
-    static text         indent, unindent;
+    Atom                opening, closing;
+    static Atom         indent, unindent;
     GARBAGE_COLLECT(Block);
 };
 
@@ -383,14 +388,14 @@ struct Infix : Tree
     typedef Infix       self_t;
     typedef Infix *     value_t;
 
-    Infix(text n, Tree *l, Tree *r, TreePosition pos = NOWHERE):
+    Infix(Atom n, Tree *l, Tree *r, TreePosition pos = NOWHERE):
         Tree(INFIX, pos), left(l), right(r), name(n) {}
     Infix(Infix *i, Tree *l, Tree *r):
         Tree(INFIX, i), left(l), right(r), name(i->name) {}
     Infix *             LastStatement(text sep1 = ";", text sep2 = "\n");
     Tree_p              left;
     Tree_p              right;
-    text                name;
+    Atom                name;
     GARBAGE_COLLECT(Infix);
 };
 
@@ -0,0 +1,139 @@
+// *****************************************************************************
+// atom.cpp                                                           XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Interned text for names and operators
+//
+//     The table is shared by all threads and never shrinks: the set of
+//     distinct names and operators in a program is small compared to the
+//     number of trees that refer to them.
+//
+//
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "atom.h"
+
+#include <unordered_map>
+#include <pthread.h>
+
+
+XL_BEGIN
+
+struct AtomTable
+// ----------------------------------------------------------------------------
+//   The global table of interned texts
+// ----------------------------------------------------------------------------
+{
+    typedef std::unordered_map<text, ulong> map_t;
+
+    AtomTable()  { pthread_mutex_init(&lock, nullptr); }
+    ~AtomTable() { pthread_mutex_destroy(&lock); }
+
+    map_t               atoms;
+    pthread_mutex_t     lock;
+};
+
+
+static AtomTable &Atoms()
+// ----------------------------------------------------------------------------
+//   Return the table, built on first use so that static atoms can use it
+// ----------------------------------------------------------------------------
+{
+    static AtomTable *table = new AtomTable;
+    return *table;
+}
+
+
+ulong Atom::Hash(const text &t)
+// ----------------------------------------------------------------------------
+//   Hash the whole text (FNV-1a)
+// ----------------------------------------------------------------------------
+{
+    ulong h = 0xCBF29CE484222325UL;
+    for (char c : t)
+        h = (h ^ (uchar) c) * 0x100000001B3UL;
+    return h;
+}
+
+
+const Atom::Entry *Atom::Intern(const text &t)
+// ----------------------------------------------------------------------------
+//   Return the unique entry for the given text, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    AtomTable &table = Atoms();
+    pthread_mutex_lock(&table.lock);
+    AtomTable::map_t::iterator found = table.atoms.find(t);
+    if (found == table.atoms.end())
+        found = table.atoms.emplace(t, Hash(t)).first;
+    const Entry *result = &*found;
+    pthread_mutex_unlock(&table.lock);
+    return result;
+}
+
+
+const Atom::Entry *Atom::Empty()
+// ----------------------------------------------------------------------------
+//   Return the entry for the empty text, so that default atoms are cheap
+// ----------------------------------------------------------------------------
+{
+    static const Entry *empty = Intern(text());
+    return empty;
+}
+
+
+size_t Atom::Count()
+// ----------------------------------------------------------------------------
+//   Return the number of distinct atoms
+// ----------------------------------------------------------------------------
+{
+    AtomTable &table = Atoms();
+    pthread_mutex_lock(&table.lock);
+    size_t result = table.atoms.size();
+    pthread_mutex_unlock(&table.lock);
+    return result;
+}
+
+
+
+// ============================================================================
+//
+//    Frequently used atoms
+//
+// ============================================================================
+
+const Atom xl_atom_semicolon    = ";";
+const Atom xl_atom_newline      = "\n";
+const Atom xl_atom_is           = "is";
+const Atom xl_atom_as           = "as";
+const Atom xl_atom_colon        = ":";
+const Atom xl_atom_assign       = ":=";
+const Atom xl_atom_comma        = ",";
+const Atom xl_atom_dot          = ".";
+const Atom xl_atom_when         = "when";
+const Atom xl_atom_matching     = "matching";
+
+XL_END
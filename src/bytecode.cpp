@@ -40,6 +40,7 @@
 #include "errors.h"
 #include "basics.h"
 #include "runtime.h"
+#include "options.h"
 
 #include <algorithm>
 #include <sstream>
@@ -47,10 +48,27 @@
 
 RECORDER(bytecode_output, 64, "Output of the bytecode generator");
 RECORDER(bytecode, 64, "Byte code generation");
+RECORDER(bytecode_code, 16, "Dump bytecode: 1=before, 2=after optimization");
 
 
 XL_BEGIN
 
+// ============================================================================
+//
+//   Options
+//
+// ============================================================================
+
+namespace Opt
+{
+NaturalOption   bytecodeOpt("bytecode_opt",
+                            "Bytecode optimization level "
+                            "(0=none, 1=peephole, 2=superinstructions)",
+                            2, 0, 2);
+}
+
+
+
 // ============================================================================
 //
 //    Main entry point
@@ -72,14 +90,21 @@ Tree *Bytecode::Evaluate(Scope *scope, Tree *what)
     {
         XL_ASSERT(proc->Inputs() == 0);
         uint size = captured.size();
-        captured.push_back(what);
-        captured.push_back(scope);
-        Data data = &captured[size];
+        Frame frame(size + 2);
+        Data data = frame;
+        for (uint c = 0; c < size; c++)
+            *data++ = captured[c];
+        data[0] = what;
+        data[1] = scope;
         Op *op = proc;
         while(op)
             op = op->Run(data);
         result = DataResult(data);
     }
+
+    // This is a safe point for checking collection status
+    GarbageCollector::SafePoint();
+
     return result;
 }
 
@@ -106,6 +131,168 @@ Procedure *Bytecode::Compile(Context *ctx, Tree *what, Tree *type,
 
 
 
+// ============================================================================
+//
+//    Frame stack
+//
+// ============================================================================
+
+struct FrameRoots : TypeAllocator::Listener
+// ----------------------------------------------------------------------------
+//   Keep trees referenced from live frames during garbage collection
+// ----------------------------------------------------------------------------
+//   Frame slots do not hold a reference count. During a collection,
+//   trees in live frames are recorded as roots and cannot be deleted.
+//   Once the collection completes, they are marked in use again so that
+//   releasing their last counted reference does not free them.
+{
+    typedef std::set<FrameStack *> Stacks;
+
+    FrameRoots(): stacks(), roots(), locked(0) {}
+
+    virtual void BeginCollection()
+    {
+        Lock();
+        for (Stacks::iterator s = stacks.begin(); s != stacks.end(); s++)
+            (*s)->Roots(roots);
+        Unlock();
+        record(bytecode, "Frame roots %u", (uint) roots.size());
+    }
+
+    virtual bool CanDelete(void *obj)
+    {
+        return roots.find((Tree *) obj) == roots.end();
+    }
+
+    virtual void EndCollection()
+    {
+        std::set<Tree *>::iterator r;
+        for (r = roots.begin(); r != roots.end(); r++)
+            TypeAllocator::InUse(*r);
+        roots.clear();
+    }
+
+    void Register(FrameStack *stack)
+    {
+        Lock();
+        stacks.insert(stack);
+        Unlock();
+    }
+
+    void Unregister(FrameStack *stack)
+    {
+        Lock();
+        stacks.erase(stack);
+        Unlock();
+    }
+
+    void Lock()         { while (locked++) locked--; }
+    void Unlock()       { locked--; }
+
+    static FrameRoots *Singleton()
+    {
+        static FrameRoots *roots = nullptr;
+        if (!roots)
+        {
+            roots = new FrameRoots;
+            Allocator<Natural>::CreateSingleton()->AddListener(roots);
+            Allocator<Real>   ::CreateSingleton()->AddListener(roots);
+            Allocator<Text>   ::CreateSingleton()->AddListener(roots);
+            Allocator<Name>   ::CreateSingleton()->AddListener(roots);
+            Allocator<Block>  ::CreateSingleton()->AddListener(roots);
+            Allocator<Prefix> ::CreateSingleton()->AddListener(roots);
+            Allocator<Postfix>::CreateSingleton()->AddListener(roots);
+            Allocator<Infix>  ::CreateSingleton()->AddListener(roots);
+        }
+        return roots;
+    }
+
+    Stacks              stacks;
+    std::set<Tree *>    roots;
+    Atomic<uint>        locked;
+};
+
+
+FrameStack::FrameStack()
+// ----------------------------------------------------------------------------
+//   Create a frame stack with an initial block and register it as roots
+// ----------------------------------------------------------------------------
+    : blocks(), current(0)
+{
+    FrameSlot *base = new FrameSlot[BLOCK_SLOTS];
+    Block block = { base, base, base + BLOCK_SLOTS };
+    blocks.push_back(block);
+    FrameRoots::Singleton()->Register(this);
+}
+
+
+FrameStack::~FrameStack()
+// ----------------------------------------------------------------------------
+//   Unregister the stack and release its blocks
+// ----------------------------------------------------------------------------
+{
+    FrameRoots::Singleton()->Unregister(this);
+    for (Blocks::iterator b = blocks.begin(); b != blocks.end(); b++)
+        delete[] (*b).base;
+}
+
+
+FrameStack &FrameStack::Current()
+// ----------------------------------------------------------------------------
+//   Return the frame stack for the current thread
+// ----------------------------------------------------------------------------
+{
+    static thread_local FrameStack stack;
+    return stack;
+}
+
+
+Data FrameStack::Grow(uint size)
+// ----------------------------------------------------------------------------
+//   Move to the next block when the current one is full
+// ----------------------------------------------------------------------------
+{
+    current++;
+    if (current < blocks.size())
+    {
+        // Reuse the next block if it is large enough
+        Block &next = blocks[current];
+        if (next.limit - next.base < (ptrdiff_t) size)
+        {
+            for (uint b = current; b < blocks.size(); b++)
+                delete[] blocks[b].base;
+            blocks.resize(current);
+        }
+    }
+    if (current >= blocks.size())
+    {
+        uint slots = size > BLOCK_SLOTS ? size : (uint) BLOCK_SLOTS;
+        FrameSlot *base = new FrameSlot[slots];
+        Block block = { base, base, base + slots };
+        blocks.push_back(block);
+        record(bytecode, "Frame stack %p grows to %u blocks",
+               this, (uint) blocks.size());
+    }
+    return Push(size);
+}
+
+
+void FrameStack::Roots(std::set<Tree *> &roots)
+// ----------------------------------------------------------------------------
+//   Record all the trees referenced from live frames
+// ----------------------------------------------------------------------------
+{
+    for (uint b = 0; b <= current; b++)
+    {
+        Block &block = blocks[b];
+        for (FrameSlot *slot = block.base; slot < block.top; slot++)
+            if (slot->tree)
+                roots.insert(slot->tree);
+    }
+}
+
+
+
 // ============================================================================
 //
 //    Opcodes we use in this translation
@@ -356,12 +543,13 @@ struct CallOp : Op
 // ----------------------------------------------------------------------------
 {
     CallOp(Code *target, uint outId, ParmOrder &parms)
-        : target(target), outId(outId), parms(parms) {}
+        : target(target), outId(outId), parms(parms), constants() {}
     Code  *     target;
     int         outId;
     ParmOrder   parms;
+    TreeList    constants;      // Known constant arguments, set by optimizer
 
-    virtual Op *Run(Data data)
+    Op *Invoke(Data data)
     {
         uint sz = parms.size();
         Data out = data + outId;
@@ -371,10 +559,21 @@ struct CallOp : Op
         DataScope (out, DataScope (data));
 
         // Copy all parameters
-        for (uint p = 0; p < sz; p++)
+        if (constants.size())
         {
-            int parmId = parms[p];
-            out[~p] = data[parmId];
+            for (uint p = 0; p < sz; p++)
+            {
+                Tree *constant = constants[p];
+                out[~p] = constant ? constant : (Tree *) data[parms[p]];
+            }
+        }
+        else
+        {
+            for (uint p = 0; p < sz; p++)
+            {
+                int parmId = parms[p];
+                out[~p] = data[parmId];
+            }
         }
         Op *remaining = target->Run(out);
         XL_ASSERT(!remaining);
@@ -382,16 +581,29 @@ struct CallOp : Op
             return remaining;
 
         DataResult(data, out[0]);
+        return nullptr;
+    }
+
+    virtual Op *Run(Data data)
+    {
+        if (Op *remaining = Invoke(data))
+            return remaining;
         return success;
     }
 
-    virtual kstring     OpID()  { return "call"; }
+    virtual kstring     OpID()  { return constants.size() ? "callk" : "call"; }
     virtual void        Dump(std::ostream &out)
     {
         out << OpID() << "\t" << Code::Ref(target, "\t", "code", "null")
             << "\t(";
         for (uint a = 0; a < parms.size(); a++)
-            out << (a ? "," : "") << parms[a];
+        {
+            out << (a ? "," : "");
+            if (a < constants.size() && constants[a])
+                out << constants[a];
+            else
+                out << parms[a];
+        }
         out << ") @ " << outId;
     }
 };
@@ -447,7 +659,10 @@ struct IndexOp : FailOp
             if (inputs == 0)
             {
                 // If no arguments, evaluate as new callee
-                Tree_p args[2] = { data[0], data[1] };
+                Frame frame(2);
+                Data args = frame;
+                args[0] = data[0];
+                args[1] = data[1];
                 Op *remaining = code->Run(args);
                 XL_ASSERT(!remaining);
                 if (remaining)
@@ -457,7 +672,11 @@ struct IndexOp : FailOp
             else if (inputs == 1)
             {
                 // Looks like a prefix, use it as an argument
-                Tree_p args[3] = { arg, data[0], data[1] };
+                Frame frame(3);
+                Data args = frame;
+                args[0] = arg;
+                args[1] = data[0];
+                args[2] = data[1];
                 Op *remaining = code->Run(&args[1]);
                 XL_ASSERT(!remaining);
                 if (remaining)
@@ -571,18 +790,21 @@ Code::Code(Context *ctx, Tree *self)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(ctx), self(self), ops(nullptr), instrs()
-{}
+    : context(ctx), self(self), ops(nullptr), instrs(), code(), entry(0)
+{
+    Linearize();
+}
 
 
 Code::Code(Context *context, Tree *self, Op *ops)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(context), self(self), ops(ops), instrs()
+    : context(context), self(self), ops(ops), instrs(), code(), entry(0)
 {
     for (Op *op = ops; op; op = op->success)
         instrs.push_back(op);
+    Linearize();
 }
 
 
@@ -607,34 +829,14 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
     XL_ASSERT(instrs.size() == 0);
     std::swap(instrs, *instrsToTakeOver);
 
-    // A few post-generation optimizations:
+    // Make sure calls all use the same out area
     uint max = instrs.size();
     for (uint i = 0; i < max; i++)
-    {
-        Op *op = instrs[i];
-
-        // Make sure calls all use the same out area
-        if (CallOp *call = dynamic_cast<CallOp *>(op))
+        if (CallOp *call = dynamic_cast<CallOp *>(instrs[i]))
             call->outId = outId;
 
-        // Remove labels, since they execute as no-ops
-        while (LabelOp *label = dynamic_cast<LabelOp *>(op->success))
-            op->success = label->success;
-        if (FailOp *fop = dynamic_cast<FailOp *>(op))
-            while (LabelOp *label = dynamic_cast<LabelOp *>(fop->fail))
-                fop->fail = label->success;
-    }
-    for (uint i = 0; i < max; i++)
-    {
-        Op *op = instrs[i];
-        if (LabelOp *label = dynamic_cast<LabelOp *>(op))
-        {
-            instrs.erase(instrs.begin() + i);
-            --i;
-            --max;
-            delete label;
-        }
-    }
+    // Build the flat representation we will actually run
+    Linearize();
 }
 
 
@@ -649,9 +851,7 @@ Op *Code::Run(Data data)
     data[1] = scope;
 
     // Run all instructions we have in that code
-    Op *op = ops;
-    while (op)
-        op = op->Run(data);
+    Execute(data, entry);
 
     // We were successful
     return success;
@@ -669,6 +869,7 @@ void Code::Dump(std::ostream &out)
     out << "\talloc"
         << "\tI" << Inputs() << " L" << Locals() << "\n";
     Dump(out, ops, instrs);
+    Dump(out, entry, code);
 }
 
 
@@ -742,6 +943,8 @@ Procedure::Procedure(Procedure *original, Data data, ParmOrder &capture)
 {
     // We have no instrs, so we don't "own" the instructions
     ops = original->ops;
+    code = original->code;
+    entry = original->entry;
 
     // Copy data in the closure from current data
     uint max = capture.size();
@@ -768,10 +971,9 @@ Op *Procedure::Run(Data data)
 // ----------------------------------------------------------------------------
 {
     Scope *scope     = context->Symbols();
-    uint   frameSize = FrameSize();
     uint   offset    = OffsetSize();
-    Data   frame     = new Tree_p[frameSize];
-    Data   newData   = frame + offset;
+    Frame  frame(FrameSize());
+    Data   newData   = (Data) frame + offset;
 
     // Initialize self and scope
     newData[0] = self;
@@ -786,25 +988,16 @@ Op *Procedure::Run(Data data)
 
     // Copy closure data if any
     uint closures = Closures();
-    if (closures)
-    {
-        Data carg = ClosureData();
-        for (uint c = 0; c < closures; c++)
-            *oarg-- = *carg++;
-    }
+    for (uint c = 0; c < closures; c++)
+        *oarg-- = captured[c];
 
     // Execute the following instructions in the newly created data context
-    Op *op = ops;
-    while (op)
-        op = op->Run(newData);
+    Execute(newData, entry);
 
     // Copy result and current context to the old data
     Tree *result = DataResult(newData);
     DataResult(data, result);
 
-    // Destroy the frame, we no longer need it
-    delete[] frame;
-
     // Evaluate next instruction
     return success;
 }
@@ -821,6 +1014,7 @@ void Procedure::Dump(std::ostream &out)
     out << "\talloc"
         << "\tI" << Inputs() << " L" << Locals() << " C" << Closures() << "\n";
     Code::Dump(out, ops, instrs);
+    Code::Dump(out, entry, code);
 }
 
 
@@ -841,7 +1035,7 @@ CodeBuilder::CodeBuilder(TreeList &captured)
       test(nullptr), resultType(nullptr),
       context(nullptr), parmsCtx(nullptr), argsCtx(nullptr),
       failOp(nullptr), successOp(nullptr),
-      instrs(), subexprs(), parms(), defer(false)
+      instrs(), subexprs(), parms(), opcodeIDs(), defer(false)
 {}
 
 
@@ -1132,6 +1326,9 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
         XL_ASSERT(!opcode->success);
         Opcode *clone = opcode->Clone();
         clone->SetParms(builder->parms);
+        builder->opcodeIDs.insert(builder->opcodeIDs.end(),
+                                  builder->parms.begin(),
+                                  builder->parms.end());
         builder->Add(clone);
         record(bytecode,
                "Compile %d:%d (%t) OPCODE %O SELF",
@@ -1196,6 +1393,14 @@ Procedure *CodeBuilder::Compile(Context *ctx, Tree *what,
     if (type)
         AddTypeCheck(ctx, what, type);
 
+    // Optimize the generated code
+    if (RECORDER_TRACE(bytecode_code) & 1)
+    {
+        std::cerr << "Unoptimized bytecode for " << what << ":\n";
+        Code::Dump(std::cerr, ops, instrs);
+    }
+    Optimize();
+
     // The generated code takes over the instructions in all cases
     proc->SetOps(&ops, &instrs, nEvals + nParms);
     if (result)
@@ -1206,6 +1411,11 @@ Procedure *CodeBuilder::Compile(Context *ctx, Tree *what,
         proc->captured = captured;
 
         record(bytecode_output, "Code %t: %O", what, (Op *) proc);
+        if (RECORDER_TRACE(bytecode_code) & 2)
+        {
+            std::cerr << "Optimized bytecode for " << what << ":\n";
+            proc->Dump(std::cerr);
+        }
 
         return proc;
     }
@@ -1432,10 +1642,10 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
         case INFIX:
         {
             Infix *infix = (Infix *) (Tree *) what;
-            text name = infix->name;
+            Atom name = infix->name;
 
             // Check sequences
-            if (name == ";" || name == "\n")
+            if (name == xl_atom_semicolon || name == xl_atom_newline)
             {
                 // Sequences: evaluate left, then right
                 if (!Instructions(ctx, infix->left))
@@ -1445,7 +1655,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             }
 
             // Check declarations
-            if (name == "is")
+            if (name == xl_atom_is)
             {
                 // Declarations evaluate last non-declaration result, or self
                 InstructionsSuccess(saveEvals.saved.size());
@@ -1453,7 +1663,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             }
 
             // Check scoped reference
-            if (name == ".")
+            if (name == xl_atom_dot)
             {
                 if (!Instructions(ctx, infix->left))
                     return false;
@@ -1989,7 +2199,7 @@ CodeBuilder::strength CodeBuilder::Do(Infix *what)
     Save<Context_p> saveContext(context, context);
 
     // Check if we have typed arguments, e.g. X:natural
-    if (what->name == ":")
+    if (what->name == xl_atom_colon)
     {
         Name *name = what->left->AsName();
         if (!name)
@@ -2035,7 +2245,7 @@ CodeBuilder::strength CodeBuilder::Do(Infix *what)
     }
 
     // Check if we have typed declarations, e.g. X+Y as natural
-    if (what->name == "as")
+    if (what->name == xl_atom_as)
     {
         if (resultType)
         {
@@ -2047,7 +2257,7 @@ CodeBuilder::strength CodeBuilder::Do(Infix *what)
     }
 
     // Check if we have a guard clause
-    if (what->name == "when")
+    if (what->name == xl_atom_when)
     {
         // It must pass the rest (need to bind values first)
         if (what->left->Do(this) == NEVER)
@@ -2136,6 +2346,895 @@ int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
     return parmId;
 }
 
+
+
+// ============================================================================
+//
+//    Superinstructions generated by the optimizer
+//
+// ============================================================================
+
+struct ConstStoreOp : Op
+// ----------------------------------------------------------------------------
+//   A constant immediately stored in a local value
+// ----------------------------------------------------------------------------
+{
+    ConstStoreOp(ConstOp *cst, StoreOp *store)
+        : value(cst->value), id(store->id) {}
+    Tree_p value;
+    int    id;
+
+    virtual Op *        Run(Data data)
+    {
+        DataResult(data, value);
+        data[id] = value;
+        return success;
+    }
+    virtual kstring     OpID()  { return "const+store"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << "\t" << value;
+    }
+};
+
+
+struct EvalTypeCheckOp : EvalOp
+// ----------------------------------------------------------------------------
+//   Evaluate a value once, then check its type
+// ----------------------------------------------------------------------------
+{
+    EvalTypeCheckOp(EvalOp *eval, TypeCheckOp *tc)
+        : EvalOp(eval->id, eval->ops, eval->fail), type(tc->type) {}
+    int type;
+
+    virtual Op *        Run(Data data)
+    {
+        EvalOp::Run(data);
+        if (!DataResult(data))
+            return fail;
+        Scope *scope = DataScope(data);
+        Tree *cast = xl_typecheck(scope, data[type], data[id]);
+        if (!cast)
+            return fail;
+        DataResult(data, cast);
+        return success;
+    }
+
+    virtual kstring     OpID()          { return "eval+typechk"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << ":" << type << "\t"
+            << Code::Ref(ops, "\t", "code", "null");
+    }
+};
+
+
+template<class T>
+struct EvalMatchOp : EvalOp
+// ----------------------------------------------------------------------------
+//   Evaluate a value once, then check it matches a natural/real/text
+// ----------------------------------------------------------------------------
+{
+    EvalMatchOp(EvalOp *eval, MatchOp<T> *match)
+        : EvalOp(eval->id, eval->ops, eval->fail), ref(match->ref) {}
+    typename T::value_t ref;
+
+    virtual Op *        Run(Data data)
+    {
+        EvalOp::Run(data);
+        if (Tree *test = DataResult(data))
+            if (T *tval = test->As<T>())
+                if (tval->value == ref)
+                    return success;
+        return fail;
+    }
+
+    virtual kstring     OpID()  { return "eval+match"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << "\t" << ref << "\t"
+            << Code::Ref(ops, "\t", "code", "null");
+    }
+};
+
+
+
+// ============================================================================
+//
+//    Optimization of the generated code
+//
+// ============================================================================
+//
+//  The optimizer runs over the op graph in CodeBuilder::instrs before it is
+//  handed over to the Code. At level 1, it removes dead stores, results that
+//  are overwritten before being read, and redundant clears. At level 2, it
+//  also fuses common sequences into superinstructions:
+//    - const, store                  => const+store
+//    - eval X, match natural 0       => eval+match
+//    - eval X, typecheck X:T         => eval+typechk
+//    - const+store A, ..., call F(A) => callk F(constant)
+
+void CodeBuilder::Optimize()
+// ----------------------------------------------------------------------------
+//   Run the optimizations selected by the -bytecode_opt option
+// ----------------------------------------------------------------------------
+{
+    uint level = Opt::bytecodeOpt.value;
+    uint before = instrs.size();
+
+    // Labels are always removed, since they execute as no-ops
+    RemoveLabels();
+
+    // Iterate until we no longer find anything to optimize
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        if (level >= 2)
+            changed |= Superinstructions();
+        if (level >= 1)
+            changed |= Peephole();
+    }
+
+    record(bytecode, "Optimized level %u from %u to %u ops",
+           level, before, instrs.size());
+}
+
+
+void CodeBuilder::RemoveLabels()
+// ----------------------------------------------------------------------------
+//   Remove all the labels from the generated code
+// ----------------------------------------------------------------------------
+{
+    for (uint i = 0; i < instrs.size(); i++)
+    {
+        if (LabelOp *label = dynamic_cast<LabelOp *>(instrs[i]))
+        {
+            Remove(label);
+            delete label;
+            --i;
+        }
+    }
+}
+
+
+bool CodeBuilder::Superinstructions()
+// ----------------------------------------------------------------------------
+//   Fuse common sequences of operations
+// ----------------------------------------------------------------------------
+{
+    bool changed = false;
+
+    for (uint i = 0; i < instrs.size(); i++)
+    {
+        Op *op = instrs[i];
+        Op *next = op->success;
+        Op *fused = nullptr;
+        if (!next || Predecessors(next) != 1)
+            continue;
+
+        if (ConstOp *cst = dynamic_cast<ConstOp *>(op))
+        {
+            if (StoreOp *store = dynamic_cast<StoreOp *>(next))
+                fused = new ConstStoreOp(cst, store);
+        }
+        else if (dynamic_cast<EvalTypeCheckOp *>(op) ||
+                 dynamic_cast<EvalMatchOp<Natural> *>(op) ||
+                 dynamic_cast<EvalMatchOp<Real> *>(op) ||
+                 dynamic_cast<EvalMatchOp<Text> *>(op))
+        {
+            // Already fused
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            if (next->Fail() != eval->fail)
+                continue;
+            if (TypeCheckOp *tc = dynamic_cast<TypeCheckOp *>(next))
+            {
+                if (tc->value == eval->id)
+                    fused = new EvalTypeCheckOp(eval, tc);
+            }
+            else if (MatchOp<Natural> *m = dynamic_cast<MatchOp<Natural>*>(next))
+            {
+                fused = new EvalMatchOp<Natural>(eval, m);
+            }
+            else if (MatchOp<Real> *m = dynamic_cast<MatchOp<Real> *>(next))
+            {
+                fused = new EvalMatchOp<Real>(eval, m);
+            }
+            else if (MatchOp<Text> *m = dynamic_cast<MatchOp<Text> *>(next))
+            {
+                fused = new EvalMatchOp<Text>(eval, m);
+            }
+        }
+
+        if (fused)
+        {
+            record(bytecode, "Fuse %O and %O", op, next);
+            fused->success = next->success;
+            instrs[i] = fused;
+            Replace(op, fused);
+            Remove(next);
+            delete next;
+            delete op;
+            changed = true;
+        }
+    }
+
+    // Pass constant arguments directly to calls
+    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
+    {
+        CallOp *call = dynamic_cast<CallOp *>(*o);
+        if (!call)
+            continue;
+        uint sz = call->parms.size();
+        if (call->constants.size() != sz)
+            call->constants.resize(sz);
+        for (Op *prev = Predecessor(call);
+             ConstStoreOp *cst = dynamic_cast<ConstStoreOp *>(prev);
+             prev = Predecessor(prev))
+        {
+            for (uint p = 0; p < sz; p++)
+            {
+                if (call->parms[p] == cst->id && !call->constants[p])
+                {
+                    call->constants[p] = cst->value;
+                    changed = true;
+                }
+            }
+        }
+        if (std::count(call->constants.begin(), call->constants.end(),
+                       nullptr) == sz)
+            call->constants.clear();
+    }
+
+    return changed;
+}
+
+
+static bool OverwritesResult(Op *op)
+// ----------------------------------------------------------------------------
+//   Check if an op sets the result without reading it first
+// ----------------------------------------------------------------------------
+{
+    if (dynamic_cast<ConstOp *>(op) ||
+        dynamic_cast<ConstStoreOp *>(op) ||
+        dynamic_cast<ValueOp *>(op))
+        return true;
+    if (CallOp *call = dynamic_cast<CallOp *>(op))
+        return dynamic_cast<Procedure *>(call->target) != nullptr;
+    return false;
+}
+
+
+bool CodeBuilder::Peephole()
+// ----------------------------------------------------------------------------
+//   Remove dead temporaries and redundant operations
+// ----------------------------------------------------------------------------
+{
+    bool changed = false;
+    std::set<int> live;
+    bool known = LiveIDs(instrs, live);
+    live.insert(opcodeIDs.begin(), opcodeIDs.end());
+
+    for (uint i = 0; i < instrs.size(); i++)
+    {
+        Op *op = instrs[i];
+        Op *next = op->success;
+        Op *removed = nullptr;
+
+        if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+        {
+            // Store in a temporary that nobody reads
+            if (known && !live.count(store->id))
+                removed = op;
+        }
+        else if (ConstStoreOp *cst = dynamic_cast<ConstStoreOp *>(op))
+        {
+            // Constant stored in a temporary that nobody reads
+            if (known && !live.count(cst->id))
+            {
+                ConstOp *value = new ConstOp(cst->value);
+                value->success = cst->success;
+                instrs[i] = value;
+                Replace(cst, value);
+                delete cst;
+                changed = true;
+                op = value;
+            }
+        }
+        else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+        {
+            // Nothing to clear
+            if (clear->lo > clear->hi)
+                removed = op;
+
+            // Merge adjacent clears
+            else if (ClearOp *nclear = dynamic_cast<ClearOp *>(next))
+            {
+                if (Predecessors(nclear) == 1 &&
+                    nclear->lo <= clear->hi + 1 &&
+                    clear->lo <= nclear->hi + 1)
+                {
+                    clear->lo = std::min(clear->lo, nclear->lo);
+                    clear->hi = std::max(clear->hi, nclear->hi);
+                    removed = nclear;
+                }
+            }
+        }
+
+        // Result that is overwritten before being read
+        if (!removed && next && OverwritesResult(next) &&
+            (dynamic_cast<ConstOp *>(op) || dynamic_cast<ValueOp *>(op)))
+            removed = op;
+
+        if (removed)
+        {
+            record(bytecode, "Remove %O", removed);
+            Remove(removed);
+            delete removed;
+            changed = true;
+            if (removed == op)
+                --i;
+        }
+    }
+
+    return changed;
+}
+
+
+bool CodeBuilder::LiveIDs(Ops &ops, std::set<int> &live)
+// ----------------------------------------------------------------------------
+//   Collect the IDs read by the given ops, return false if unsure
+// ----------------------------------------------------------------------------
+{
+    bool known = true;
+    for (Ops::iterator o = ops.begin(); o != ops.end(); o++)
+    {
+        Op *op = *o;
+        if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+        {
+            live.insert(value->id);
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            live.insert(eval->id);
+            if (EvalTypeCheckOp *tc = dynamic_cast<EvalTypeCheckOp *>(op))
+                live.insert(tc->type);
+
+            // Code attached to a tree, e.g. by EvaluationTemporary
+            Code *code = dynamic_cast<Code *>(eval->ops);
+            if (code && !dynamic_cast<Procedure *>(code))
+                known &= LiveIDs(code->instrs, live);
+        }
+        else if (ArgEvalOp *arg = dynamic_cast<ArgEvalOp *>(op))
+        {
+            live.insert(arg->argId);
+            live.insert(arg->id);
+        }
+        else if (CallOp *call = dynamic_cast<CallOp *>(op))
+        {
+            uint sz = call->parms.size();
+            for (uint p = 0; p < sz; p++)
+                if (p >= call->constants.size() || !call->constants[p])
+                    live.insert(call->parms[p]);
+        }
+        else if (TypeCheckOp *tc = dynamic_cast<TypeCheckOp *>(op))
+        {
+            live.insert(tc->value);
+            live.insert(tc->type);
+        }
+        else if (IndexOp *index = dynamic_cast<IndexOp *>(op))
+        {
+            live.insert(index->left);
+            live.insert(index->right);
+        }
+        else if (NameMatchOp *nm = dynamic_cast<NameMatchOp *>(op))
+        {
+            live.insert(nm->testID);
+            live.insert(nm->nameID);
+        }
+        else if (WhenClauseOp *when = dynamic_cast<WhenClauseOp *>(op))
+        {
+            live.insert(when->whenID);
+        }
+        else if (InfixMatchOp *ifx = dynamic_cast<InfixMatchOp *>(op))
+        {
+            live.insert(ifx->lid);
+            live.insert(ifx->rid);
+        }
+        else if (!dynamic_cast<ConstOp *>(op) &&
+                 !dynamic_cast<ConstStoreOp *>(op) &&
+                 !dynamic_cast<StoreOp *>(op) &&
+                 !dynamic_cast<ClearOp *>(op) &&
+                 !dynamic_cast<SelfOp *>(op) &&
+                 !dynamic_cast<ClosureOp *>(op) &&
+                 !dynamic_cast<FormErrorOp *>(op) &&
+                 !dynamic_cast<LabelOp *>(op) &&
+                 !dynamic_cast<MatchOp<Natural> *>(op) &&
+                 !dynamic_cast<MatchOp<Real> *>(op) &&
+                 !dynamic_cast<MatchOp<Text> *>(op) &&
+                 !dynamic_cast<Opcode *>(op))
+        {
+            // Builtin opcodes read the IDs recorded in opcodeIDs
+            known = false;
+        }
+    }
+    return known;
+}
+
+
+uint CodeBuilder::Predecessors(Op *op)
+// ----------------------------------------------------------------------------
+//   Count how many references there are to the given op
+// ----------------------------------------------------------------------------
+{
+    uint count = ops == op;
+    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
+    {
+        Op *from = *o;
+        count += from->success == op;
+        count += from->Fail() == op;
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(from))
+            count += eval->ops == op;
+    }
+    return count;
+}
+
+
+Op *CodeBuilder::Predecessor(Op *op)
+// ----------------------------------------------------------------------------
+//   Return the single op that falls through to this one, if any
+// ----------------------------------------------------------------------------
+{
+    if (Predecessors(op) != 1)
+        return nullptr;
+    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
+        if ((*o)->success == op)
+            return *o;
+    return nullptr;
+}
+
+
+void CodeBuilder::Replace(Op *from, Op *to)
+// ----------------------------------------------------------------------------
+//   Redirect all references to 'from' so that they point to 'to'
+// ----------------------------------------------------------------------------
+{
+    if (ops == from)
+        ops = to;
+    for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
+    {
+        Op *op = *o;
+        if (op->success == from)
+            op->success = to;
+        if (FailOp *fop = dynamic_cast<FailOp *>(op))
+            if (fop->fail == from)
+                fop->fail = to;
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            if (eval->ops == from)
+                eval->ops = to;
+    }
+    for (TreeOps::iterator s = subexprs.begin(); s != subexprs.end(); s++)
+        if ((*s).second == from)
+            (*s).second = to;
+}
+
+
+void CodeBuilder::Remove(Op *op)
+// ----------------------------------------------------------------------------
+//   Remove an op from the code, references now go to the next op
+// ----------------------------------------------------------------------------
+//   The caller is responsible for deleting the op if needed
+{
+    Ops::iterator found = std::find(instrs.begin(), instrs.end(), op);
+    if (found != instrs.end())
+        instrs.erase(found);
+    Replace(op, op->success);
+}
+
+
+
+// ============================================================================
+//
+//    Direct-threaded execution of the flat code
+//
+// ============================================================================
+//
+//  The ops generated by the CodeBuilder are linked through 'success' and
+//  'fail' pointers, and each is dispatched through a virtual 'Run'.
+//  Linearize lays them out in a contiguous 'Instr' array, following
+//  'success' chains first so that the common path falls through, and
+//  Execute runs that array with a computed goto on GCC-compatible compilers
+//  (a plain switch elsewhere).
+
+#if defined(__GNUC__)
+#define XL_THREADED_DISPATCH    1
+#endif
+
+typedef std::map<Op *, uint> OpIndex;
+
+
+static Instr EncodeInstr(Op *op, OpIndex &index)
+// ----------------------------------------------------------------------------
+//   Find the flat encoding for a given op
+// ----------------------------------------------------------------------------
+{
+    Instr instr = { Instr::GENERIC, 0, 0,
+                    index[op->success], index[op->Fail()], op };
+
+    if (dynamic_cast<ConstOp *>(op))
+    {
+        instr.opcode = Instr::CONST;
+    }
+    else if (ConstStoreOp *cst = dynamic_cast<ConstStoreOp *>(op))
+    {
+        instr.opcode = Instr::CONST_STORE;
+        instr.a = cst->id;
+    }
+    else if (EvalTypeCheckOp *tc = dynamic_cast<EvalTypeCheckOp *>(op))
+    {
+        instr.opcode = Instr::EVAL_TYPECHECK;
+        instr.a = tc->id;
+        instr.b = index[tc->ops];
+    }
+    else if (EvalMatchOp<Natural> *m = dynamic_cast<EvalMatchOp<Natural>*>(op))
+    {
+        instr.opcode = Instr::EVAL_MATCH_NATURAL;
+        instr.a = m->id;
+        instr.b = index[m->ops];
+    }
+    else if (EvalMatchOp<Real> *m = dynamic_cast<EvalMatchOp<Real> *>(op))
+    {
+        instr.opcode = Instr::EVAL_MATCH_REAL;
+        instr.a = m->id;
+        instr.b = index[m->ops];
+    }
+    else if (EvalMatchOp<Text> *m = dynamic_cast<EvalMatchOp<Text> *>(op))
+    {
+        instr.opcode = Instr::EVAL_MATCH_TEXT;
+        instr.a = m->id;
+        instr.b = index[m->ops];
+    }
+    else if (dynamic_cast<SelfOp *>(op))
+    {
+        instr.opcode = Instr::SELF;
+    }
+    else if (ValueOp *value = dynamic_cast<ValueOp *>(op))
+    {
+        instr.opcode = Instr::VALUE;
+        instr.a = value->id;
+    }
+    else if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+    {
+        instr.opcode = Instr::STORE;
+        instr.a = store->id;
+    }
+    else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+    {
+        instr.opcode = Instr::CLEAR;
+        instr.a = clear->lo;
+        instr.b = clear->hi;
+    }
+    else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+    {
+        instr.opcode = Instr::EVAL;
+        instr.a = eval->id;
+        instr.b = index[eval->ops];
+    }
+    else if (CallOp *call = dynamic_cast<CallOp *>(op))
+    {
+        instr.opcode = Instr::CALL;
+        instr.a = call->outId;
+    }
+    else if (TypeCheckOp *tc = dynamic_cast<TypeCheckOp *>(op))
+    {
+        instr.opcode = Instr::TYPECHECK;
+        instr.a = tc->value;
+        instr.b = tc->type;
+    }
+    else if (dynamic_cast<MatchOp<Natural> *>(op))
+    {
+        instr.opcode = Instr::MATCH_NATURAL;
+    }
+    else if (dynamic_cast<MatchOp<Real> *>(op))
+    {
+        instr.opcode = Instr::MATCH_REAL;
+    }
+    else if (dynamic_cast<MatchOp<Text> *>(op))
+    {
+        instr.opcode = Instr::MATCH_TEXT;
+    }
+    else if (NameMatchOp *nm = dynamic_cast<NameMatchOp *>(op))
+    {
+        instr.opcode = Instr::MATCH_NAME;
+        instr.a = nm->testID;
+        instr.b = nm->nameID;
+    }
+    else if (WhenClauseOp *when = dynamic_cast<WhenClauseOp *>(op))
+    {
+        instr.opcode = Instr::WHEN;
+        instr.a = when->whenID;
+    }
+    return instr;
+}
+
+
+void Code::Linearize()
+// ----------------------------------------------------------------------------
+//   Build the flat instruction array from the op graph
+// ----------------------------------------------------------------------------
+{
+    OpIndex index;
+    Ops     order;
+    Ops     pending;
+
+    // Assign indices to all reachable ops, laying out success chains first
+    pending.push_back(ops);
+    while (!pending.empty())
+    {
+        Op *op = pending.back();
+        pending.pop_back();
+        for (; op && index.find(op) == index.end(); op = op->success)
+        {
+            index[op] = order.size();
+            order.push_back(op);
+            if (Op *fail = op->Fail())
+                pending.push_back(fail);
+            if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+                pending.push_back(eval->ops);
+        }
+    }
+
+    // The null op is the exit, placed after all others
+    uint max = order.size();
+    index[nullptr] = max;
+
+    code.clear();
+    code.reserve(max + 1);
+    for (uint i = 0; i < max; i++)
+        code.push_back(EncodeInstr(order[i], index));
+    Instr exit = { Instr::EXIT, 0, 0, max, max, nullptr };
+    code.push_back(exit);
+    entry = index[ops];
+}
+
+
+void Code::Execute(Data data, uint pc)
+// ----------------------------------------------------------------------------
+//   Run the flat code starting at the given instruction
+// ----------------------------------------------------------------------------
+{
+    Instr *base = &code[0];
+    Instr *in   = base + pc;
+
+#ifdef XL_THREADED_DISPATCH
+    static void *dispatch[Instr::NUM_OPCODES] =
+    {
+        &&do_EXIT, &&do_GENERIC, &&do_CONST, &&do_SELF, &&do_VALUE,
+        &&do_STORE, &&do_CLEAR, &&do_EVAL, &&do_CALL, &&do_TYPECHECK,
+        &&do_MATCH_NATURAL, &&do_MATCH_REAL, &&do_MATCH_TEXT,
+        &&do_MATCH_NAME, &&do_WHEN, &&do_CONST_STORE, &&do_EVAL_TYPECHECK,
+        &&do_EVAL_MATCH_NATURAL, &&do_EVAL_MATCH_REAL, &&do_EVAL_MATCH_TEXT
+    };
+#define NEXT(next)      do { in = base + (next);                \
+                             goto *dispatch[in->opcode]; } while (0)
+#define OPCODE(name)    do_##name
+
+    NEXT(pc);
+#else
+#define NEXT(next)      do { in = base + (next); goto next_op; } while(0)
+#define OPCODE(name)    case Instr::name
+
+next_op:
+    switch(in->opcode)
+    {
+    case Instr::NUM_OPCODES:
+#endif // XL_THREADED_DISPATCH
+
+    OPCODE(EXIT):
+        return;
+
+    OPCODE(GENERIC):
+    {
+        Op *op = in->op;
+        Op *next = op->Run(data);
+        if (next == op->success)
+            NEXT(in->success);
+        if (next == op->Fail())
+            NEXT(in->fail);
+
+        // Some op jumped outside of this code, finish with the op graph
+        while (next)
+            next = next->Run(data);
+        return;
+    }
+
+    OPCODE(CONST):
+        DataResult(data, ((ConstOp *) in->op)->value);
+        NEXT(in->success);
+
+    OPCODE(SELF):
+        NEXT(in->success);
+
+    OPCODE(VALUE):
+        DataResult(data, data[in->a]);
+        NEXT(in->success);
+
+    OPCODE(STORE):
+        data[in->a] = DataResult(data);
+        NEXT(in->success);
+
+    OPCODE(CLEAR):
+        for (int v = in->a; v <= in->b; v++)
+            data[v] = nullptr;
+        NEXT(in->success);
+
+    OPCODE(EVAL):
+        if (EvalOnce(data, in))
+            NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(CALL):
+        if (Op *remaining = ((CallOp *) in->op)->Invoke(data))
+        {
+            while (remaining)
+                remaining = remaining->Run(data);
+            return;
+        }
+        NEXT(in->success);
+
+    OPCODE(TYPECHECK):
+    {
+        Tree *cast = xl_typecheck(DataScope(data), data[in->b], data[in->a]);
+        if (!cast)
+            NEXT(in->fail);
+        DataResult(data, cast);
+        NEXT(in->success);
+    }
+
+    OPCODE(MATCH_NATURAL):
+        if (Natural *test = DataResult(data)->As<Natural>())
+            if (test->value == ((MatchOp<Natural> *) in->op)->ref)
+                NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(MATCH_REAL):
+        if (Real *test = DataResult(data)->As<Real>())
+            if (test->value == ((MatchOp<Real> *) in->op)->ref)
+                NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(MATCH_TEXT):
+        if (Text *test = DataResult(data)->As<Text>())
+            if (test->value == ((MatchOp<Text> *) in->op)->ref)
+                NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(MATCH_NAME):
+        if (Tree::Equal(data[in->b], data[in->a]))
+            NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(WHEN):
+        if (data[in->a] != xl_true)
+            NEXT(in->fail);
+        NEXT(in->success);
+
+    OPCODE(CONST_STORE):
+    {
+        Tree *value = ((ConstStoreOp *) in->op)->value;
+        DataResult(data, value);
+        data[in->a] = value;
+        NEXT(in->success);
+    }
+
+    OPCODE(EVAL_TYPECHECK):
+    {
+        Tree *value = EvalOnce(data, in);
+        if (!value)
+            NEXT(in->fail);
+        Tree *type = data[((EvalTypeCheckOp *) in->op)->type];
+        Tree *cast = xl_typecheck(DataScope(data), type, value);
+        if (!cast)
+            NEXT(in->fail);
+        DataResult(data, cast);
+        NEXT(in->success);
+    }
+
+    OPCODE(EVAL_MATCH_NATURAL):
+        if (Tree *value = EvalOnce(data, in))
+            if (Natural *test = value->As<Natural>())
+                if (test->value == ((EvalMatchOp<Natural> *) in->op)->ref)
+                    NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(EVAL_MATCH_REAL):
+        if (Tree *value = EvalOnce(data, in))
+            if (Real *test = value->As<Real>())
+                if (test->value == ((EvalMatchOp<Real> *) in->op)->ref)
+                    NEXT(in->success);
+        NEXT(in->fail);
+
+    OPCODE(EVAL_MATCH_TEXT):
+        if (Tree *value = EvalOnce(data, in))
+            if (Text *test = value->As<Text>())
+                if (test->value == ((EvalMatchOp<Text> *) in->op)->ref)
+                    NEXT(in->success);
+        NEXT(in->fail);
+
+#ifndef XL_THREADED_DISPATCH
+    }
+#endif // XL_THREADED_DISPATCH
+
+#undef NEXT
+#undef OPCODE
+}
+
+
+Tree *Code::EvalOnce(Data data, Instr *in)
+// ----------------------------------------------------------------------------
+//   Evaluate the code at 'b' unless data[a] already holds its value
+// ----------------------------------------------------------------------------
+{
+    Tree *result = data[in->a];
+    if (result)
+    {
+        DataResult(data, result);
+        return result;
+    }
+
+    Execute(data, in->b);
+    result = DataResult(data);
+    data[in->a] = result;
+    return result;
+}
+
+
+static kstring instrNames[Instr::NUM_OPCODES] =
+// ----------------------------------------------------------------------------
+//   Names of the flat instructions, for Code::Dump
+// ----------------------------------------------------------------------------
+{
+    "exit", "op", "const", "self", "value", "store", "clear", "eval",
+    "call", "typechk", "match\tnatural", "match\treal", "match\ttext",
+    "match\tname", "when", "const+store", "eval+typechk",
+    "eval+match\tnatural", "eval+match\treal", "eval+match\ttext"
+};
+
+
+void Code::Dump(std::ostream &out, uint entry, Instrs &code)
+// ----------------------------------------------------------------------------
+//   Dump the flat instructions
+// ----------------------------------------------------------------------------
+{
+    uint max = code.size();
+    for (uint i = 0; i < max; i++)
+    {
+        Instr &in = code[i];
+        out << "#" << i << (i == entry ? "=>\t" : "\t");
+        switch(in.opcode)
+        {
+        case Instr::EXIT:
+            out << instrNames[in.opcode] << "\n";
+            continue;
+        case Instr::GENERIC:
+        case Instr::CONST:
+        case Instr::CALL:
+            out << in.op;
+            break;
+        default:
+            out << instrNames[in.opcode] << "\t" << in.a << "," << in.b;
+            break;
+        }
+        if (in.success != i + 1)
+            out << "\tgoto #" << in.success;
+        if (in.fail != max - 1)
+            out << "\tfail #" << in.fail;
+        out << "\n";
+    }
+}
+
 XL_END
 
 
@@ -0,0 +1,279 @@
+// *****************************************************************************
+// cache.cpp                                                          XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     On-disk cache of parsed source files
+//
+//     Entries are written to a temporary file and renamed, so that several
+//     processes sharing the cache never see a partially written entry.
+//     Failing to read or write the cache is never an error, the source is
+//     simply parsed again.
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "cache.h"
+#include "flat.h"
+#include "options.h"
+#include "atomic.h"
+
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+
+RECORDER(module_cache, 16, "On-disk cache of parsed source files");
+
+XL_BEGIN
+
+namespace Opt
+{
+extern BooleanOption caseSensitive;
+extern BooleanOption signedConstants;
+}
+
+
+ulonglong ModuleCache::Mix(ulonglong hash, const text &t)
+// ----------------------------------------------------------------------------
+//   Add a text to a 64-bit FNV-1a hash
+// ----------------------------------------------------------------------------
+{
+    for (char c : t)
+        hash = (hash ^ (byte) c) * 0x100000001B3ULL;
+    return (hash ^ 0xFF) * 0x100000001B3ULL; // Separate consecutive texts
+}
+
+
+ulonglong ModuleCache::Mix(ulonglong hash, ulonglong value)
+// ----------------------------------------------------------------------------
+//   Add a number to a 64-bit FNV-1a hash
+// ----------------------------------------------------------------------------
+{
+    for (uint i = 0; i < sizeof(value); i++)
+        hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 0x100000001B3ULL;
+    return hash;
+}
+
+
+template <typename Table>
+static ulonglong MixTable(ulonglong hash, const Table &table)
+// ----------------------------------------------------------------------------
+//   Add an ordered syntax table to a hash
+// ----------------------------------------------------------------------------
+{
+    for (auto &entry : table)
+        hash = ModuleCache::Mix(ModuleCache::Mix(hash, entry.first),
+                                entry.second);
+    return ModuleCache::Mix(hash, ulonglong(table.size()));
+}
+
+
+ulonglong ModuleCache::SyntaxStamp(Syntax &syntax)
+// ----------------------------------------------------------------------------
+//   Identify the current state of the syntax, which may change while parsing
+// ----------------------------------------------------------------------------
+{
+    ulonglong hash = 0xCBF29CE484222325ULL;
+    hash = MixTable(hash, syntax.infix_priority);
+    hash = MixTable(hash, syntax.prefix_priority);
+    hash = MixTable(hash, syntax.postfix_priority);
+    hash = MixTable(hash, syntax.comment_delimiters);
+    hash = MixTable(hash, syntax.text_delimiters);
+    hash = MixTable(hash, syntax.block_delimiters);
+    hash = MixTable(hash, syntax.subsyntax_file);
+    hash = Mix(hash, ulonglong(syntax.default_priority));
+    hash = Mix(hash, ulonglong(syntax.statement_priority));
+    hash = Mix(hash, ulonglong(syntax.function_priority));
+    return hash;
+}
+
+
+ulonglong ModuleCache::BuildStamp()
+// ----------------------------------------------------------------------------
+//   Identify the version of the program that parsed the source
+// ----------------------------------------------------------------------------
+//   When the running binary can be found, its modification time also
+//   invalidates entries written by a previous build
+{
+    static ulonglong stamp = 0;
+    if (!stamp)
+    {
+        stamp = Mix(0xCBF29CE484222325ULL, text(__DATE__ " " __TIME__));
+        stamp = Mix(stamp, ulonglong(FlatTree::FLAT_VERSION));
+        struct stat st;
+        if (stat("/proc/self/exe", &st) == 0)
+            stamp = Mix(Mix(stamp, ulonglong(st.st_mtime)),
+                        ulonglong(st.st_size));
+    }
+    return stamp;
+}
+
+
+ModuleCache::ModuleCache(text directory, Positions &positions)
+// ----------------------------------------------------------------------------
+//   Create a module cache using the given directory
+// ----------------------------------------------------------------------------
+    : directory(directory), positions(positions)
+{
+    record(module_cache, "Module cache in %s", directory.c_str());
+}
+
+
+Tree *ModuleCache::Load(text file, const text &source, ulonglong syntax)
+// ----------------------------------------------------------------------------
+//   Return the cached tree for the source file, or nullptr if not current
+// ----------------------------------------------------------------------------
+{
+    text entry = Entry(file);
+    struct stat st;
+    if (stat(entry.c_str(), &st) != 0)
+    {
+        record(module_cache, "No entry for %s", file.c_str());
+        return nullptr;
+    }
+
+    FlatTree *flat = FlatTree::Map(entry, positions);
+    if (!flat)
+    {
+        record(module_cache, "Invalid entry %s for %s",
+               entry.c_str(), file.c_str());
+        return nullptr;
+    }
+
+    Tree *result = nullptr;
+    if (flat->Stamp() == Stamp(file, source, syntax))
+        result = flat->Materialize();
+    record(module_cache, "%s entry %s for %s",
+           result ? "Using" : "Outdated", entry.c_str(), file.c_str());
+    delete flat;
+    return result;
+}
+
+
+bool ModuleCache::Store(text file, const text &source, ulonglong syntax,
+                        Tree *tree)
+// ----------------------------------------------------------------------------
+//   Record the tree parsed from the source file
+// ----------------------------------------------------------------------------
+//   The temporary file is unique to the thread, since several threads may
+//   store the same entry when a file is given twice on the command line
+{
+    if (!CreateDirectory())
+        return false;
+
+    static Atomic<uint> serial;
+    text entry = Entry(file);
+    char pid[32];
+    snprintf(pid, sizeof(pid), ".%d.%u", (int) getpid(), serial++);
+    text temp = entry + pid;
+
+    bool ok;
+    {
+        std::ofstream out(temp.c_str(), std::ios::out | std::ios::binary);
+        FlatTree flat(tree);
+        ok = out.good() &&
+            flat.Write(out, positions, Stamp(file, source, syntax));
+        out.close();
+        ok = ok && out.good();
+    }
+    ok = ok && rename(temp.c_str(), entry.c_str()) == 0;
+    if (!ok)
+        unlink(temp.c_str());
+    record(module_cache, "%s entry %s for %s",
+           ok ? "Wrote" : "Failed to write", entry.c_str(), file.c_str());
+    return ok;
+}
+
+
+text ModuleCache::DefaultDirectory()
+// ----------------------------------------------------------------------------
+//   Return the default cache directory, following the XDG conventions
+// ----------------------------------------------------------------------------
+{
+    if (kstring cache = getenv("XDG_CACHE_HOME"))
+        if (*cache)
+            return text(cache) + "/xl";
+    if (kstring home = getenv("HOME"))
+        if (*home)
+            return text(home) + "/.cache/xl";
+    return "";
+}
+
+
+text ModuleCache::Entry(text file)
+// ----------------------------------------------------------------------------
+//   Return the name of the cache entry for a given source file
+// ----------------------------------------------------------------------------
+//   Files are identified by their full path when it can be found
+{
+    if (char *path = realpath(file.c_str(), nullptr))
+    {
+        file = path;
+        free(path);
+    }
+
+    char name[32];
+    ulonglong hash = Mix(0xCBF29CE484222325ULL, file);
+    snprintf(name, sizeof(name), "/%016llx.xlc", hash);
+    return directory + name;
+}
+
+
+ulonglong ModuleCache::Stamp(text file, const text &source, ulonglong syntax)
+// ----------------------------------------------------------------------------
+//   Compute the stamp identifying the source and how it was parsed
+// ----------------------------------------------------------------------------
+//   The file name is the one recorded in positions, so it must match too
+{
+    ulonglong hash = Mix(BuildStamp(), syntax);
+    hash = Mix(hash, file);
+    hash = Mix(hash, ulonglong(Opt::caseSensitive));
+    hash = Mix(hash, ulonglong(Opt::signedConstants));
+    return Mix(hash, source);
+}
+
+
+bool ModuleCache::CreateDirectory()
+// ----------------------------------------------------------------------------
+//   Create the cache directory and its parents if necessary
+// ----------------------------------------------------------------------------
+{
+    for (size_t pos = 1; pos != text::npos; pos++)
+    {
+        pos = directory.find('/', pos);
+        text dir = directory.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            record(module_cache, "Cannot create %s", dir.c_str());
+            return false;
+        }
+        if (pos == text::npos)
+            break;
+    }
+    return true;
+}
+
+XL_END
@@ -71,6 +71,7 @@ XL_BEGIN
 // ============================================================================
 
 uint Context::hasRewritesForKind = 0;
+uint Context::generation = 0;
 
 Context::Context()
 // ----------------------------------------------------------------------------
@@ -353,6 +354,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
     Tree_p  &locals = ScopeLocals(scope);
     Tree_p  *parent = &locals;
     Rewrite *result = nullptr;
+    uint     depth  = 0;
     while (!result)
     {
         // If we have found a nil spot, that's where we can insert
@@ -408,6 +410,16 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         else
             parent = &children->left;
         h = Rehash(h);
+        depth++;
+    }
+
+    // Maintain the hash index for names, create it if scope becomes large
+    if (name)
+    {
+        if (ScopeIndex *index = scope->GetInfo<ScopeIndex>())
+            index->Add(name, rewrite);
+        else if (depth >= SCOPE_INDEX_DEPTH)
+            scope->SetInfo<ScopeIndex>(new ScopeIndex(scope));
     }
 
     // Return the entry we created
@@ -583,7 +595,8 @@ text Context::ResolvePrefixedPath(text path)
 //
 // ============================================================================
 
-Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
+Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse,
+                      LookupCache *cache)
 // ----------------------------------------------------------------------------
 //   Lookup a tree using the given lookup function
 // ----------------------------------------------------------------------------
@@ -594,14 +607,61 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 
     Scope * scope = symbols;
     ulong   h0    = Hash(what);
+    Name *  name  = what->AsName();
 
     while (scope)
     {
+        // For names, use the scope index if there is one
+        if (name)
+        {
+            if (ScopeIndex *index = scope->GetInfo<ScopeIndex>())
+            {
+                ScopeIndex::Entry *entry = index->Find(name);
+                if (!entry)
+                {
+                    if (!recurse)
+                        break;
+                    scope = Enclosing(scope);
+                    continue;
+                }
+                if (Infix *decl = entry->decl)
+                {
+                    if (Tree *result = lookup(symbols, scope, what, decl, info))
+                        return result;
+                    if (!recurse)
+                        break;
+                    scope = Enclosing(scope);
+                    continue;
+                }
+                // Name is declared more than once, use the rewrite tree
+            }
+        }
+
+        // Check if we already know the candidates in this scope
+        if (cache)
+        {
+            if (LookupCache::Entry *entry = cache->Find(scope))
+            {
+                record(scope_lookup, "Cached lookup %t in %p, %u candidates",
+                       what, scope, entry->candidates.size());
+                for (Infix *decl : entry->candidates)
+                    if (Tree *result = lookup(symbols, scope, what, decl, info))
+                        return result;
+                if (!recurse)
+                    break;
+                scope = Enclosing(scope);
+                continue;
+            }
+        }
+
         // Initialize local scope
         Tree_p &locals = ScopeLocals(scope);
         Tree_p *parent = &locals;
         Tree *result = nullptr;
         ulong h = h0;
+        RewriteChildren *last = nullptr;
+        RewriteList candidates;
+        uint depth = 0;
 
         while (true)
         {
@@ -622,9 +682,14 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
             ulong declHash = Hash(defined);
             if (declHash == h0)
             {
-                result = lookup(symbols, scope, what, decl, info);
-                if (result)
-                    return result;
+                if (cache)
+                    candidates.push_back(decl);
+                if (!result)
+                {
+                    result = lookup(symbols, scope, what, decl, info);
+                    if (result && !cache)
+                        return result;
+                }
             }
 
             // Keep going in local symbol table
@@ -633,8 +698,16 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
             else
                 parent = &children->left;
             h = Rehash(h);
+            last = children;
+            depth++;
         }
 
+        // Remember candidates in deep scopes for next time
+        if (cache && depth >= LOOKUP_CACHE_DEPTH)
+            cache->Add(scope, last, parent, candidates);
+        if (result)
+            return result;
+
         // Not found in this scope. Keep going with next scope if recursing
         // The last top-level global will be nil, so we will end with scope=NULL
         if (!recurse)
@@ -863,21 +936,21 @@ ulong Context::Hash(Tree *what)
         h += HashText(((Text *) what)->value);
         break;
     case NAME:
-        h += HashText(((Name *) what)->value);
+        h += ((Name *) what)->value.Hash();
         break;
     case BLOCK:
         h += HashText(((Block *) what)->opening);
         break;
     case INFIX:
-        h += HashText(((Infix *) what)->name);
+        h += ((Infix *) what)->name.Hash();
         break;
     case PREFIX:
         if (Name *name = ((Prefix *) what)->left->AsName())
-            h += HashText(name->value);
+            h += name->value.Hash();
         break;
     case POSTFIX:
         if (Name *name = ((Postfix *) what)->right->AsName())
-            h += HashText(name->value);
+            h += name->value.Hash();
         break;
     }
 
@@ -886,6 +959,153 @@ ulong Context::Hash(Tree *what)
 
 
 
+// ============================================================================
+//
+//    Hash index for large scopes
+//
+// ============================================================================
+
+ScopeIndex::ScopeIndex(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Build the index from all the names currently declared in the scope
+// ----------------------------------------------------------------------------
+    : entries(SCOPE_INDEX_MIN_SIZE), count(0)
+{
+    std::vector<Rewrite *> pending;
+    if (Rewrite *top = ScopeRewrites(scope))
+        pending.push_back(top);
+
+    while (pending.size())
+    {
+        Rewrite *entry = pending.back();
+        pending.pop_back();
+
+        Infix *decl = RewriteDeclaration(entry);
+        if (Name *name = PatternBase(decl->left)->AsName())
+            Add(name, decl);
+
+        RewriteChildren *children = RewriteNext(entry);
+        if (Rewrite *left = children->left->As<Rewrite>())
+            pending.push_back(left);
+        if (Rewrite *right = children->right->As<Rewrite>())
+            pending.push_back(right);
+    }
+    record(scope_enter, "Created index for scope %p with %u names",
+           scope, count);
+}
+
+
+ScopeIndex::Entry *ScopeIndex::Find(Name *name)
+// ----------------------------------------------------------------------------
+//   Find the entry for a name, or return nullptr if it is not declared
+// ----------------------------------------------------------------------------
+{
+    ulong  h    = name->value.Hash();
+    size_t mask = entries.size() - 1;
+    for (size_t i = h & mask; entries[i].name; i = (i + 1) & mask)
+    {
+        Entry &entry = entries[i];
+        if (entry.hash == h && entry.name->value == name->value)
+            return &entry;
+    }
+    return nullptr;
+}
+
+
+void ScopeIndex::Add(Name *name, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Add a declaration, mark entry as ambiguous if name is already there
+// ----------------------------------------------------------------------------
+{
+    if (Entry *existing = Find(name))
+    {
+        existing->decl = nullptr;
+        return;
+    }
+    if (2 * (count + 1) > entries.size())
+        Grow();
+    Insert(name->value.Hash(), name, decl);
+    count++;
+}
+
+
+void ScopeIndex::Insert(ulong hash, Name *name, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Insert in the first free slot (the name is known not to be there)
+// ----------------------------------------------------------------------------
+{
+    size_t mask = entries.size() - 1;
+    size_t i = hash & mask;
+    while (entries[i].name)
+        i = (i + 1) & mask;
+    entries[i] = Entry { hash, name, decl };
+}
+
+
+void ScopeIndex::Grow()
+// ----------------------------------------------------------------------------
+//   Double the size of the table and reinsert existing entries
+// ----------------------------------------------------------------------------
+{
+    Entries old(2 * entries.size());
+    old.swap(entries);
+    for (Entry &entry : old)
+        if (entry.name)
+            Insert(entry.hash, entry.name, entry.decl);
+}
+
+
+
+// ============================================================================
+//
+//    Lookup cache
+//
+// ============================================================================
+
+LookupCache::Entry *LookupCache::Find(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Find a still valid entry for the given scope
+// ----------------------------------------------------------------------------
+{
+    for (Entry &entry : entries)
+        if (entry.scope == scope)
+            if (*entry.slot == xl_nil && entry.generation==Context::generation)
+                return &entry;
+    return nullptr;
+}
+
+
+void LookupCache::Add(Scope *scope, Tree *last, Tree_p *slot,
+                      RewriteList &candidates)
+// ----------------------------------------------------------------------------
+//   Record the candidates for a scope, replacing an older entry if needed
+// ----------------------------------------------------------------------------
+{
+    Entry *entry = nullptr;
+    for (Entry &existing : entries)
+        if (existing.scope == scope)
+            entry = &existing;
+    if (!entry)
+    {
+        if (entries.size() < LOOKUP_CACHE_ENTRIES)
+        {
+            entries.push_back(Entry());
+            entry = &entries.back();
+        }
+        else
+        {
+            entry = &entries[next++ % LOOKUP_CACHE_ENTRIES];
+        }
+    }
+    entry->scope = scope;
+    entry->last = last;
+    entry->slot = slot;
+    entry->generation = Context::generation;
+    entry->candidates.swap(candidates);
+}
+
+
+
 // ============================================================================
 //
 //    Utility functions
@@ -898,6 +1118,8 @@ void Context::Clear()
 // ----------------------------------------------------------------------------
 {
     symbols->right = xl_nil;
+    symbols->Purge<ScopeIndex>();
+    generation++;
 }
 
 
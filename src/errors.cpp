@@ -170,10 +170,10 @@ text Error::Position()
     case Tree::BUILTIN:                 return "<Builtin>";
     }
 
-    text  file, source;
+    text  file;
     ulong line, column;
     std::ostringstream out;
-    MAIN->positions.GetInfo(position, &file, &line, &column, &source);
+    MAIN->positions.GetInfo(position, &file, &line, &column, nullptr);
     out << file << ":" << line << ":" << column + 1;
     return out.str();
 }
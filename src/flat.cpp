@@ -0,0 +1,770 @@
+// *****************************************************************************
+// flat.cpp                                                           XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Compact, read-only representation of parsed source trees
+//
+//     Flattening and materialization both walk the nodes iteratively,
+//     since a long source file is a very deep chain of sequence infixes.
+//
+//     Packed files are checked once when they are mapped, so that
+//     materialization can trust the indexes it reads.
+//
+//
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "flat.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif // HAVE_SYS_MMAN_H
+
+RECORDER(flat, 16, "Flat representation of source trees");
+
+XL_BEGIN
+
+FlatTree::FlatTree(bool shared)
+// ----------------------------------------------------------------------------
+//   Create an empty flat tree
+// ----------------------------------------------------------------------------
+    : nodes(), textIndex(), texts(), trees(), atoms(), comments(), added(),
+      shared(shared), root(NONE),
+      image(nullptr), imageSize(0), mapped(false), header(nullptr),
+      imageNodes(nullptr), imageTexts(nullptr), imageComments(nullptr),
+      imageData(nullptr), base(0)
+{}
+
+
+FlatTree::FlatTree(Tree *source, bool shared)
+// ----------------------------------------------------------------------------
+//   Create a flat tree from a regular tree, optionally sharing nodes
+// ----------------------------------------------------------------------------
+    : nodes(), textIndex(), texts(), trees(), atoms(), comments(), added(),
+      shared(shared), root(NONE),
+      image(nullptr), imageSize(0), mapped(false), header(nullptr),
+      imageNodes(nullptr), imageTexts(nullptr), imageComments(nullptr),
+      imageData(nullptr), base(0)
+{
+    root = Add(source);
+    record(flat, "Flattened %p into %u nodes, %u texts, %u bytes",
+           source, nodes.size(), texts.size(), Size());
+}
+
+
+FlatTree::~FlatTree()
+// ----------------------------------------------------------------------------
+//   Destructor releases the materialized trees and the file image
+// ----------------------------------------------------------------------------
+{
+    if (!image)
+        return;
+#ifdef HAVE_SYS_MMAN_H
+    if (mapped)
+    {
+        munmap((void *) image, imageSize);
+        return;
+    }
+#endif // HAVE_SYS_MMAN_H
+    free((void *) image);
+}
+
+
+uint FlatTree::Add(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Append a tree after its children, return the index of its root node
+// ----------------------------------------------------------------------------
+//   With sharing, a tree that was already added is not added again.
+//   A tree that contains itself returns NONE, since it cannot be added.
+{
+    struct Pending
+    {
+        Tree *  tree;
+        bool    expanded;       // Children are already pushed
+    };
+    std::vector<Pending> pending;
+    std::vector<uint>    done;
+
+    XL_ASSERT(!image && "Cannot add to a packed file image");
+    pending.push_back(Pending { tree, false });
+    while (pending.size())
+    {
+        Pending p = pending.back();
+        pending.pop_back();
+        Tree *t = p.tree;
+        kind  k = t->Kind();
+
+        // Reuse the node of a shared tree, detect cycles
+        if (shared && !p.expanded)
+        {
+            auto found = added.find(t);
+            if (found != added.end())
+            {
+                if (found->second == NONE)
+                {
+                    record(flat, "Cannot flatten %p, it contains itself", t);
+                    return NONE;
+                }
+                done.push_back(found->second);
+                continue;
+            }
+            added[t] = NONE;
+        }
+
+        // Visit children first, left to right
+        if (!p.expanded && !t->IsLeaf())
+        {
+            pending.push_back(Pending { t, true });
+            switch(k)
+            {
+            case BLOCK:
+                pending.push_back(Pending { ((Block *) t)->child, false });
+                break;
+            case PREFIX:
+                pending.push_back(Pending { ((Prefix *) t)->right, false });
+                pending.push_back(Pending { ((Prefix *) t)->left, false });
+                break;
+            case POSTFIX:
+                pending.push_back(Pending { ((Postfix *) t)->right, false });
+                pending.push_back(Pending { ((Postfix *) t)->left, false });
+                break;
+            case INFIX:
+                pending.push_back(Pending { ((Infix *) t)->right, false });
+                pending.push_back(Pending { ((Infix *) t)->left, false });
+                break;
+            default:
+                break;
+            }
+            continue;
+        }
+
+        Node node;
+        node.tag = t->tag;
+        node.ref[0] = node.ref[1] = node.ref[2] = NONE;
+        switch(k)
+        {
+        case NATURAL:
+            node.natural = ((Natural *) t)->value;
+            break;
+        case REAL:
+            node.real = ((Real *) t)->value;
+            break;
+        case TEXT:
+        {
+            Text *txt = (Text *) t;
+            node.ref[0] = AddText(txt->value);
+            node.ref[1] = AddText(txt->opening);
+            node.ref[2] = AddText(txt->closing);
+            break;
+        }
+        case NAME:
+            node.ref[0] = AddText(((Name *) t)->value);
+            break;
+        case BLOCK:
+        {
+            Block *block = (Block *) t;
+            node.ref[0] = done.back(); done.pop_back();
+            node.ref[1] = AddText(block->opening);
+            node.ref[2] = AddText(block->closing);
+            break;
+        }
+        case PREFIX:
+        case POSTFIX:
+        case INFIX:
+            node.ref[1] = done.back(); done.pop_back();
+            node.ref[0] = done.back(); done.pop_back();
+            if (k == INFIX)
+                node.ref[2] = AddText(((Infix *) t)->name);
+            break;
+        }
+        done.push_back(nodes.size());
+        nodes.push_back(node);
+        if (shared)
+            added[t] = done.back();
+        if (CommentsInfo *cinfo = t->GetInfo<CommentsInfo>())
+            AddComments(done.back(), cinfo);
+    }
+
+    XL_ASSERT(done.size() == 1);
+    return done.back();
+}
+
+
+uint FlatTree::Alias(Tree *tree, Tree *as)
+// ----------------------------------------------------------------------------
+//   Write references to a tree as another tree, without adding its children
+// ----------------------------------------------------------------------------
+{
+    XL_ASSERT(shared && "Aliases require sharing");
+    uint node = Add(as);
+    added[tree] = node;
+    return node;
+}
+
+
+uint FlatTree::AddText(const text &value)
+// ----------------------------------------------------------------------------
+//   Return the index of the given text in the text table
+// ----------------------------------------------------------------------------
+{
+    auto inserted = textIndex.emplace(value, texts.size());
+    if (inserted.second)
+        texts.push_back(&inserted.first->first);
+    return inserted.first->second;
+}
+
+
+void FlatTree::AddComments(uint node, CommentsInfo *info)
+// ----------------------------------------------------------------------------
+//   Record the comments before and after a node
+// ----------------------------------------------------------------------------
+{
+    for (auto &c : info->before)
+        comments.push_back(Comment { node, AddText(c), 0 });
+    for (auto &c : info->after)
+        comments.push_back(Comment { node, AddText(c), 1 });
+}
+
+
+Tree *FlatTree::Materialize(uint n)
+// ----------------------------------------------------------------------------
+//   Return the regular tree for a node, building the subtree if needed
+// ----------------------------------------------------------------------------
+//   Since a subtree occupies the range [First(n), n], children are always
+//   materialized before their parent when walking that range in order.
+{
+    if (n == NONE)
+        return nullptr;
+    if (trees.size() < NodeCount())
+        trees.resize(NodeCount());
+    if (trees[n])
+        return trees[n];
+
+    uint           first = IsShared() ? 0 : First(n);
+    uint           built = 0;
+    const Comment *cmt   = CommentsAt(first);
+    const Comment *cend  = CommentsAt(NONE);
+    for (uint i = first; i <= n; i++)
+    {
+        if (trees[i])
+            continue;
+
+        const Node  &node = At(i);
+        TreePosition pos  = Position(i);
+        const uint  *ref  = node.ref;
+        Trees       &t    = trees;
+        Tree        *tree = nullptr;
+        switch(Kind(i))
+        {
+        case NATURAL:
+            tree = new Natural(node.natural, pos);
+            break;
+        case REAL:
+            tree = new Real(node.real, pos);
+            break;
+        case TEXT:
+            tree = new Text(TextAt(ref[0]),
+                            AtomAt(ref[1]), AtomAt(ref[2]), pos);
+            break;
+        case NAME:
+            tree = new Name(AtomAt(ref[0]), pos);
+            break;
+        case BLOCK:
+            tree = new Block(t[ref[0]], AtomAt(ref[1]), AtomAt(ref[2]), pos);
+            break;
+        case PREFIX:
+            tree = new Prefix(t[ref[0]], t[ref[1]], pos);
+            break;
+        case POSTFIX:
+            tree = new Postfix(t[ref[0]], t[ref[1]], pos);
+            break;
+        case INFIX:
+            tree = new Infix(AtomAt(ref[2]), t[ref[0]], t[ref[1]], pos);
+            break;
+        }
+        trees[i] = tree;
+        built++;
+
+        // Restore the comments attached to that node
+        while (cmt < cend && cmt->node < i)
+            cmt++;
+        if (cmt < cend && cmt->node == i)
+        {
+            CommentsInfo *cinfo = new CommentsInfo;
+            for (; cmt < cend && cmt->node == i; cmt++)
+            {
+                CommentsList &list = cmt->after ? cinfo->after : cinfo->before;
+                list.push_back(TextAt(cmt->value));
+            }
+            tree->SetInfo<CommentsInfo>(cinfo);
+        }
+    }
+
+    record(flat, "Materialized node %u, built %u trees from %u",
+           n, built, first);
+    return trees[n];
+}
+
+
+bool FlatTree::IsMaterialized(uint n)
+// ----------------------------------------------------------------------------
+//   Check if we already built the regular tree for a node
+// ----------------------------------------------------------------------------
+{
+    return n < trees.size() && trees[n];
+}
+
+
+void FlatTree::Bind(uint n, Tree *tree)
+// ----------------------------------------------------------------------------
+//   Use an existing tree for a node, e.g. a tree that must keep its identity
+// ----------------------------------------------------------------------------
+{
+    if (trees.size() < NodeCount())
+        trees.resize(NodeCount());
+    trees[n] = tree;
+}
+
+
+kind FlatTree::Kind(uint n)
+// ----------------------------------------------------------------------------
+//   Return the kind of a node
+// ----------------------------------------------------------------------------
+{
+    return kind(At(n).tag & Tree::KINDMASK);
+}
+
+
+TreePosition FlatTree::Position(uint n)
+// ----------------------------------------------------------------------------
+//   Return the source position of a node
+// ----------------------------------------------------------------------------
+//   Positions in a packed image are relative to the start of the source
+{
+    TreePosition pos = (long) At(n).tag >> Tree::KINDBITS;
+    if (header && pos < header->sourceSize)
+        pos += base;
+    return pos;
+}
+
+
+uint FlatTree::Left(uint n)
+// ----------------------------------------------------------------------------
+//   Return the left node of a prefix, postfix or infix, or a block child
+// ----------------------------------------------------------------------------
+{
+    switch(Kind(n))
+    {
+    case BLOCK:
+    case PREFIX:
+    case POSTFIX:
+    case INFIX:
+        return At(n).ref[0];
+    default:
+        return NONE;
+    }
+}
+
+
+uint FlatTree::Right(uint n)
+// ----------------------------------------------------------------------------
+//   Return the right node of a prefix, postfix or infix
+// ----------------------------------------------------------------------------
+{
+    switch(Kind(n))
+    {
+    case PREFIX:
+    case POSTFIX:
+    case INFIX:
+        return At(n).ref[1];
+    default:
+        return NONE;
+    }
+}
+
+
+text FlatTree::Value(uint n)
+// ----------------------------------------------------------------------------
+//   Return the text value of a text or name, or the name of an infix
+// ----------------------------------------------------------------------------
+{
+    const Node &node = At(n);
+    switch(Kind(n))
+    {
+    case TEXT:
+    case NAME:
+        return TextAt(node.ref[0]);
+    case INFIX:
+        return TextAt(node.ref[2]);
+    default:
+        return "";
+    }
+}
+
+
+uint FlatTree::First(uint n)
+// ----------------------------------------------------------------------------
+//   Return the first node in the range occupied by a subtree
+// ----------------------------------------------------------------------------
+{
+    uint left;
+    while ((left = Left(n)) != NONE)
+        n = left;
+    return n;
+}
+
+
+bool FlatTree::IsShared()
+// ----------------------------------------------------------------------------
+//   Check if nodes may be shared between several parents
+// ----------------------------------------------------------------------------
+{
+    return header ? (header->flags & SHARED) != 0 : shared;
+}
+
+
+size_t FlatTree::NodeCount()
+// ----------------------------------------------------------------------------
+//   Return the number of nodes
+// ----------------------------------------------------------------------------
+{
+    return header ? header->nodes : nodes.size();
+}
+
+
+size_t FlatTree::TextCount()
+// ----------------------------------------------------------------------------
+//   Return the number of distinct texts
+// ----------------------------------------------------------------------------
+{
+    return header ? header->texts : texts.size();
+}
+
+
+size_t FlatTree::CommentCount()
+// ----------------------------------------------------------------------------
+//   Return the number of comments
+// ----------------------------------------------------------------------------
+{
+    return header ? header->comments : comments.size();
+}
+
+
+size_t FlatTree::Size()
+// ----------------------------------------------------------------------------
+//   Return the approximate number of bytes used by the flat representation
+// ----------------------------------------------------------------------------
+{
+    size_t result = sizeof(*this) + imageSize + nodes.capacity()*sizeof(Node)
+        + comments.capacity() * sizeof(Comment);
+    for (const text *t : texts)
+        result += sizeof(text *) + sizeof(TextIndex::value_type)
+            + t->capacity();
+    return result;
+}
+
+
+const FlatTree::Node &FlatTree::At(uint n)
+// ----------------------------------------------------------------------------
+//   Return a node, either built in memory or in the file image
+// ----------------------------------------------------------------------------
+{
+    return header ? imageNodes[n] : nodes[n];
+}
+
+
+text FlatTree::TextAt(uint t)
+// ----------------------------------------------------------------------------
+//   Return an entry in the text table
+// ----------------------------------------------------------------------------
+{
+    if (header)
+        return text(imageData + imageTexts[t].offset, imageTexts[t].length);
+    return *texts[t];
+}
+
+
+Atom FlatTree::AtomAt(uint t)
+// ----------------------------------------------------------------------------
+//   Return an entry in the text table as an atom, interning it only once
+// ----------------------------------------------------------------------------
+{
+    if (atoms.size() < TextCount())
+        atoms.resize(TextCount());
+    if (atoms[t].empty())
+        atoms[t] = TextAt(t);
+    return atoms[t];
+}
+
+
+const FlatTree::Comment *FlatTree::CommentsAt(uint first)
+// ----------------------------------------------------------------------------
+//   Return the first comment attached to a node at or after the given one
+// ----------------------------------------------------------------------------
+{
+    const Comment *begin = header ? imageComments : comments.data();
+    const Comment *end = begin + CommentCount();
+    return std::lower_bound(begin, end, first,
+                            [](const Comment &c, uint node)
+                            {
+                                return c.node < node;
+                            });
+}
+
+
+
+// ============================================================================
+//
+//    Packed file format
+//
+// ============================================================================
+
+bool FlatTree::Write(std::ostream &out, Positions &positions, ulonglong stamp)
+// ----------------------------------------------------------------------------
+//   Write the flat tree in a format that can be mapped back in memory
+// ----------------------------------------------------------------------------
+//   The stamp is not interpreted, callers use it to check an image is current
+{
+    XL_ASSERT(!header && root != NONE && "Can only write a built tree");
+
+    // Positions are written relative to the start of the source file
+    text         source;
+    ulong        offset = 0;
+    TreePosition start = Position(root);
+    positions.GetFile(start, &source, &offset);
+    start -= offset;
+
+    Header hdr;
+    hdr.magic = FLAT_MAGIC;
+    hdr.version = FLAT_VERSION;
+    hdr.root = root;
+    hdr.source = AddText(source);
+    hdr.nodes = nodes.size();
+    hdr.texts = texts.size();
+    hdr.comments = comments.size();
+    hdr.flags = shared ? SHARED : 0;
+    hdr.textBytes = 0;
+    hdr.sourceSize = 0;
+    hdr.stamp = stamp;
+
+    // Positions before the source are dropped, special ones are kept
+    Nodes relocated(nodes);
+    for (Node &node : relocated)
+    {
+        TreePosition pos = (long) node.tag >> Tree::KINDBITS;
+        if (pos >= Tree::BUILTIN)
+            continue;
+        if (pos < start)
+            pos = Tree::NOWHERE;
+        else if (hdr.sourceSize <= (pos -= start))
+            hdr.sourceSize = pos + 1;
+        node.tag = (pos << Tree::KINDBITS) | (node.tag & Tree::KINDMASK);
+    }
+
+    std::vector<TextRef> refs;
+    refs.reserve(texts.size());
+    for (const text *t : texts)
+    {
+        refs.push_back(TextRef { uint(hdr.textBytes), uint(t->length()) });
+        hdr.textBytes += t->length();
+    }
+
+    out.write((kstring) &hdr, sizeof(hdr));
+    out.write((kstring) relocated.data(), relocated.size() * sizeof(Node));
+    out.write((kstring) refs.data(), refs.size() * sizeof(TextRef));
+    out.write((kstring) comments.data(), comments.size() * sizeof(Comment));
+    for (const text *t : texts)
+        out.write(t->data(), t->length());
+
+    record(flat, "Wrote %u nodes, %u texts, %u text bytes for %s",
+           hdr.nodes, hdr.texts, (uint) hdr.textBytes, source.c_str());
+    return out.good();
+}
+
+
+FlatTree *FlatTree::Map(text file, Positions &positions)
+// ----------------------------------------------------------------------------
+//   Map a packed file in memory, return nullptr if it is not in flat format
+// ----------------------------------------------------------------------------
+{
+#ifdef HAVE_SYS_MMAN_H
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header))
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return nullptr;
+
+    FlatTree *result = new FlatTree;
+    if (!result->Attach((kstring) addr, st.st_size, true))
+    {
+        delete result;
+        return nullptr;
+    }
+    result->Relocate(positions);
+    record(flat, "Mapped %s, %u nodes", file.c_str(), result->NodeCount());
+    return result;
+
+#else // !HAVE_SYS_MMAN_H
+    std::ifstream input(file.c_str(), std::ios::in | std::ios::binary);
+    std::stringstream contents;
+    contents << input.rdbuf();
+    return Read(contents.str(), positions);
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+FlatTree *FlatTree::Read(const text &image, Positions &positions)
+// ----------------------------------------------------------------------------
+//   Use a copy of a packed image, return nullptr if it is not in flat format
+// ----------------------------------------------------------------------------
+{
+    if (image.length() < sizeof(Header))
+        return nullptr;
+
+    // Copy into a malloc'ed buffer, which is suitably aligned for nodes
+    char *copy = (char *) malloc(image.length());
+    memcpy(copy, image.data(), image.length());
+
+    FlatTree *result = new FlatTree;
+    if (!result->Attach(copy, image.length(), false))
+    {
+        delete result;
+        return nullptr;
+    }
+    result->Relocate(positions);
+    return result;
+}
+
+
+bool FlatTree::Attach(kstring data, size_t size, bool isMapped)
+// ----------------------------------------------------------------------------
+//   Check that an image is valid, and use it for the nodes and texts
+// ----------------------------------------------------------------------------
+{
+    // From now on, the destructor releases the image
+    image = data;
+    imageSize = size;
+    mapped = isMapped;
+
+    const Header *hdr = (const Header *) data;
+    if (hdr->magic != FLAT_MAGIC || hdr->version != FLAT_VERSION ||
+        (hdr->flags & ~SHARED))
+        return false;
+
+    size_t nodeBytes = size_t(hdr->nodes) * sizeof(Node);
+    size_t refBytes = size_t(hdr->texts) * sizeof(TextRef);
+    size_t cmtBytes = size_t(hdr->comments) * sizeof(Comment);
+    size_t needed = sizeof(Header) + nodeBytes + refBytes + cmtBytes
+        + hdr->textBytes;
+    if (needed > size || hdr->root >= hdr->nodes || hdr->source >= hdr->texts)
+    {
+        record(flat, "Invalid packed image header, size %u", size);
+        return false;
+    }
+
+    const Node    *n = (const Node *) (data + sizeof(Header));
+    const TextRef *t = (const TextRef *) (data + sizeof(Header) + nodeBytes);
+    for (uint i = 0; i < hdr->texts; i++)
+        if (ulonglong(t[i].offset) + t[i].length > hdr->textBytes)
+            return false;
+
+    // Comments must be sorted by node for CommentsAt
+    const Comment *c = (const Comment *) (data + sizeof(Header)
+                                          + nodeBytes + refBytes);
+    for (uint i = 0; i < hdr->comments; i++)
+        if (c[i].node >= hdr->nodes || c[i].value >= hdr->texts ||
+            (i && c[i].node < c[i-1].node))
+            return false;
+
+    // Children come before their parent, which also excludes cycles
+    for (uint i = 0; i < hdr->nodes; i++)
+    {
+        const uint *ref = n[i].ref;
+        bool ok = true;
+        switch(kind(n[i].tag & Tree::KINDMASK))
+        {
+        case NATURAL:
+        case REAL:
+            break;
+        case TEXT:
+            ok = ref[0] < hdr->texts && ref[1] < hdr->texts
+                && ref[2] < hdr->texts;
+            break;
+        case NAME:
+            ok = ref[0] < hdr->texts;
+            break;
+        case BLOCK:
+            ok = ref[0] < i && ref[1] < hdr->texts && ref[2] < hdr->texts;
+            break;
+        case PREFIX:
+        case POSTFIX:
+            ok = ref[0] < i && ref[1] < i;
+            break;
+        case INFIX:
+            ok = ref[0] < i && ref[1] < i && ref[2] < hdr->texts;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok)
+        {
+            record(flat, "Invalid packed node %u", i);
+            return false;
+        }
+    }
+
+    header = hdr;
+    imageNodes = n;
+    imageTexts = t;
+    imageComments = c;
+    imageData = data + sizeof(Header) + nodeBytes + refBytes + cmtBytes;
+    root = hdr->root;
+    return true;
+}
+
+
+void FlatTree::Relocate(Positions &positions)
+// ----------------------------------------------------------------------------
+//   Register the original source so that positions refer to it
+// ----------------------------------------------------------------------------
+{
+    text source = TextAt(header->source);
+    base = positions.OpenFile(source, header->sourceSize);
+}
+
+XL_END
@@ -45,9 +45,15 @@
 #include <recorder/recorder.h>
 #include <valgrind/memcheck.h>
 #include <iostream>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <pthread.h>
+#include <sched.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>             // For malloc_trim
+#endif // __GLIBC__
 
 // Windows/MinGW (ancient): When getting in the way becomes an art form...
 #if !defined(HAVE_POSIX_MEMALIGN) && defined(HAVE_MINGW_ALIGNED_MALLOC)
@@ -70,6 +76,7 @@ void *TypeAllocator::highestAddress = (void *) 0;
 void *TypeAllocator::lowestAllocatorAddress = (void *) ~0;
 void *TypeAllocator::highestAllocatorAddress = (void *) 0;
 Atomic<uint> TypeAllocator::finalizing = 0;
+bool TypeAllocator::concurrent = false;
 
 // Identifier of the thread currently collecting if any
 #define PTHREAD_NULL ((pthread_t) 0)
@@ -77,6 +84,45 @@ static pthread_t collecting = PTHREAD_NULL;
 
 RECORDER_DEFINE(memory, 64, "Memory allocation and garbage collector");
 
+namespace Opt
+{
+NaturalOption   gcBudget("gc_budget",
+                         "Maximum number of objects scanned by each "
+                         "garbage collection slice (0=unlimited)",
+                         0);
+NaturalOption   gcThreads("gc_threads",
+                          "Number of background threads running finalizers "
+                          "(0=finalize synchronously)",
+                          0, 0, 16);
+}
+
+
+struct ThreadMagazines
+// ----------------------------------------------------------------------------
+//   Per-thread caches of free items, one per allocator
+// ----------------------------------------------------------------------------
+//   Allocating or freeing from a magazine is a plain pointer pop or push.
+//   The shared free list is only touched when a magazine runs empty or
+//   grows too large, and then MAGAZINE_BATCH items are moved at once.
+{
+    TypeAllocator::Magazine magazines[TypeAllocator::MAX_MAGAZINES];
+    ~ThreadMagazines()
+    {
+#ifdef XL_DEFERRED_REFCOUNT
+        TypeAllocator::ReconcileRefCounts();
+#endif // XL_DEFERRED_REFCOUNT
+        TypeAllocator::FlushThreadMagazines();
+    }
+};
+static thread_local ThreadMagazines threadMagazines;
+
+// Set in sweeper threads, which drain their lists without being woken up
+static thread_local bool sweeperThread = false;
+
+#ifdef XL_DEFERRED_REFCOUNT
+thread_local TypeAllocator::RefCountLog TypeAllocator::refCountLog;
+#endif // XL_DEFERRED_REFCOUNT
+
 
 TypeAllocator::TypeAllocator(kstring tn, uint os)
 // ----------------------------------------------------------------------------
@@ -85,8 +131,11 @@ TypeAllocator::TypeAllocator(kstring tn, uint os)
     : gc(nullptr), name(tn), locked(0), lowestInUse(~0UL), highestInUse(0),
       chunks(), freeList(nullptr), toDelete(nullptr),
       available(0), freedCount(0),
-      chunkSize(1022), objectSize(os), alignedSize(os),
-      allocatedCount(0), scannedCount(0), collectedCount(0), totalCount(0)
+      index(~0U), chunkSize(1022), objectSize(os), alignedSize(os),
+      allocatedCount(0), scannedCount(0), collectedCount(0), totalCount(0),
+      releasedCount(0),
+      scanLow(nullptr), scanHigh(nullptr), scanNext(nullptr),
+      scanChunk(0), scanning(false)
 {
     record(memory, "New type allocator %p name '%s' object size %u",
            this, tn, os);
@@ -134,73 +183,245 @@ TypeAllocator::~TypeAllocator()
 }
 
 
-void *TypeAllocator::Allocate()
+void TypeAllocator::GrowFreeList()
 // ----------------------------------------------------------------------------
-//   Allocate a chunk of the given size
+//   Allocate a new block of items and push them on the shared free list
 // ----------------------------------------------------------------------------
 {
-    record(memory, "Allocate in '%+s', free list %p",
-           this->name, (void *) freeList.Get());
+    // Make sure only one thread allocates chunks, let it run if it was
+    // preempted while holding the lock
+    uint wasLocked = locked++;
+    if (wasLocked)
+    {
+        locked--;
+        sched_yield();
+        return;
+    }
 
-    Chunk_vp result;
-    do
+    // Nothing free: allocate a big enough chunk
+    size_t  itemSize  = alignedSize + sizeof(Chunk);
+    size_t  allocSize = (chunkSize + 1) * itemSize;
+
+    void   *allocated = malloc(allocSize);
+    (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
+
+    record(memory, "New chunk %p in '%+s'", allocated, this->name);
+
+    char *chunkBase = (char *) allocated + alignedSize;
+    Chunk_vp last = (Chunk_vp) chunkBase;
+    Chunk_vp result = freeList;
+    Chunk_vp free = result;
+    for (uint i = 0; i < chunkSize; i++)
+    {
+        Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
+        VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
+        ptr->next = free;
+        free = ptr;
+    }
+
+    // Update the chunks list
+    chunks.push_back((Chunk *) allocated);
+    available += chunkSize;
+    if (lowestAddress > allocated)
+        lowestAddress = allocated;
+    char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
+    if (highestAddress < (void *) highMark)
+        highestAddress = highMark;
+
+    // Update the freelist
+    while (!freeList.SetQ(result, free))
     {
         result = freeList;
-        while (!result)
+        last->next = result;
+    }
+
+    // Unlock the chunks
+    --locked;
+}
+
+
+TypeAllocator::Magazine *TypeAllocator::ThreadMagazine()
+// ----------------------------------------------------------------------------
+//   Return the magazine for the current thread, if this allocator has one
+// ----------------------------------------------------------------------------
+{
+    if (index < MAX_MAGAZINES)
+        return &threadMagazines.magazines[index];
+    return nullptr;
+}
+
+
+void TypeAllocator::RefillMagazine(Magazine &magazine)
+// ----------------------------------------------------------------------------
+//   Move a batch of items from the shared free list to a thread magazine
+// ----------------------------------------------------------------------------
+//   The shared free list cache line is acquired once and then stays local
+//   for the duration of the batch, instead of bouncing on every allocation
+{
+    record(memory, "Refill magazine in '%+s', count %u",
+           this->name, magazine.count);
+
+    for (uint i = 0; i < MAGAZINE_BATCH; i++)
+    {
+        Chunk_vp item;
+        do
         {
-            // Make sure only one thread allocates chunks
-            uint wasLocked = locked++;
-            if (wasLocked)
+            item = freeList;
+            while (!item)
             {
-                locked--;
-                result = freeList;
-                continue;
+                if (magazine.head)
+                    return;
+                GrowFreeList();
+                item = freeList;
             }
+        }
+        while (!freeList.SetQ(item, item->next));
 
-            // Nothing free: allocate a big enough chunk
-            size_t  itemSize  = alignedSize + sizeof(Chunk);
-            size_t  allocSize = (chunkSize + 1) * itemSize;
+        item->next = magazine.head;
+        magazine.head = item;
+        magazine.count++;
+    }
+}
 
-            void   *allocated = malloc(allocSize);
-            (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
 
-            record(memory, "New chunk %p in '%+s'", allocated, this->name);
+void TypeAllocator::FlushMagazine(Magazine &magazine, uint count)
+// ----------------------------------------------------------------------------
+//   Return up to 'count' items from a thread magazine to the shared list
+// ----------------------------------------------------------------------------
+{
+    record(memory, "Flush %u items from magazine in '%+s', count %u",
+           count, this->name, magazine.count);
 
-            char *chunkBase = (char *) allocated + alignedSize;
-            Chunk_vp last = (Chunk_vp) chunkBase;
-            Chunk_vp free = result;
-            for (uint i = 0; i < chunkSize; i++)
-            {
-                Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
-                VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
-                ptr->next = free;
-                free = ptr;
-            }
+    Chunk_vp first = magazine.head;
+    if (!first || !count)
+        return;
 
-            // Update the chunks list
-            chunks.push_back((Chunk *) allocated);
-            available += chunkSize;
-            if (lowestAddress > allocated)
-                lowestAddress = allocated;
-            char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
-            if (highestAddress < (void *) highMark)
-                highestAddress = highMark;
-
-            // Update the freelist
-            while (!freeList.SetQ(result, free))
-            {
-                result = freeList;
-                last->next = result;
-            }
+    // Cut the first 'count' items from the magazine
+    Chunk_vp last = first;
+    uint     moved = 1;
+    while (moved < count && last->next)
+    {
+        last = last->next;
+        moved++;
+    }
+    magazine.head = last->next;
+    magazine.count -= moved;
+
+    // Push them on the shared free list in a single operation
+    Chunk_vp next;
+    do
+    {
+        next = freeList;
+        last->next = next;
+    }
+    while (!freeList.SetQ(next, first));
+}
+
+
+void TypeAllocator::FlushThreadMagazines()
+// ----------------------------------------------------------------------------
+//   Return all the items cached by the current thread to the shared lists
+// ----------------------------------------------------------------------------
+{
+    GarbageCollector *gc = GarbageCollector::GC();
+    if (!gc)
+        return;
+
+    uint max = gc->allocators.size();
+    if (max > MAX_MAGAZINES)
+        max = MAX_MAGAZINES;
+    for (uint i = 0; i < max; i++)
+    {
+        Magazine &magazine = threadMagazines.magazines[i];
+        gc->allocators[i]->FlushMagazine(magazine, magazine.count);
+    }
+}
+
+
+#ifdef XL_DEFERRED_REFCOUNT
+void TypeAllocator::ReconcileRefCounts()
+// ----------------------------------------------------------------------------
+//   Apply the reference count updates logged by the current thread
+// ----------------------------------------------------------------------------
+//   All increments are applied before any decrement, so that an object
+//   never transiently drops to zero while the batch still holds it.
+//   Deleting objects may log new releases, so releases are copied out
+//   and the log is reset before they are applied.
+{
+    RefCountLog &log = refCountLog;
+    uint max = log.count;
+    if (!max)
+        return;
+
+    uintptr_t releases[LOG_SIZE];
+    uint      count = 0;
+    for (uint i = 0; i < max; i++)
+    {
+        uintptr_t entry = log.entries[i];
+        if (entry & LOG_RELEASE)
+        {
+            releases[count++] = entry & ~(uintptr_t) LOG_RELEASE;
+        }
+        else if (entry)
+        {
+            Chunk_vp chunk = ((Chunk_vp) entry) - 1;
+            IncrementCount(chunk);
+        }
+    }
+    log.count = 0;
+    record(memory, "Reconcile %u reference counts, %u releases", max, count);
+
+    for (uint i = 0; i < count; i++)
+    {
+        Chunk_vp chunk = ((Chunk_vp) releases[i]) - 1;
+        XL_ASSERT(chunk->count);
+        if (!DecrementCount(chunk))
+            ScheduleDelete(chunk);
+    }
+}
+
+
+bool TypeAllocator::PendingRefCounts()
+// ----------------------------------------------------------------------------
+//   Return true if the current thread has reference counts to reconcile
+// ----------------------------------------------------------------------------
+{
+    return refCountLog.count != 0;
+}
+#endif // XL_DEFERRED_REFCOUNT
 
-            // Unlock the chunks
-            --locked;
 
-            // Read back the free list
+void *TypeAllocator::Allocate()
+// ----------------------------------------------------------------------------
+//   Allocate a chunk of the given size
+// ----------------------------------------------------------------------------
+{
+    record(memory, "Allocate in '%+s', free list %p",
+           this->name, (void *) freeList.Get());
+
+    Chunk_vp result;
+    if (Magazine *magazine = ThreadMagazine())
+    {
+        // Fast path: pop from the thread-local magazine
+        if (!magazine->head)
+            RefillMagazine(*magazine);
+        result = magazine->head;
+        magazine->head = result->next;
+        magazine->count--;
+    }
+    else
+    {
+        do
+        {
             result = freeList;
+            while (!result)
+            {
+                GrowFreeList();
+                result = freeList;
+            }
         }
+        while (!freeList.SetQ(result, result->next));
     }
-    while (!freeList.SetQ(result, result->next));
 
     VALGRIND_MAKE_MEM_UNDEFINED(result, sizeof(Chunk));
     result->allocator = this;
@@ -237,12 +458,22 @@ void TypeAllocator::Delete(void *ptr)
     XL_ASSERT(!chunk->count &&
                  "Deleted pointer has live references");
 
-    // Put the pointer back on the free list
-    do
+    // Put the pointer back in the thread magazine or on the free list
+    if (Magazine *magazine = ThreadMagazine())
     {
-        chunk->next = freeList;
+        chunk->next = magazine->head;
+        magazine->head = chunk;
+        if (++magazine->count >= 2 * MAGAZINE_BATCH)
+            FlushMagazine(*magazine, MAGAZINE_BATCH);
+    }
+    else
+    {
+        do
+        {
+            chunk->next = freeList;
+        }
+        while (!freeList.SetQ(chunk->next, chunk));
     }
-    while (!freeList.SetQ(chunk->next, chunk));
     available++;
     freedCount++;
 
@@ -288,6 +519,10 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
         {
             // Put it on the to-delete list to avoid deep recursion
             LinkedListInsert(allocator->toDelete, ptr);
+
+            // With sweeper threads, let them delete the children
+            if (concurrent && !sweeperThread)
+                GarbageCollector::MustSweep();
         }
         else
         {
@@ -295,33 +530,48 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
             allocator->Finalize((void *) (ptr + 1));
 
             // Delete the children put on the toDelete list
-            GarbageCollector::Sweep();
+            if (!concurrent)
+                GarbageCollector::Sweep();
         }
     }
 }
 
 
-bool TypeAllocator::CheckLeakedPointers()
+bool TypeAllocator::CheckLeakedPointers(uint &budget)
 // ----------------------------------------------------------------------------
 //   Check if any pointers were allocated and not captured between safe points
 // ----------------------------------------------------------------------------
+//   At most 'budget' objects are scanned, and the scan resumes where it
+//   stopped on the next call. Each call happens at a safe point, so any
+//   object found with a zero count at that time can be finalized.
+//   Returns true once the whole in-use range has been scanned.
 {
-    record(memory, "CheckLeaks in '%+s'", name);
-
-    char *lo = (char *) lowestInUse.Get();
-    char *hi = (char *) highestInUse.Get();
+    record(memory, "CheckLeaks in '%+s' budget %u", name, budget);
 
-    lowestInUse.Set((uintptr_t) lo, ~0UL);
-    highestInUse.Set((uintptr_t) hi, 0UL);
+    if (!scanning)
+    {
+        // Start a new scan with the range marked since the previous one
+        char *lo = (char *) lowestInUse.Get();
+        char *hi = (char *) highestInUse.Get();
+
+        lowestInUse.Set((uintptr_t) lo, ~0UL);
+        highestInUse.Set((uintptr_t) hi, 0UL);
+
+        scanLow = lo;
+        scanHigh = hi;
+        scanNext = nullptr;
+        scanChunk = 0;
+        scanning = true;
+    }
 
-    uint  collected = 0;
-    totalCount = 0;
-    for (Chunks::iterator chk = chunks.begin(); chk != chunks.end(); chk++)
+    char   *lo = scanLow;
+    char   *hi = scanHigh;
+    size_t  itemSize = alignedSize + sizeof(Chunk);
+    uint    collected = 0;
+    for (; scanChunk < chunks.size(); scanChunk++, scanNext = nullptr)
     {
-        char   *chunkBase = (char *) *chk + alignedSize;
-        size_t  itemSize  = alignedSize + sizeof(Chunk);
+        char   *chunkBase = (char *) chunks[scanChunk] + alignedSize;
         char   *chunkEnd = chunkBase + itemSize * chunkSize;
-        totalCount += chunkSize;
 
         if (chunkBase <= hi && chunkEnd  >= lo)
         {
@@ -331,10 +581,23 @@ bool TypeAllocator::CheckLeakedPointers()
                 start = lo;
             if (end > hi)
                 end = hi;
-            scannedCount += (end - start) / itemSize;
+            if (scanNext > start)
+                start = scanNext;
 
             for (char *addr = start; addr < end; addr += itemSize)
             {
+                if (!budget)
+                {
+                    // Out of budget, resume here on the next slice
+                    scanNext = addr;
+                    collectedCount += collected;
+                    record(memory, "CheckLeaks in '%+s' suspended, "
+                           "collected %u", name, collected);
+                    return false;
+                }
+                budget--;
+                scannedCount++;
+
                 Chunk_vp ptr = (Chunk_vp) addr;
                 if (AllocatorPointer(ptr->allocator) == this)
                 {
@@ -350,10 +613,12 @@ bool TypeAllocator::CheckLeakedPointers()
         }
     }
 
+    scanning = false;
+    totalCount = chunks.size() * chunkSize;
     collectedCount += collected;
     record(memory, "CheckLeaks in '%+s' done, scanned %u, collected %u",
            name, scannedCount, collected);
-    return collected;
+    return true;
 }
 
 
@@ -377,6 +642,127 @@ bool TypeAllocator::Sweep()
 }
 
 
+uint TypeAllocator::ReleaseFreeChunks()
+// ----------------------------------------------------------------------------
+//   Return to the system the chunks where all items are on the free list
+// ----------------------------------------------------------------------------
+//   Called after a complete collection cycle, when no scan is in progress.
+//   Items cached in thread magazines count as live, so a chunk is only
+//   released if no thread can still hand out one of its items.
+//   We keep at least one chunk worth of free items, to avoid returning
+//   memory that we would allocate again right away.
+{
+    if (available < 2 * chunkSize)
+        return 0;
+
+    // Make sure no other thread grows the chunks list while we work
+    uint wasLocked = locked++;
+    if (wasLocked)
+    {
+        locked--;
+        return 0;
+    }
+
+    // Detach the shared free list, other threads will wait or push
+    Chunk_vp items = freeList;
+    while (!freeList.SetQ(items, nullptr))
+        items = freeList;
+
+    // Count free items in each chunk, looked up by address
+    size_t itemSize = alignedSize + sizeof(Chunk);
+    size_t chunkBytes = (chunkSize + 1) * itemSize;
+    std::sort(chunks.begin(), chunks.end());
+    uint max = chunks.size();
+    std::vector<uint> freeCounts(max, 0);
+    std::vector<bool> release(max, false);
+    for (Chunk_vp item = items; item; item = item->next)
+    {
+        Chunks::iterator c =
+            std::upper_bound(chunks.begin(), chunks.end(), item);
+        if (c != chunks.begin())
+        {
+            uint index = c - chunks.begin() - 1;
+            if ((char *) item < (char *) chunks[index] + chunkBytes)
+                freeCounts[index]++;
+        }
+    }
+
+    // Select the chunks with no live item, leaving some free items
+    uint released = 0;
+    uint keep = available - chunkSize;
+    for (uint c = 0; c < max && keep >= chunkSize; c++)
+    {
+        if (freeCounts[c] == chunkSize)
+        {
+            release[c] = true;
+            keep -= chunkSize;
+            released++;
+        }
+    }
+
+    // Rebuild the free list without the items in released chunks
+    Chunk_vp head = nullptr;
+    Chunk_vp tail = nullptr;
+    Chunk_vp next;
+    for (Chunk_vp item = items; item; item = next)
+    {
+        next = item->next;
+        if (released)
+        {
+            Chunks::iterator c =
+                std::upper_bound(chunks.begin(), chunks.end(), item);
+            uint index = c - chunks.begin() - 1;
+            if (c != chunks.begin() && release[index] &&
+                (char *) item < (char *) chunks[index] + chunkBytes)
+                continue;
+        }
+        item->next = nullptr;
+        if (tail)
+            tail->next = item;
+        else
+            head = item;
+        tail = item;
+    }
+
+    // Put back the remaining items, after those freed in the meantime
+    if (head)
+    {
+        do
+        {
+            next = freeList;
+            tail->next = next;
+        }
+        while (!freeList.SetQ(next, head));
+    }
+
+    // Free the released chunks
+    uint kept = 0;
+    for (uint c = 0; c < max; c++)
+    {
+        if (release[c])
+        {
+            record(memory, "Release chunk %p in '%+s'", chunks[c], name);
+            free((void *) chunks[c]);
+        }
+        else
+        {
+            chunks[kept++] = chunks[c];
+        }
+    }
+    chunks.resize(kept);
+    available -= released * chunkSize;
+    releasedCount += released;
+    totalCount = chunks.size() * chunkSize;
+
+    // Unlock the chunks
+    --locked;
+
+    record(memory, "Released %u chunks in '%+s', %u left",
+           released, name, kept);
+    return released;
+}
+
+
 void TypeAllocator::ResetStatistics()
 // ----------------------------------------------------------------------------
 //    Reset the statistics counters
@@ -387,6 +773,7 @@ void TypeAllocator::ResetStatistics()
     scannedCount = 0;
     collectedCount = 0;
     totalCount = 0;
+    releasedCount = 0;
 }
 
 
@@ -462,11 +849,51 @@ bool TypeAllocator::CanDelete(void *obj)
 //
 // ============================================================================
 
+struct GarbageCollector::Sweeper
+// ----------------------------------------------------------------------------
+//   A background thread running finalizers for some of the allocators
+// ----------------------------------------------------------------------------
+//   Sweeper N drains the toDelete lists of allocators whose index is N
+//   modulo the number of sweepers, so that each list has a single
+//   consumer. The collector holds 'sweepLock' while it runs.
+{
+    Sweeper(uint index, uint count)
+        : index(index), count(count), pending(0), stop(false)
+    {
+        pthread_mutex_init(&sweepLock, nullptr);
+        pthread_mutex_init(&waitLock, nullptr);
+        pthread_cond_init(&wake, nullptr);
+    }
+    ~Sweeper()
+    {
+        pthread_cond_destroy(&wake);
+        pthread_mutex_destroy(&waitLock);
+        pthread_mutex_destroy(&sweepLock);
+    }
+
+    static void *Run(void *arg);
+    void         Wake();
+    static void  ForkPrepare();
+    static void  ForkParent();
+    static void  ForkChild();
+
+    pthread_t           thread;
+    pthread_mutex_t     sweepLock;      // Held while finalizing
+    pthread_mutex_t     waitLock;       // Protects sleeping on 'wake'
+    pthread_cond_t      wake;
+    uint                index;
+    uint                count;
+    Atomic<uint>        pending;
+    bool                stop;
+};
+
+
 GarbageCollector::GarbageCollector()
 // ----------------------------------------------------------------------------
 //   Create the garbage collector
 // ----------------------------------------------------------------------------
-    : mustRun(false), running(false)
+    : mustRun(false), mustSweep(false), running(false),
+      scanIndex(0), sweptInCycle(false)
 {}
 
 
@@ -475,9 +902,11 @@ GarbageCollector::~GarbageCollector()
 //    Destroy the garbage collector
 // ----------------------------------------------------------------------------
 {
+    StopSweepers();
     MustRun();
-    Collect();
-    Collect();
+    Collect(true);
+    Collect(true);
+    TypeAllocator::FlushThreadMagazines();
 
     Allocators::iterator i;
     for (i = allocators.begin(); i != allocators.end(); i++)
@@ -497,6 +926,7 @@ void GarbageCollector::Register(TypeAllocator *allocator)
 //    Record each individual allocator
 // ----------------------------------------------------------------------------
 {
+    allocator->index = allocators.size();
     allocators.push_back(allocator);
 }
 
@@ -514,10 +944,14 @@ bool GarbageCollector::Sweep()
 }
 
 
-bool GarbageCollector::Collect()
+bool GarbageCollector::Collect(bool complete)
 // ----------------------------------------------------------------------------
-//   Run garbage collection on all the allocators we own
+//   Run a slice of garbage collection on all the allocators we own
 // ----------------------------------------------------------------------------
+//   Unless 'complete' is set, at most -gc_budget objects are scanned,
+//   and the next call resumes where this one stopped. 'mustRun' remains
+//   set until a whole cycle completes, so that every safe point runs a
+//   slice in the meantime.
 {
     pthread_t self = pthread_self();
 
@@ -536,36 +970,89 @@ bool GarbageCollector::Collect()
             for (l = (*a)->listeners.begin(); l != (*a)->listeners.end(); l++)
                 listeners.insert(*l);
 
+        // Keep sweeper threads out while we scan and finalize
+        Sweepers::iterator s;
+        for (s = sweepers.begin(); s != sweepers.end(); s++)
+            pthread_mutex_lock(&(*s)->sweepLock);
+
         // Notify all the listeners that we begin a collection
         for (l = listeners.begin(); l != listeners.end(); l++)
             (*l)->BeginCollection();
 
         // Cleanup pending purges to maximize the effect of garbage collection
-        bool sweeping = true;
-        while (sweeping)
+        bool sliced = !complete && Opt::gcBudget;
+        uint budget = sliced ? (uint) Opt::gcBudget : ~0U;
+        bool finished = false;
+        while (!finished)
         {
+#ifdef XL_DEFERRED_REFCOUNT
+            // Counts must be up to date before looking for leaked pointers
+            TypeAllocator::ReconcileRefCounts();
+#endif // XL_DEFERRED_REFCOUNT
+
             // Check if any object was allocated and not captured at this stage
-            for (a = allocators.begin(); a != allocators.end(); a++)
-                (*a)->CheckLeakedPointers();
-            sweeping = Sweep();
+            uint max = allocators.size();
+            while (scanIndex < max &&
+                   allocators[scanIndex]->CheckLeakedPointers(budget))
+                scanIndex++;
+            if (Sweep())
+                sweptInCycle = true;
+
+            // If we ran out of budget, resume at the next safe point
+            if (scanIndex < max)
+                break;
+
+            // Cycle complete. A complete collection runs another one if
+            // it freed anything. Slices do not, or they would never end
+            // while the program keeps producing garbage between them.
+            finished = !sweptInCycle || sliced;
+            sweptInCycle = false;
+            scanIndex = 0;
         }
 
+#ifdef XL_DEFERRED_REFCOUNT
+        // Apply the releases logged while finalizing objects
+        while (TypeAllocator::PendingRefCounts())
+            TypeAllocator::ReconcileRefCounts();
+#endif // XL_DEFERRED_REFCOUNT
+
         // Notify all the listeners that we completed the collection
         for (l = listeners.begin(); l != listeners.end(); l++)
             (*l)->EndCollection();
 
-        // Print statistics (inside lock, to increase race pressure)
-        if (RECORDER_TRACE(memory))
-            PrintStatistics();
+        // After a complete cycle, return fully free chunks to the system
+        if (finished)
+        {
+            TypeAllocator::FlushThreadMagazines();
+            uint released = 0;
+            for (a = allocators.begin(); a != allocators.end(); a++)
+                released += (*a)->ReleaseFreeChunks();
+#ifdef __GLIBC__
+            if (released)
+                malloc_trim(0);
+#endif // __GLIBC__
+        }
+
+        for (s = sweepers.begin(); s != sweepers.end(); s++)
+            pthread_mutex_unlock(&(*s)->sweepLock);
+
+        if (finished)
+        {
+            // Print statistics (inside lock, to increase race pressure)
+            if (RECORDER_TRACE(memory))
+                PrintStatistics();
+
+            // We are done, mark it so
+            mustRun &= 0U;
+        }
 
-        // We are done, mark it so
-        mustRun &= 0U;
         if (!Atomic<pthread_t>::SetQ(collecting, self, PTHREAD_NULL))
         {
             XL_ASSERT(!"Someone else stole the collection lock?");
         }
 
-        record(memory, "Finished garbage collection in thread %p", self);
+        record(memory, "Finished garbage collection %+s in thread %p",
+               finished ? "cycle" : "slice", self);
         return true;
     }
     record(memory, "Garbage collection for thread %p was blocked", self);
@@ -573,49 +1060,266 @@ bool GarbageCollector::Collect()
 }
 
 
+void *GarbageCollector::Sweeper::Run(void *arg)
+// ----------------------------------------------------------------------------
+//   Wait for objects to finalize and run their finalizers
+// ----------------------------------------------------------------------------
+//   Finalizers may schedule more deletions, so we loop until our lists
+//   are empty. 'pending' is only cleared once idle, so that deletions
+//   made while we run do not cost a wakeup.
+{
+    Sweeper *sweeper = (Sweeper *) arg;
+    Allocators &allocators = gc->allocators;
+    record(memory, "Sweeper %u started", sweeper->index);
+    sweeperThread = true;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sweeper->waitLock);
+        while (!sweeper->pending && !sweeper->stop)
+            pthread_cond_wait(&sweeper->wake, &sweeper->waitLock);
+        bool stop = sweeper->stop;
+        pthread_mutex_unlock(&sweeper->waitLock);
+
+        pthread_mutex_lock(&sweeper->sweepLock);
+        bool swept = true;
+        while (swept)
+        {
+            swept = false;
+            uint max = allocators.size();
+            for (uint a = sweeper->index; a < max; a += sweeper->count)
+                swept |= allocators[a]->Sweep();
+#ifdef XL_DEFERRED_REFCOUNT
+            TypeAllocator::ReconcileRefCounts();
+#endif // XL_DEFERRED_REFCOUNT
+        }
+        pthread_mutex_unlock(&sweeper->sweepLock);
+        sweeper->pending &= 0U;
+
+        // Deletions made just before we cleared 'pending' wait for the
+        // next safe point, make sure it wakes us up
+        uint max = allocators.size();
+        for (uint a = sweeper->index; a < max; a += sweeper->count)
+            if (allocators[a]->toDelete)
+                MustSweep();
+
+        if (stop)
+            break;
+    }
+
+    record(memory, "Sweeper %u stopped", sweeper->index);
+    return nullptr;
+}
+
+
+void GarbageCollector::Sweeper::Wake()
+// ----------------------------------------------------------------------------
+//   Wake up the sweeper if it is not already running
+// ----------------------------------------------------------------------------
+{
+    if (!pending && pending.SetQ(0, 1))
+    {
+        pthread_mutex_lock(&waitLock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&waitLock);
+    }
+}
+
+
+void GarbageCollector::Sweeper::ForkPrepare()
+// ----------------------------------------------------------------------------
+//   Make sure no sweeper is running a finalizer while we fork
+// ----------------------------------------------------------------------------
+{
+    Sweepers::iterator s;
+    for (s = gc->sweepers.begin(); s != gc->sweepers.end(); s++)
+        pthread_mutex_lock(&(*s)->sweepLock);
+}
+
+
+void GarbageCollector::Sweeper::ForkParent()
+// ----------------------------------------------------------------------------
+//   Let the sweepers resume in the parent
+// ----------------------------------------------------------------------------
+{
+    Sweepers::iterator s;
+    for (s = gc->sweepers.begin(); s != gc->sweepers.end(); s++)
+        pthread_mutex_unlock(&(*s)->sweepLock);
+}
+
+
+void GarbageCollector::Sweeper::ForkChild()
+// ----------------------------------------------------------------------------
+//   Sweeper threads do not survive a fork, finalize synchronously
+// ----------------------------------------------------------------------------
+{
+    ForkParent();
+    gc->sweepers.clear();
+    TypeAllocator::concurrent = false;
+}
+
+
+void GarbageCollector::StartSweepers()
+// ----------------------------------------------------------------------------
+//   Start the number of sweeper threads selected by -gc_threads
+// ----------------------------------------------------------------------------
+{
+    uint count = Opt::gcThreads;
+    if (!count || !gc->sweepers.empty())
+        return;
+
+    static bool atfork = false;
+    if (!atfork)
+    {
+        pthread_atfork(Sweeper::ForkPrepare,
+                       Sweeper::ForkParent,
+                       Sweeper::ForkChild);
+        atfork = true;
+    }
+
+    record(memory, "Starting %u sweeper threads", count);
+    TypeAllocator::concurrent = true;
+    for (uint i = 0; i < count; i++)
+    {
+        Sweeper *sweeper = new Sweeper(i, count);
+        if (pthread_create(&sweeper->thread, nullptr, Sweeper::Run, sweeper))
+        {
+            record(memory, "Unable to start sweeper %u", i);
+            delete sweeper;
+            break;
+        }
+        gc->sweepers.push_back(sweeper);
+    }
+
+    // If no thread could be started, finalize synchronously
+    if (gc->sweepers.empty())
+        TypeAllocator::concurrent = false;
+
+    // Adjust the allocator partition if some threads failed to start
+    count = gc->sweepers.size();
+    Sweepers::iterator s;
+    for (s = gc->sweepers.begin(); s != gc->sweepers.end(); s++)
+        (*s)->count = count;
+}
+
+
+void GarbageCollector::StopSweepers()
+// ----------------------------------------------------------------------------
+//   Stop sweeper threads after they drained the pending deletions
+// ----------------------------------------------------------------------------
+{
+    if (!gc || gc->sweepers.empty())
+        return;
+
+    Sweepers::iterator s;
+    for (s = gc->sweepers.begin(); s != gc->sweepers.end(); s++)
+    {
+        Sweeper *sweeper = *s;
+        pthread_mutex_lock(&sweeper->waitLock);
+        sweeper->stop = true;
+        pthread_cond_signal(&sweeper->wake);
+        pthread_mutex_unlock(&sweeper->waitLock);
+        pthread_join(sweeper->thread, nullptr);
+        delete sweeper;
+    }
+    gc->sweepers.clear();
+    TypeAllocator::concurrent = false;
+
+    // Finalize what the sweepers may have left behind
+    Sweep();
+}
+
+
+void GarbageCollector::StartThreads()
+// ----------------------------------------------------------------------------
+//   Let other threads allocate and release objects until StopThreads
+// ----------------------------------------------------------------------------
+//   Reference counts become atomic, and objects released by other threads
+//   are left for the sweepers, or for StopThreads if there are none
+{
+    record(memory, "Start threads, %u sweepers", (uint) gc->sweepers.size());
+    TypeAllocator::concurrent = true;
+}
+
+
+void GarbageCollector::StopThreads()
+// ----------------------------------------------------------------------------
+//   Return to single-threaded operation once other threads are done
+// ----------------------------------------------------------------------------
+{
+    record(memory, "Stop threads, %u sweepers", (uint) gc->sweepers.size());
+    if (!gc->sweepers.empty())
+        return;
+    TypeAllocator::concurrent = false;
+    Sweep();
+}
+
+
+void GarbageCollector::WakeSweepers()
+// ----------------------------------------------------------------------------
+//   Wake the sweepers that are idle, called at a safe point
+// ----------------------------------------------------------------------------
+//   Deletions are batched between safe points rather than signalled
+//   one at a time, since a wakeup costs more than most finalizers.
+{
+    gc->mustSweep &= 0U;
+    Sweepers &sweepers = gc->sweepers;
+    for (Sweepers::iterator s = sweepers.begin(); s != sweepers.end(); s++)
+        (*s)->Wake();
+}
+
+
 void GarbageCollector::PrintStatistics()
 // ----------------------------------------------------------------------------
 //    Print statistics about collection
 // ----------------------------------------------------------------------------
 {
     uint tot = 0, alloc = 0, avail = 0, freed = 0, scan = 0, collect = 0;
-    printf("%24s %8s %8s %8s %8s %8s %8s\n",
-           "NAME", "TOTAL", "AVAIL", "ALLOC", "FREED", "SCANNED", "COLLECT");
+    uint release = 0;
+    printf("%24s %8s %8s %8s %8s %8s %8s %8s\n",
+           "NAME", "TOTAL", "AVAIL", "ALLOC", "FREED", "SCANNED", "COLLECT",
+           "RELEASE");
 
     Allocators::iterator a;
     for (a = allocators.begin(); a != allocators.end(); a++)
     {
         TypeAllocator *ta = *a;
-        printf("%24s %8u %8u %8u %8u %8u %8u\n",
+        uint released = ta->releasedCount * ta->chunkSize;
+        printf("%24s %8u %8u %8u %8u %8u %8u %8u\n",
                ta->name, ta->totalCount,
                ta->available.Get(), ta->allocatedCount,
-               ta->freedCount.Get(), ta->scannedCount, ta->collectedCount);
+               ta->freedCount.Get(), ta->scannedCount, ta->collectedCount,
+               released);
         tot     += ta->totalCount     * ta->alignedSize;
         alloc   += ta->allocatedCount * ta->alignedSize;
         avail   += ta->available      * ta->alignedSize;
         freed   += ta->freedCount     * ta->alignedSize;
         scan    += ta->scannedCount   * ta->alignedSize;
         collect += ta->collectedCount * ta->alignedSize;
+        release += released          * ta->alignedSize;
 
         ta->ResetStatistics();
     }
-    printf("%24s %8s %8s %8s %8s %8s %8s\n",
-           "=====", "=====", "=====", "=====", "=====", "=====", "=====");
-    printf("%24s %7uK %7uK %7uK %7uK %7uK %7uK\n",
+    printf("%24s %8s %8s %8s %8s %8s %8s %8s\n",
+           "=====", "=====", "=====", "=====", "=====", "=====", "=====",
+           "=====");
+    printf("%24s %7uK %7uK %7uK %7uK %7uK %7uK %7uK\n",
            "Kilobytes",
            tot >> 10, avail >> 10, alloc >> 10,
-           freed >> 10, scan >> 10, collect >> 10);
+           freed >> 10, scan >> 10, collect >> 10, release >> 10);
 }
 
 
 void GarbageCollector::Statistics(uint &total,
                                   uint &allocated, uint &available,
-                                  uint &freed, uint &scanned, uint &collected)
+                                  uint &freed, uint &scanned, uint &collected,
+                                  uint &released)
 // ----------------------------------------------------------------------------
 //   Get statistics about garbage collections
 // ----------------------------------------------------------------------------
 {
     uint tot = 0, alloc = 0, avail = 0, free = 0, scan = 0, collect = 0;
+    uint release = 0;
     std::vector<TypeAllocator *>::iterator a;
     for (a = allocators.begin(); a != allocators.end(); a++)
     {
@@ -626,6 +1330,7 @@ void GarbageCollector::Statistics(uint &total,
         free    += ta->freedCount     * ta->alignedSize;
         scan    += ta->scannedCount   * ta->alignedSize;
         collect += ta->collectedCount * ta->alignedSize;
+        release += ta->releasedCount  * ta->chunkSize * ta->alignedSize;
 
         ta->ResetStatistics();
     }
@@ -634,7 +1339,9 @@ void GarbageCollector::Statistics(uint &total,
     allocated = alloc;
     available = avail;
     freed     = free;
+    scanned   = scan;
     collected = collect;
+    released  = release;
 }
 
 
@@ -744,6 +1451,23 @@ void *GarbageCollector::DebugPointer(void *ptr)
                         prev = f;
                     }
 
+                    freeIndex = 0;
+                    prev = nullptr;
+                    if (TA::Magazine *magazine = alloc->ThreadMagazine())
+                    {
+                        for (Chunk_vp f = magazine->head; f; f = f->next)
+                        {
+                            freeIndex++;
+                            if (f == chunk)
+                            {
+                                std::cerr << " magazine #" << freeIndex
+                                          << " after " << prev << " ";
+                                found++;
+                            }
+                            prev = f;
+                        }
+                    }
+
                     freeIndex = 0;
                     prev = nullptr;
                     for (Chunk_vp f = alloc->toDelete; f; f = f->next)
@@ -41,6 +41,7 @@
 #include "renderer.h"
 #include "basics.h"
 #include "runtime.h"
+#include "bytecode.h"
 
 #include <cmath>
 #include <algorithm>
@@ -381,7 +382,7 @@ bool Bindings::Do(Infix *what)
     Save<Context_p> saveContext(context, context);
 
     // Check if we have typed arguments, e.g. X:natural
-    if (what->name == ":")
+    if (what->name == xl_atom_colon)
     {
         Name *name = what->left->AsName();
         if (!name)
@@ -423,7 +424,7 @@ bool Bindings::Do(Infix *what)
     }
 
     // Check if we have a guard clause
-    if (what->name == "when")
+    if (what->name == xl_atom_when)
     {
         // It must pass the rest (need to bind values first)
         if (!what->left->Do(this))
@@ -639,12 +640,14 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     // Check if we have builtins (opcode or C bindings)
     if (opcode)
     {
-        // Cached callback
-        uint offset = args.size();
-        std::reverse(args.begin(), args.end());
-        args.push_back(decl->right);
-        args.push_back(context->Symbols());
-        Data data = &args[offset];
+        // Cached callback, arguments at negative offsets in a frame
+        int   count = args.size();
+        Frame frame(count + 2);
+        Data  data = (Data) frame + count;
+        for (int a = 0; a < count; a++)
+            data[~a] = args[a];
+        data[0] = decl->right;
+        data[1] = context->Symbols();
         opcode->Run(data);
         result = DataResult(data);
         record(interpreter_eval, "Eval%u %t opcode %+s, result %t",
@@ -686,9 +689,16 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
     // Loop to avoid recursion for a few common cases, e.g. sequences, blocks
     while (what)
     {
-        // First attempt to look things up
+        // First attempt to look things up, using the call site cache
         EvalCache cache;
-        if (Tree *eval = context->Lookup(what, evalLookup, &cache))
+        LookupCache *lookupCache = what->GetInfo<LookupCache>();
+        if (!lookupCache)
+        {
+            lookupCache = new LookupCache;
+            what->SetInfo<LookupCache>(lookupCache);
+        }
+        if (Tree *eval = context->Lookup(what, evalLookup, &cache,
+                                         true, lookupCache))
         {
             if (eval == xl_error)
                 return eval;
@@ -821,10 +831,10 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
         case INFIX:
         {
             Infix *infix = (Infix *) (Tree *) what;
-            text name = infix->name;
+            Atom name = infix->name;
 
             // Check sequences
-            if (name == ";" || name == "\n")
+            if (name == xl_atom_semicolon || name == xl_atom_newline)
             {
                 // Sequences: evaluate left, then right
                 Context *leftContext = context;
@@ -836,14 +846,14 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
             }
 
             // Check declarations
-            if (name == "is")
+            if (name == xl_atom_is)
             {
                 // Declarations evaluate last non-declaration result, or self
                 return encloseResult(context, originalScope, result);
             }
 
             // Check type matching
-            if (name == "as")
+            if (name == xl_atom_as)
             {
                 Scope *scope = context->Symbols();
                 result = xl_typecheck(scope, infix->right, infix->left);
@@ -857,7 +867,7 @@ Tree *Interpreter::Instructions(Context_p context, Tree_p what)
             }
 
             // Check scoped reference
-            if (name == ".")
+            if (name == xl_atom_dot)
             {
                 Tree *left = Instructions(context, infix->left);
                 IsClosure(left, &context);
@@ -1021,7 +1031,7 @@ Tree *Interpreter::TypeCheck(Scope *scope, Tree *type, Tree *value)
         // Check a type like 'matching (X, Y)'
         if (Prefix *ptype = type->AsPrefix())
             if (Name *ptypename = ptype->left->AsName())
-                if (ptypename->value == "matching")
+                if (ptypename->value == xl_atom_matching)
                     return formTypeCheck(scope, ptype->right, value);
 
         record(interpreter_typecheck, "No code for %t, opcode is %O",
@@ -47,11 +47,16 @@
 #include "options.h"
 #include "basics.h"
 #include "serializer.h"
+#include "flat.h"
+#include "cache.h"
+#include "snapshot.h"
 #include "runtime.h"
 #include "utf8_fileutils.h"
 #include "opcodes.h"
 #include "remote.h"
 #include "interpreter.h"
+#include "atomic.h"
+#include "gc.h"
 #ifndef INTERPRETER_ONLY
 #include "compiler.h"
 #include "compiler-fast.h"
@@ -67,6 +72,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 
 RECORDER(fileload,                      16, "Files being loaded");
@@ -112,9 +118,21 @@ CodeOption      interpreted("interpreted",
                             });
 
 
+BooleanOption   moduleCache("module_cache",
+                            "Cache parsed source files on disk", true);
+
+TextOption      moduleCachePath("module_cache_path",
+                                "Select the directory for the module cache",
+                                "");
+
 BooleanOption   parse("parse",
                       "Only parse the file without evaluating it");
 
+NaturalOption   parseThreads("parse_threads",
+                             "Number of threads parsing command-line files "
+                             "(0=one per processor)",
+                             0, 0, 64);
+
 BooleanOption   remote("remote",
                        "Listen for remote programs");
 
@@ -126,6 +144,15 @@ NaturalOption   remoteForks("remote_forks",
                             "Select the number of forks for remote access",
                             20, 0, 1000);
 
+NaturalOption   remoteWorkers("remote_workers",
+                              "Number of worker processes for remote access "
+                              "(0=fork for each connexion)",
+                              0, 0, 1000);
+
+TextOption      snapshot("snapshot",
+                         "Restore builtins from a snapshot file, "
+                         "or create it if it is missing or outdated");
+
 BooleanOption   showSource("show",
                            "Show the source code");
 
@@ -223,6 +250,7 @@ Main::Main(int inArgc,
       renderer(std::cout, SearchLibFile(styleSheetName), syntax),
       reader(nullptr),
       writer(nullptr),
+      cache(nullptr),
       evaluator(nullptr)
 {
     recorder_dump_on_common_signals(0, 0);
@@ -235,6 +263,15 @@ Main::Main(int inArgc,
     MAIN = this;
     Opt::builtinsPath.value = SearchLibFile(builtinsName);
     ParseOptions();
+    GarbageCollector::StartSweepers();
+    if (Opt::moduleCache)
+    {
+        text dir = Opt::moduleCachePath.value;
+        if (dir == "")
+            dir = ModuleCache::DefaultDirectory();
+        if (dir != "")
+            cache = new ModuleCache(dir, positions);
+    }
 #ifndef INTERPRETER_ONLY
     if (Opt::emitIR && Opt::optimize.value < 2)
     {
@@ -244,6 +281,7 @@ Main::Main(int inArgc,
     }
 #endif // INTERPRETER_ONLY
     Opcode::Enter(&context);
+    LoadSnapshot();
 
     // Once all options have been read, enter symbols and setup compiler
 #ifndef INTERPRETER_ONLY
@@ -276,7 +314,9 @@ Main::~Main()
 
     delete reader;
     delete writer;
+    delete cache;
     delete evaluator;
+    GarbageCollector::StopSweepers();
 }
 
 
@@ -312,6 +352,8 @@ int Main::LoadAndRun()
     if (!rc && Opt::remote)
     {
         Scope *scope = context.Symbols();
+        if (Opt::remoteWorkers)
+            return xl_listen_pool(scope, Opt::remoteWorkers, Opt::remotePort);
         return xl_listen(scope, Opt::remoteForks, Opt::remotePort);
     }
 
@@ -382,22 +424,150 @@ int Main::ParseOptions()
 }
 
 
+struct ParseTask
+// ----------------------------------------------------------------------------
+//   A command-line file parsed by a parser thread before it is loaded
+// ----------------------------------------------------------------------------
+//   Each file is parsed with its own copy of the syntax, since parsing may
+//   change it. The result is only used if the syntax did not change.
+{
+    ParseTask(text file, Syntax &syntax)
+        : file(file), syntax(syntax), errors(new Errors), logged(),
+          tree(), changed(false) {}
+
+    text                file;
+    Syntax              syntax;
+    Errors *            errors;         // Used while parsing
+    std::vector<Error>  logged;         // Errors once parsing is done
+    Tree_p              tree;
+    bool                changed;
+};
+
+
+struct ParseTasks
+// ----------------------------------------------------------------------------
+//   Files that parser threads pick in command-line order
+// ----------------------------------------------------------------------------
+{
+    std::vector<ParseTask *>    tasks;
+    Atomic<uint>                next;
+};
+
+
+static void *ParseThread(void *data)
+// ----------------------------------------------------------------------------
+//   Parse files until there are none left
+// ----------------------------------------------------------------------------
+{
+    ParseTasks *tasks = (ParseTasks *) data;
+    uint max = tasks->tasks.size();
+    for (uint t = tasks->next++; t < max; t = tasks->next++)
+    {
+        ParseTask *task = tasks->tasks[t];
+        ulonglong stamp = ModuleCache::SyntaxStamp(task->syntax);
+        task->tree = MAIN->ParseFile(task->file, task->syntax, *task->errors);
+        task->changed = ModuleCache::SyntaxStamp(task->syntax) != stamp;
+        record(fileload, "Parsed %s in parallel, syntax %+s",
+               task->file.c_str(), task->changed ? "changed" : "unchanged");
+    }
+    return nullptr;
+}
+
+
 int Main::LoadFiles()
 // ----------------------------------------------------------------------------
 //   Load all files given on the command line and compile them
 // ----------------------------------------------------------------------------
+//   Files are first parsed concurrently. They are then loaded in order,
+//   using the parallel result until a file changes the syntax or reads
+//   from standard input. That file and the following ones are parsed
+//   again sequentially with the resulting syntax.
 {
     bool hadError = false;
 
+    // Select how many threads parse files, including this one
+    uint count = file_names.size();
+    uint threads = Opt::parseThreads;
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > count)
+        threads = count;
+
+    // Parse the files before standard input, creating errors in order
+    ParseTasks parsed;
+    if (threads > 1)
+        for (auto &file : file_names)
+        {
+            if (file == "-")
+                break;
+            parsed.tasks.push_back(new ParseTask(file, syntax));
+        }
+
+    if (parsed.tasks.size() > 1)
+    {
+        // Errors logged while reading child syntax files end up here
+        Errors childSyntaxErrors;
+
+        std::vector<pthread_t> started;
+        GarbageCollector::StartThreads();
+        for (uint t = 1; t < threads; t++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, ParseThread, &parsed))
+            {
+                record(fileload, "Unable to start parser thread %u", t);
+                break;
+            }
+            started.push_back(thread);
+        }
+        ParseThread(&parsed);
+        for (pthread_t thread : started)
+            pthread_join(thread, nullptr);
+        GarbageCollector::StopThreads();
+        record(fileload, "Parsed %u files with %u threads",
+               (uint) parsed.tasks.size(), (uint) started.size() + 1);
+
+        // Files that read child syntax files are parsed again below
+        childSyntaxErrors.Clear();
+    }
+
+    // Errors are stacked, so they must be deleted in reverse order
+    for (auto t = parsed.tasks.rbegin(); t != parsed.tasks.rend(); t++)
+    {
+        ParseTask *task = *t;
+        task->logged.swap(task->errors->errors);
+        task->errors->Clear();
+        delete task->errors;
+        task->errors = nullptr;
+    }
+
     // Loop over files we will process
-    for (auto &file : file_names)
+    bool parallel = parsed.tasks.size() > 1;
+    for (uint f = 0; f < count; f++)
     {
-        int rc = LoadFile(file);
+        text &file = file_names[f];
+        ParseTask *task = f < parsed.tasks.size() ? parsed.tasks[f] : nullptr;
+        parallel = parallel && task && !task->changed;
+
+        int rc;
+        if (parallel)
+        {
+            std::vector<Error> &logged = task->logged;
+            topLevelErrors.errors.insert(topLevelErrors.errors.end(),
+                                         logged.begin(), logged.end());
+            rc = LoadTree(file, task->tree);
+        }
+        else
+        {
+            rc = LoadFile(file);
+        }
         hadError |= rc;
         record(fileload,
                "Load file %s code %d, errors %d", file.c_str(), rc, hadError);
     }
 
+    for (ParseTask *task : parsed.tasks)
+        delete task;
     return hadError;
 }
 
@@ -407,8 +577,17 @@ int Main::LoadFile(text file, text modname)
 //   Load an individual file
 // ----------------------------------------------------------------------------
 {
-    // Find which source file we are referencing
-    SourceFile         &sf       = files[file];
+    Tree_p tree = ParseFile(file, syntax, topLevelErrors);
+    return LoadTree(file, tree, modname);
+}
+
+
+Tree *Main::ParseFile(text file, Syntax &syntax, Errors &errors)
+// ----------------------------------------------------------------------------
+//   Read the tree for a file, from a packed or cached image or by parsing
+// ----------------------------------------------------------------------------
+//   This may run in parser threads, and only changes the given syntax
+{
     std::istream       *input    = nullptr;
     Tree_p              tree     = nullptr;
     utf8_ifstream       inputFile(file.c_str(), std::ios::in|std::ios::binary);
@@ -443,14 +622,51 @@ int Main::LoadFile(text file, text modname)
     // Check if we need to deserialize the input file first
     if (Opt::writePacked)
     {
-        Deserializer deserializer(*input);
-        tree = deserializer.ReadTree();
-        if (deserializer.IsValid())
+        // Packed files in flat format are used in place
+        FlatTree *flat = nullptr;
+        if (input == &inputFile)
+            flat = FlatTree::Map(file, positions);
+        else if (input == &inputStream)
+            flat = FlatTree::Read(inputStream.str(), positions);
+        if (flat)
         {
-            record(fileload, "Input was in serialized format");
+            record(fileload, "Input was in flat packed format");
+            tree = flat->Materialize();
+            delete flat;
+        }
+        else
+        {
+            Deserializer deserializer(*input);
+            tree = deserializer.ReadTree();
+            if (deserializer.IsValid())
+            {
+                record(fileload, "Input was in serialized format");
+            }
+            else
+            {
+                // Not packed, rewind to parse it as source
+                tree = nullptr;
+                input->clear();
+                input->seekg(0);
+            }
         }
     }
 
+    // Check if the module cache has an up-to-date parse of a source file
+    text source;
+    ulonglong stamp = 0;
+    bool cacheable = cache && input == &inputFile && inputFile.good() &&
+        !Opt::writePacked;
+    if (cacheable)
+    {
+        inputStream << inputFile.rdbuf();
+        inputStream.clear();
+        source = inputStream.str();
+        input = &inputStream;
+        stamp = ModuleCache::SyntaxStamp(syntax);
+        tree = cache->Load(file, source, stamp);
+    }
+
     // Read in standard format if we could not read it from packed format
     if (!tree)
     {
@@ -458,10 +674,35 @@ int Main::LoadFile(text file, text modname)
         kstring errName = file.c_str();
         if (file == "-")
             errName = "<stdin>";
-        Parser parser (*input, syntax, positions, topLevelErrors, errName);
+        uint errCount = errors.Count();
+        Parser parser (*input, syntax, positions, errors, errName);
         tree = parser.Parse();
+
+        // Only cache files that parsed without errors. Files that change
+        // the syntax are not cached, since loading them from the cache
+        // would not change the syntax
+        if (cacheable && tree && errors.Count() == errCount)
+        {
+            if (ModuleCache::SyntaxStamp(syntax) == stamp)
+                cache->Store(file, source, stamp, tree);
+            else
+                record(fileload, "Not caching %s, syntax changed",
+                       file.c_str());
+        }
     }
 
+    return tree;
+}
+
+
+int Main::LoadTree(text file, Tree *tree, text modname)
+// ----------------------------------------------------------------------------
+//   Load the tree read from an individual file
+// ----------------------------------------------------------------------------
+{
+    // Find which source file we are referencing
+    SourceFile         &sf       = files[file];
+
     // If at this stage we don't have a tree, this is an error
     if (!tree)
     {
@@ -473,8 +714,8 @@ int Main::LoadFile(text file, text modname)
     if (Opt::writePacked)
     {
         std::stringstream output;
-        Serializer serialize(output);
-        tree->Do(serialize);
+        FlatTree flat(tree);
+        flat.Write(output, positions);
         text packed = output.str();
         if (Opt::writeEncrypted)
         {
@@ -568,6 +809,10 @@ int Main::Run()
                 errors.Display();
                 errors.Clear();
             }
+            else if (*file == Opt::builtinsPath.value)
+            {
+                SaveSnapshot(sf);
+            }
         }
 
         if (!result)
@@ -585,6 +830,47 @@ int Main::Run()
 }
 
 
+bool Main::LoadSnapshot()
+// ----------------------------------------------------------------------------
+//   Restore the builtins scope from a snapshot if one is selected and current
+// ----------------------------------------------------------------------------
+//   Only the interpreter is supported, compiled modes attach the generated
+//   code and C declarations to the builtins trees
+{
+    text file = Opt::snapshot.value;
+    text builtins = Opt::builtinsPath.value;
+    if (file == "" || !Opt::builtins || Opt::optimize != 0)
+        return false;
+
+    Scope_p scope;
+    Tree_p  tree;
+    ulonglong stamp = Snapshot::Stamp(builtins);
+    Scope *parent = context.Symbols();
+    if (!Snapshot::Read(file, stamp, positions, parent, scope, tree))
+        return false;
+
+    // Builtins are already loaded and evaluated
+    context.SetSymbols(scope);
+    files[builtins] = SourceFile(builtins, tree, scope);
+    file_names.erase(file_names.begin());
+    record(fileload, "Builtins restored from %s", file.c_str());
+    return true;
+}
+
+
+bool Main::SaveSnapshot(SourceFile &sf)
+// ----------------------------------------------------------------------------
+//   Save the builtins scope after builtins were evaluated, if requested
+// ----------------------------------------------------------------------------
+{
+    text file = Opt::snapshot.value;
+    if (file == "" || !Opt::builtins || Opt::optimize != 0)
+        return false;
+    ulonglong stamp = Snapshot::Stamp(sf.name);
+    return Snapshot::Write(file, stamp, positions, sf.scope, sf.tree);
+}
+
+
 
 // ============================================================================
 //
@@ -41,7 +41,7 @@
 #include "main.h"
 #include "save.h"
 #include "tree-clone.h"
-#include "fdstream.hpp"
+#include "cache.h"
 
 #include <sys/types.h>
 #ifndef HAVE_SYS_SOCKET_H
@@ -49,18 +49,32 @@
 #undef Context
 #else // HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 #endif // HAVE_SYS_SOCKET_H
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif // HAVE_SYS_EPOLL_H
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 
 #include <string>
-#include <sstream>
+#include <cstring>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
 
 
 RECORDER(remote,        64, "Remote context information");
@@ -93,26 +107,163 @@ static bool        listening       = true;
 //   Utilities for the code below
 //
 // ============================================================================
+//   Trees are exchanged in frames made of a kind byte, a 32-bit size in
+//   network byte order, and the serialized tree. Frames keep messages
+//   apart on connections that remain open between requests.
 
-static Tree *xl_read_tree(int sock)
+enum frame_kind
+{
+    FRAME_REQUEST       = 1,    // Code to evaluate, sent by tell/ask/invoke
+    FRAME_REPLY         = 2,    // Code sent back by 'reply' while evaluating
+    FRAME_RESULT        = 3     // Result of evaluation, ends a request
+};
+const size_t FRAME_HEADER = 5;
+const size_t FRAME_MAX    = 1UL << 30;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif // MSG_NOSIGNAL
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT    0
+#endif // MSG_DONTWAIT
+
+
+static bool xl_send_all(int sock, iovec *chunks, uint count, int flags)
 // ----------------------------------------------------------------------------
-//   Read a tree directly from the socket
+//   Write all the chunks to the socket, without copying them together
 // ----------------------------------------------------------------------------
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    boost::fdistream is(fd);
-    return Deserializer::Read(is);
+    msghdr message = { 0 };
+    message.msg_iov = chunks;
+    message.msg_iovlen = count;
+    while (message.msg_iovlen)
+    {
+        ssize_t sent = sendmsg(sock, &message, flags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+
+        // Skip what was sent, which may end in the middle of a chunk
+        while (message.msg_iovlen && size_t(sent) >= message.msg_iov->iov_len)
+        {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (sent)
+        {
+            iovec *chunk = message.msg_iov;
+            chunk->iov_base = (char *) chunk->iov_base + sent;
+            chunk->iov_len -= sent;
+        }
+    }
+    return true;
 }
 
 
-static void xl_write_tree(int sock, Tree *tree)
+static bool xl_recv_all(int sock, char *data, size_t size)
 // ----------------------------------------------------------------------------
-//   Write a tree directly into the socket
+//   Read exactly the given amount of data from the socket
 // ----------------------------------------------------------------------------
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    boost::fdostream os(fd);
-    Serializer::Write(os, tree);
+    while (size)
+    {
+        ssize_t got = recv(sock, data, size, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+
+static bool xl_frame_header(const byte *header,
+                            frame_kind &kind, size_t &size)
+// ----------------------------------------------------------------------------
+//   Decode a frame header, return false if it is invalid
+// ----------------------------------------------------------------------------
+{
+    size = 0;
+    for (uint i = 1; i < FRAME_HEADER; i++)
+        size = (size << 8) | header[i];
+    kind = frame_kind(header[0]);
+    if (size > FRAME_MAX || kind < FRAME_REQUEST || kind > FRAME_RESULT)
+    {
+        record(remote_error, "Invalid frame kind %u size %lu",
+               kind, (ulong) size);
+        return false;
+    }
+    return true;
+}
+
+
+static bool xl_read_frame(int sock, text &frame, frame_kind &kind)
+// ----------------------------------------------------------------------------
+//   Read the next frame from the socket, return false at end of input
+// ----------------------------------------------------------------------------
+{
+    byte header[FRAME_HEADER];
+    size_t size;
+    if (!xl_recv_all(sock, (char *) header, FRAME_HEADER) ||
+        !xl_frame_header(header, kind, size))
+        return false;
+    frame.resize(size);
+    return xl_recv_all(sock, &frame[0], size);
+}
+
+
+static Tree *xl_read_tree(int sock, frame_kind &kind)
+// ----------------------------------------------------------------------------
+//   Read a tree from the next frame on the socket
+// ----------------------------------------------------------------------------
+{
+    text frame;
+    if (!xl_read_frame(sock, frame, kind))
+        return nullptr;
+    return Deserializer::Read(frame.data(), frame.size());
+}
+
+
+static bool xl_write_tree(int sock, Tree *tree, frame_kind kind)
+// ----------------------------------------------------------------------------
+//   Write a tree as a single frame into the socket
+// ----------------------------------------------------------------------------
+//   A peer that went away is reported as an error for requests, so that
+//   a stale connection can be replaced. For results and replies, the
+//   SIGPIPE still stops a server whose client is gone.
+{
+    text payload;
+    Serializer::Write(payload, tree);
+    byte header[FRAME_HEADER];
+    size_t size = payload.size();
+    header[0] = kind;
+    for (uint i = FRAME_HEADER - 1; i > 0; i--, size >>= 8)
+        header[i] = size & 0xFF;
+
+    iovec chunks[2];
+    chunks[0].iov_base = header;
+    chunks[0].iov_len = FRAME_HEADER;
+    chunks[1].iov_base = (char *) payload.data();
+    chunks[1].iov_len = payload.size();
+    int flags = kind == FRAME_REQUEST ? MSG_NOSIGNAL : 0;
+    return xl_send_all(sock, chunks, 2, flags);
+}
+
+
+static void xl_no_delay(int sock)
+// ----------------------------------------------------------------------------
+//   Send small frames immediately on connections that remain open
+// ----------------------------------------------------------------------------
+{
+    int option = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                   (char *) &option, sizeof(option)) < 0)
+        record(remote_error, "Error setting TCP_NODELAY: %s (%d)",
+               strerror(errno), errno);
 }
 
 
@@ -147,9 +298,9 @@ struct StopAtGlobalsCloneMode
 typedef TreeCloneTemplate<StopAtGlobalsCloneMode> StopAtGlobalsClone;
 
 
-static Tree_p xl_attach_context(Context &context, Tree *code)
+static Tree *xl_context_cutpoint(Context &context, Tree *code)
 // ----------------------------------------------------------------------------
-//   Attach the scope for the given code
+//   Find the scope where the context sent with the code stops, if any
 // ----------------------------------------------------------------------------
 {
     // Find first enclosing scope containing a "module_path"
@@ -157,11 +308,18 @@ static Tree_p xl_attach_context(Context &context, Tree *code)
     Rewrite_p rewrite;
     Name *module_path = new Name("module_path", code->Position());
     Tree *found = context.Bound(module_path, true, &rewrite, &globals);
+    return found ? Enclosing(globals) : nullptr;
+}
+
 
-    // Do a clone of the symbol table up to that point
+static Tree_p xl_attach_context(Context &context, Tree *code)
+// ----------------------------------------------------------------------------
+//   Attach the scope for the given code
+// ----------------------------------------------------------------------------
+{
+    // Do a clone of the symbol table up to the module
     StopAtGlobalsClone partialClone;
-    if (found)
-        partialClone.cutpoint = Enclosing(globals);
+    partialClone.cutpoint = xl_context_cutpoint(context, code);
     Scope_p symbols = context.Symbols();
     Tree_p symbolsToSend = partialClone.Clone(symbols);
 
@@ -204,10 +362,12 @@ static Tree *xl_restore_nil(Tree *tree)
 }
 
 
-static Tree_p xl_merge_context(Context &context, Tree *code)
+static Tree_p xl_merge_context(Context &context, Tree *code,
+                               bool restored = false)
 // ----------------------------------------------------------------------------
 //    Merge the code into the current running context
 // ----------------------------------------------------------------------------
+//    If restored is set, 'nil' was already restored in the incoming symbols
 {
     if (code)
     {
@@ -220,34 +380,747 @@ static Tree_p xl_merge_context(Context &context, Tree *code)
             Context *codeCtx = context.Pointer();
             if (scope)
             {
-                scope = xl_restore_nil(scope)->As<Scope>();
+                if (!restored)
+                    scope = xl_restore_nil(scope)->As<Scope>();
                 codeCtx = new Context(scope);
                 while (Scope *parent = Enclosing(scope))
                     scope = parent;
 
-                // Reattach that end to current scope
-                scope->left = context.Symbols();
-            }
+                // Reattach that end to current scope
+                scope->left = context.Symbols();
+            }
+
+            // And make the resulting code a closure at that location
+            code = Interpreter::MakeClosure(codeCtx, code);
+        }
+    }
+
+    return code;
+}
+
+
+
+// ============================================================================
+//
+//    Scopes known to both ends of a connection
+//
+// ============================================================================
+//   Each scope sent with a request is identified by a hash of its contents,
+//   including the scopes it refers to. The client replaces the scopes that
+//   the server already has with a name holding their hash, so that a scope
+//   is sent once per connection, and once per request if it is shared.
+//   Both ends update their list of known scopes in the same order while
+//   walking the request, so that they agree on what the server has without
+//   exchanging extra messages.
+
+const ulonglong SCOPE_HASH_SEED = 0xCBF29CE484222325ULL;
+const char      SCOPE_REFERENCE = '#';
+
+
+struct RemoteScopes
+// ----------------------------------------------------------------------------
+//   The most recently used scopes on a connection, by hash
+// ----------------------------------------------------------------------------
+//   Only the server keeps the scopes, the client only needs their hash
+{
+    enum { MAX_SCOPES = 256 };
+
+    bool                Has(ulonglong hash) { return entries.count(hash); }
+    Tree *              Use(ulonglong hash);
+    void                Insert(ulonglong hash, Tree *scope);
+
+private:
+    typedef std::list<ulonglong> Order;
+    struct Entry
+    {
+        Tree_p          scope;
+        Order::iterator position;
+    };
+    Order               order;          // Most recently used first
+    std::map<ulonglong, Entry> entries;
+};
+
+
+Tree *RemoteScopes::Use(ulonglong hash)
+// ----------------------------------------------------------------------------
+//   Mark a known scope as recently used, and return it
+// ----------------------------------------------------------------------------
+{
+    auto found = entries.find(hash);
+    if (found == entries.end())
+        return nullptr;
+    Entry &entry = found->second;
+    order.splice(order.begin(), order, entry.position);
+    return entry.scope;
+}
+
+
+void RemoteScopes::Insert(ulonglong hash, Tree *scope)
+// ----------------------------------------------------------------------------
+//   Record a scope that was sent, forgetting the least recently used one
+// ----------------------------------------------------------------------------
+{
+    if (entries.count(hash))
+    {
+        Use(hash);
+        return;
+    }
+    order.push_front(hash);
+    entries[hash] = Entry { scope, order.begin() };
+    if (order.size() > MAX_SCOPES)
+    {
+        entries.erase(order.back());
+        order.pop_back();
+    }
+}
+
+
+static ulonglong xl_node_hash(Tree *tree, ulonglong left, ulonglong right)
+// ----------------------------------------------------------------------------
+//   Hash a node given the hash of its children, ignoring positions
+// ----------------------------------------------------------------------------
+//   Children that are not used by the kind of node are ignored
+{
+    kind k = tree->Kind();
+    ulonglong hash = ModuleCache::Mix(SCOPE_HASH_SEED, ulonglong(k));
+    switch(k)
+    {
+    case NATURAL:
+        return ModuleCache::Mix(hash, tree->AsNatural()->value);
+    case REAL:
+    {
+        double value = tree->AsReal()->value;
+        ulonglong bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return ModuleCache::Mix(hash, bits);
+    }
+    case TEXT:
+    {
+        Text *t = tree->AsText();
+        hash = ModuleCache::Mix(hash, t->value);
+        hash = ModuleCache::Mix(hash, text(t->opening));
+        return ModuleCache::Mix(hash, text(t->closing));
+    }
+    case NAME:
+        return ModuleCache::Mix(hash, text(tree->AsName()->value));
+    case BLOCK:
+    {
+        Block *block = tree->AsBlock();
+        hash = ModuleCache::Mix(hash, text(block->opening));
+        hash = ModuleCache::Mix(hash, text(block->closing));
+        return ModuleCache::Mix(hash, left);
+    }
+    case INFIX:
+        hash = ModuleCache::Mix(hash, text(tree->AsInfix()->name));
+        // Fall through
+    case PREFIX:
+    case POSTFIX:
+        return ModuleCache::Mix(ModuleCache::Mix(hash, left), right);
+    }
+    return hash;
+}
+
+
+static bool xl_is_nil_name(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Check if a tree is 'nil', or a name that will be restored as 'nil'
+// ----------------------------------------------------------------------------
+{
+    Name *name = tree->AsName();
+    return name && name->value == "nil";
+}
+
+
+static bool xl_may_enclose(Tree *left)
+// ----------------------------------------------------------------------------
+//   Check if the left of a prefix may be an enclosing scope
+// ----------------------------------------------------------------------------
+//   Only such prefixes can be scopes or closures, which may be shared
+{
+    return left->Kind() == PREFIX || xl_is_nil_name(left);
+}
+
+
+static bool xl_is_sent_scope(Tree *left, bool leftIsScope, Tree *right)
+// ----------------------------------------------------------------------------
+//   Check if a prefix with the given children is a scope
+// ----------------------------------------------------------------------------
+//   This only looks at what both ends see, i.e. the left child may
+//   already have been replaced with a reference.
+{
+    if (!leftIsScope && !xl_is_nil_name(left))
+        return false;
+    if (xl_is_nil_name(right))
+        return true;
+    Infix *rewrite = right->AsInfix();
+    return rewrite && rewrite->name == REWRITE_NAME;
+}
+
+
+static text xl_scope_reference(ulonglong hash)
+// ----------------------------------------------------------------------------
+//   The name sent in place of a known scope
+// ----------------------------------------------------------------------------
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%c%016llx", SCOPE_REFERENCE, hash);
+    return buffer;
+}
+
+
+struct ScopeSender
+// ----------------------------------------------------------------------------
+//   Build the request to send, with references to the scopes already sent
+// ----------------------------------------------------------------------------
+//   This works on the symbol table itself, stopping at the cutpoint.
+//   Hashes of scopes and closures are computed once, since they are often
+//   shared. Subtrees without any change are sent as is.
+{
+    ScopeSender(RemoteScopes &scopes, Tree *cutpoint)
+        : scopes(scopes), cutpoint(cutpoint), sent(0), known(0) {}
+
+    Tree *              Send(Tree *tree);
+
+private:
+    struct Hash
+    {
+        ulonglong       value;
+        bool            scope;
+    };
+    Hash                Compute(Tree *tree);
+
+public:
+    RemoteScopes &      scopes;
+    Tree_p              cutpoint;
+    std::unordered_map<Tree *, Hash> prefixes;
+    uint                sent;           // Scopes sent in full
+    uint                known;          // Scopes sent as a reference
+};
+
+
+ScopeSender::Hash ScopeSender::Compute(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Compute the hash of a tree, and check if it is a scope
+// ----------------------------------------------------------------------------
+{
+    if (tree == cutpoint)
+        tree = xl_nil;
+
+    Hash left = { 0, false }, right = { 0, false };
+    switch(tree->Kind())
+    {
+    case BLOCK:
+        left = Compute(tree->AsBlock()->child);
+        break;
+    case INFIX:
+        left = Compute(tree->AsInfix()->left);
+        right = Compute(tree->AsInfix()->right);
+        break;
+    case POSTFIX:
+        left = Compute(tree->AsPostfix()->left);
+        right = Compute(tree->AsPostfix()->right);
+        break;
+    case PREFIX:
+    {
+        auto found = prefixes.find(tree);
+        if (found != prefixes.end())
+            return found->second;
+        Prefix *prefix = tree->AsPrefix();
+        Tree *before = prefix->left;
+        Tree *after = prefix->right;
+        if (before == cutpoint)
+            before = xl_nil;
+        if (after == cutpoint)
+            after = xl_nil;
+        left = Compute(before);
+        right = Compute(after);
+        Hash hash = { xl_node_hash(tree, left.value, right.value),
+                      xl_is_sent_scope(before, left.scope, after) };
+        if (xl_may_enclose(before))
+            prefixes[tree] = hash;
+        return hash;
+    }
+    default:
+        break;
+    }
+    Hash hash = { xl_node_hash(tree, left.value, right.value), false };
+    return hash;
+}
+
+
+Tree *ScopeSender::Send(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Return the tree to send, in the same order as ScopeReceiver::Receive
+// ----------------------------------------------------------------------------
+{
+    if (tree == cutpoint)
+        return xl_nil;
+
+    switch(tree->Kind())
+    {
+    case BLOCK:
+    {
+        Block *block = tree->AsBlock();
+        Tree *child = Send(block->child);
+        if (child != block->child)
+            tree = new Block(child, block->opening, block->closing,
+                             block->Position());
+        break;
+    }
+    case INFIX:
+    {
+        Infix *infix = tree->AsInfix();
+        Tree *left = Send(infix->left);
+        Tree *right = Send(infix->right);
+        if (left != infix->left || right != infix->right)
+            tree = new Infix(infix->name, left, right, infix->Position());
+        break;
+    }
+    case POSTFIX:
+    {
+        Postfix *postfix = tree->AsPostfix();
+        Tree *left = Send(postfix->left);
+        Tree *right = Send(postfix->right);
+        if (left != postfix->left || right != postfix->right)
+            tree = new Postfix(left, right, postfix->Position());
+        break;
+    }
+    case PREFIX:
+    {
+        Prefix *prefix = tree->AsPrefix();
+        Hash hash = { 0, false };
+        if (prefix->left == cutpoint || xl_may_enclose(prefix->left))
+            hash = Compute(prefix);
+        if (hash.scope && scopes.Has(hash.value))
+        {
+            scopes.Use(hash.value);
+            known++;
+            return new Name(xl_scope_reference(hash.value),
+                            prefix->Position());
+        }
+        Tree *left = Send(prefix->left);
+        Tree *right = Send(prefix->right);
+        if (left != prefix->left || right != prefix->right)
+            tree = new Prefix(left, right, prefix->Position());
+        if (hash.scope)
+        {
+            scopes.Insert(hash.value, nullptr);
+            sent++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return tree;
+}
+
+
+struct ScopeReceiver
+// ----------------------------------------------------------------------------
+//   Rebuild a request, replacing references with the scopes received before
+// ----------------------------------------------------------------------------
+//   The scopes are recorded as received, and evaluation uses a copy, so
+//   that evaluating a request does not change what later requests see.
+{
+    ScopeReceiver(RemoteScopes &scopes): scopes(scopes), failed(false) {}
+
+    Tree *              Receive(Tree *tree, ulonglong &hash, bool &scope);
+
+public:
+    RemoteScopes &      scopes;
+    bool                failed;         // Found a reference to unknown scope
+};
+
+
+Tree *ScopeReceiver::Receive(Tree *tree, ulonglong &hash, bool &scope)
+// ----------------------------------------------------------------------------
+//   Replace references in a tree, and return its hash as computed by sender
+// ----------------------------------------------------------------------------
+{
+    ulonglong left = 0, right = 0;
+    bool leftScope = false, rightScope = false;
+    scope = false;
+    switch(tree->Kind())
+    {
+    case NAME:
+    {
+        Name *name = tree->AsName();
+        if (name->value.length() > 1 && name->value[0] == SCOPE_REFERENCE)
+        {
+            hash = strtoull(name->value.c_str() + 1, nullptr, 16);
+            if (Tree *known = scopes.Use(hash))
+            {
+                scope = true;
+                return known;
+            }
+            record(remote_error, "Request refers to unknown scope %s",
+                   name->value.c_str());
+            failed = true;
+        }
+        break;
+    }
+    case BLOCK:
+    {
+        Block *block = tree->AsBlock();
+        block->child = Receive(block->child, left, leftScope);
+        break;
+    }
+    case INFIX:
+    {
+        Infix *infix = tree->AsInfix();
+        infix->left = Receive(infix->left, left, leftScope);
+        infix->right = Receive(infix->right, right, rightScope);
+        break;
+    }
+    case POSTFIX:
+    {
+        Postfix *postfix = tree->AsPostfix();
+        postfix->left = Receive(postfix->left, left, leftScope);
+        postfix->right = Receive(postfix->right, right, rightScope);
+        break;
+    }
+    case PREFIX:
+    {
+        Prefix *prefix = tree->AsPrefix();
+        Tree_p before = prefix->left;
+        Tree_p value = prefix->right;
+        prefix->left = Receive(before, left, leftScope);
+        prefix->right = Receive(value, right, rightScope);
+        hash = xl_node_hash(tree, left, right);
+        scope = xl_is_sent_scope(before, leftScope, value);
+        if (scope)
+            scopes.Insert(hash, prefix);
+        return tree;
+    }
+    default:
+        break;
+    }
+    hash = xl_node_hash(tree, left, right);
+    return tree;
+}
+
+
+struct SharedScopesCloneMode
+// ----------------------------------------------------------------------------
+//   Clone mode copying shared scopes and closures once, and restoring 'nil'
+// ----------------------------------------------------------------------------
+{
+    std::unordered_map<Tree *, Tree *> copies;
+
+    template<typename CloneClass>
+    Tree *Clone(Tree *t, CloneClass *clone)
+    {
+        if (xl_is_nil_name(t))
+            return xl_nil;
+        if (t->Kind() != PREFIX || !xl_may_enclose(t->AsPrefix()->left))
+            return t->Do(clone);
+        auto found = copies.find(t);
+        if (found != copies.end())
+            return found->second;
+        Tree *copy = t->Do(clone);
+        copies[t] = copy;
+        return copy;
+    }
+
+    template<typename CloneClass>
+    Tree *Adjust(Tree * /* from */, Tree *to, CloneClass * /* clone */)
+    {
+        return to;
+    }
+};
+typedef TreeCloneTemplate<SharedScopesCloneMode> SharedScopesClone;
+
+
+static Tree_p xl_send_context(Context &context, Tree *code,
+                              RemoteScopes &scopes)
+// ----------------------------------------------------------------------------
+//   Attach the scope for the given code, except scopes the server has
+// ----------------------------------------------------------------------------
+{
+    ScopeSender sender(scopes, xl_context_cutpoint(context, code));
+    Scope *symbols = context.Symbols();
+    Tree_p symbolsToSend = sender.Send(symbols);
+    code = sender.Send(code);
+    record(remote, "Sending %u scopes, %u known to the server",
+           sender.sent, sender.known);
+    return new Prefix(symbolsToSend, code, code->Position());
+}
+
+
+static Tree_p xl_receive_context(Tree *request, RemoteScopes &scopes)
+// ----------------------------------------------------------------------------
+//   Rebuild the context sent with a request, null if it refers to unknown
+// ----------------------------------------------------------------------------
+//   The context and the code are walked separately, as when sending them.
+{
+    Prefix *prefix = request->AsPrefix();
+    if (!prefix)
+        return request;
+
+    ScopeReceiver receiver(scopes);
+    ulonglong hash;
+    bool scope;
+    prefix->left = receiver.Receive(prefix->left, hash, scope);
+    prefix->right = receiver.Receive(prefix->right, hash, scope);
+    if (receiver.failed)
+        return nullptr;
+
+    SharedScopesClone copy;
+    return copy.Clone(prefix);
+}
+
+
+
+// ============================================================================
+//
+//    Simple program exchange over TCP/IP
+//
+// ============================================================================
+//   Connections to each host are kept open between requests. Requests are
+//   sent without waiting for the results of earlier ones, and results come
+//   back in the order of the requests.
+
+struct RemoteConnection
+// ----------------------------------------------------------------------------
+//   A connection to a host, with the requests sent on it
+// ----------------------------------------------------------------------------
+{
+    enum { MAX_PENDING = 64 };          // Requests sent without results
+    enum { READ_SIZE = 64 * 1024 };     // Size of reads from the socket
+
+    RemoteConnection(text host, int sock)
+        : host(host), sock(sock), sent(0), done(0), failed(false),
+          start(0) {}
+    ~RemoteConnection() { close(sock); }
+
+    ulong               Send(Context &context, Tree *code, bool wanted);
+    Tree *              Receive(ulong request, frame_kind &kind);
+    bool                Poll();
+    bool                Ready(ulong request) { return results.count(request); }
+    bool                Idle()  { return sent == done; }
+
+private:
+    bool                Read(bool wait);
+    size_t              Missing();
+    bool                Frame(kstring &frame, size_t &size, frame_kind &kind);
+    Tree *              Dispatch(kstring frame, size_t size, frame_kind kind,
+                                 ulong request);
+
+public:
+    text                host;
+    int                 sock;
+    ulong               sent;           // Number of requests sent
+    ulong               done;           // Number of results received
+    bool                failed;         // Received an invalid frame
+    std::set<ulong>     ignored;        // Requests whose result is dropped
+    std::map<ulong, Tree_p> results;    // Results read for later requests
+    text                input;          // Data read from the socket
+    size_t              start;          // Start of the next frame in input
+    RemoteScopes        scopes;         // Scopes the server already has
+};
+typedef std::map<text, RemoteConnection *> RemoteConnections;
+static RemoteConnections connections;
+
+
+struct RemoteFuture
+// ----------------------------------------------------------------------------
+//   The result of a request sent by 'ask_async', until it is waited for
+// ----------------------------------------------------------------------------
+{
+    RemoteConnection *  connection;     // Null once the result is known
+    ulong               request;        // Request number on the connection
+    Scope_p             scope;          // Scope the result is merged into
+    Tree_p              result;
+};
+typedef std::map<ulong, RemoteFuture> RemoteFutures;
+static RemoteFutures futures;
+static ulong         lastFuture = 0;
+
+
+ulong RemoteConnection::Send(Context &context, Tree *code, bool wanted)
+// ----------------------------------------------------------------------------
+//   Send a request with its context, return its number, 0 if it failed
+// ----------------------------------------------------------------------------
+{
+    // Limit the number of requests in flight, so that we do not block
+    // writing requests while the other side blocks writing results
+    while (sent - done >= MAX_PENDING)
+    {
+        ulong next = done + 1;
+        frame_kind kind;
+        Tree_p tree = Receive(next, kind);
+        if (tree && kind == FRAME_RESULT)
+            results[next] = tree;
+        else if (!tree && done < next)
+            return 0;
+    }
+
+    // Attach the running context, i.e. all symbols we might need
+    Tree_p request = xl_send_context(context, code, scopes);
+    if (!xl_write_tree(sock, request, FRAME_REQUEST))
+        return 0;
+    sent++;
+    if (!wanted)
+        ignored.insert(sent);
+    return sent;
+}
+
+
+Tree *RemoteConnection::Receive(ulong request, frame_kind &kind)
+// ----------------------------------------------------------------------------
+//   Wait for the next reply or the result for the given request
+// ----------------------------------------------------------------------------
+{
+    auto found = results.find(request);
+    if (found != results.end())
+    {
+        Tree_p result = found->second;
+        results.erase(found);
+        kind = FRAME_RESULT;
+        return result;
+    }
+
+    kstring frame;
+    size_t size;
+    while (done < request)
+    {
+        while (!Frame(frame, size, kind))
+            if (failed || !Read(true))
+                return nullptr;
+        if (Tree *tree = Dispatch(frame, size, kind, request))
+            return tree;
+    }
+    return nullptr;
+}
+
+
+bool RemoteConnection::Poll()
+// ----------------------------------------------------------------------------
+//   Process the frames that arrived without waiting, false on error
+// ----------------------------------------------------------------------------
+{
+    if (!Read(false))
+        return false;
+    kstring frame;
+    size_t size;
+    frame_kind kind;
+    while (Frame(frame, size, kind))
+        Dispatch(frame, size, kind, 0);
+    return !failed;
+}
+
+
+bool RemoteConnection::Read(bool wait)
+// ----------------------------------------------------------------------------
+//   Append the data available on the socket to the input
+// ----------------------------------------------------------------------------
+//   Return false at end of input or on error. When not waiting, having
+//   no data available is not an error. The rest of a large frame is read
+//   directly into the input, other data goes through a local buffer.
+{
+    // Drop the frames already processed
+    if (start)
+    {
+        input.erase(0, start);
+        start = 0;
+    }
+
+    char buffer[READ_SIZE];
+    size_t missing = Missing();
+    size_t used = input.size();
+    char *data = buffer;
+    if (missing > READ_SIZE)
+    {
+        input.resize(used + missing);
+        data = &input[used];
+    }
+    else
+    {
+        missing = READ_SIZE;
+    }
+
+    ssize_t got;
+    do
+        got = recv(sock, data, missing, wait ? 0 : MSG_DONTWAIT);
+    while (got < 0 && errno == EINTR);
+    if (data != buffer)
+        input.resize(used + (got > 0 ? got : 0));
+    if (got < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    if (got <= 0)
+        return false;
+    if (data == buffer)
+        input.append(buffer, got);
+    return true;
+}
+
 
-            // And make the resulting code a closure at that location
-            code = Interpreter::MakeClosure(codeCtx, code);
-        }
-    }
+size_t RemoteConnection::Missing()
+// ----------------------------------------------------------------------------
+//   Return the number of bytes missing to complete the next frame, if known
+// ----------------------------------------------------------------------------
+{
+    size_t available = input.size() - start;
+    frame_kind kind;
+    size_t size;
+    if (available < FRAME_HEADER ||
+        !xl_frame_header((const byte *) input.data() + start, kind, size) ||
+        available >= FRAME_HEADER + size)
+        return 0;
+    return FRAME_HEADER + size - available;
+}
 
-    return code;
+
+bool RemoteConnection::Frame(kstring &frame, size_t &size, frame_kind &kind)
+// ----------------------------------------------------------------------------
+//   Find the next complete frame in the input, if any
+// ----------------------------------------------------------------------------
+//   The frame remains in the input until the next read
+{
+    size_t available = input.size() - start;
+    if (failed || available < FRAME_HEADER)
+        return false;
+    if (!xl_frame_header((const byte *) input.data() + start, kind, size))
+    {
+        failed = true;
+        return false;
+    }
+    if (available < FRAME_HEADER + size)
+        return false;
+    frame = input.data() + start + FRAME_HEADER;
+    start += FRAME_HEADER + size;
+    return true;
 }
 
 
+Tree *RemoteConnection::Dispatch(kstring frame, size_t size, frame_kind kind,
+                                 ulong request)
+// ----------------------------------------------------------------------------
+//   Process a frame, return the tree if it is for the given request
+// ----------------------------------------------------------------------------
+//   Results of other requests are kept if wanted. Replies sent while
+//   evaluating other requests are dropped.
+{
+    ulong current = done + 1;
+    if (kind == FRAME_RESULT)
+        done++;
+    else if (current != request)
+        return nullptr;
+    if (kind == FRAME_RESULT && ignored.erase(current))
+        return nullptr;
+
+    Tree *tree = Deserializer::Read(frame, size);
+    if (current == request)
+        return tree;
+    results[current] = tree;
+    return nullptr;
+}
 
-// ============================================================================
-//
-//    Simple program exchange over TCP/IP
-//
-// ============================================================================
 
-static int xl_send(Context &context, text host, Tree *code)
+static int xl_connect(text host)
 // ----------------------------------------------------------------------------
-//   Send the text for the given body to the target host, return open fd
+//   Open a connection to the target host, return open fd
 // ----------------------------------------------------------------------------
 {
     // Compute port number
@@ -281,6 +1154,7 @@ static int xl_send(Context &context, text host, Tree *code)
     {
         record(remote_error, "Error resolving server %s: %s (%d)",
                host.c_str(), strerror(errno), errno);
+        close(sock);
         return -1;
     }
 
@@ -297,16 +1171,113 @@ static int xl_send(Context &context, text host, Tree *code)
     {
         record(remote_error, "Error connecting to %s port %d: %s (%d)",
                host.c_str(), port, strerror(errno), errno);
+        close(sock);
         return -1;
     }
+    xl_no_delay(sock);
 
-    // Attach the running context, i.e. all symbols we might need
-    code = xl_attach_context(context, code);
+    return sock;
+}
 
-    // Write program to socket
-    xl_write_tree(sock, code);
 
-    return sock;
+static void xl_disconnect(text host)
+// ----------------------------------------------------------------------------
+//   Close the connection to the host, e.g. after an error
+// ----------------------------------------------------------------------------
+{
+    auto found = connections.find(host);
+    if (found != connections.end())
+    {
+        record(remote, "Closing connection to %s", host.c_str());
+        RemoteConnection *connection = found->second;
+
+        // Requests that did not get their result yet will not get it
+        for (auto &f : futures)
+        {
+            RemoteFuture &future = f.second;
+            if (future.connection == connection)
+            {
+                frame_kind kind;
+                if (connection->Ready(future.request))
+                    future.result = connection->Receive(future.request, kind);
+                else
+                    future.result = xl_nil;
+                future.connection = nullptr;
+            }
+        }
+
+        delete connection;
+        connections.erase(found);
+    }
+}
+
+
+static bool xl_closed_by_peer(int sock)
+// ----------------------------------------------------------------------------
+//   Check if the other side closed an idle connection
+// ----------------------------------------------------------------------------
+//   Nothing should come on an idle connection, so input means it was closed
+{
+#ifdef HAVE_SYS_SOCKET_H
+    pollfd fds = { sock, POLLIN, 0 };
+    return poll(&fds, 1, 0) != 0;
+#else // !HAVE_SYS_SOCKET_H
+    return false;
+#endif // HAVE_SYS_SOCKET_H
+}
+
+
+static RemoteConnection *xl_connection(text host)
+// ----------------------------------------------------------------------------
+//   Return the open connection to the host, or open a new one
+// ----------------------------------------------------------------------------
+{
+    auto found = connections.find(host);
+    if (found != connections.end())
+    {
+        RemoteConnection *connection = found->second;
+        if (!connection->Idle() || !xl_closed_by_peer(connection->sock))
+            return connection;
+        xl_disconnect(host);
+    }
+
+    int sock = xl_connect(host);
+    if (sock < 0)
+        return nullptr;
+    record(remote, "Opened connection %d to %s", sock, host.c_str());
+    RemoteConnection *connection = new RemoteConnection(host, sock);
+    connections[host] = connection;
+    return connection;
+}
+
+
+static RemoteConnection *xl_send(Context &context, text host, Tree *code,
+                                 ulong *request)
+// ----------------------------------------------------------------------------
+//   Send the given body to the target host, return connection used
+// ----------------------------------------------------------------------------
+//   If the request is null, the result will be dropped when it arrives.
+//   A connection closed by the other side is replaced once.
+{
+    for (uint attempt = 0; attempt < 2; attempt++)
+    {
+        RemoteConnection *connection = xl_connection(host);
+        if (!connection)
+            return nullptr;
+
+        // Write program to socket
+        ulong sent = connection->Send(context, code, request != nullptr);
+        if (sent)
+        {
+            if (request)
+                *request = sent;
+            return connection;
+        }
+        record(remote_error, "Error sending to %s: %s (%d)",
+               host.c_str(), strerror(errno), errno);
+        xl_disconnect(host);
+    }
+    return nullptr;
 }
 
 
@@ -317,10 +1288,9 @@ int xl_tell(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_tell, "Telling %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
-        return sock;
-    close(sock);
+    RemoteConnection *connection = xl_send(context, host, code, nullptr);
+    if (!connection)
+        return -1;
     return 0;
 }
 
@@ -332,16 +1302,26 @@ Tree_p xl_ask(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_ask, "Asking %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
+    ulong request = 0;
+    RemoteConnection *connection = xl_send(context, host, code, &request);
+    if (!connection)
         return xl_nil;
 
-    Tree_p result = xl_read_tree(sock);
+    // Skip replies, the result comes last
+    frame_kind kind = FRAME_REPLY;
+    Tree_p result = nullptr;
+    while (kind != FRAME_RESULT)
+    {
+        result = connection->Receive(request, kind);
+        if (!result)
+        {
+            xl_disconnect(host);
+            return xl_nil;
+        }
+    }
     result = xl_merge_context(context, result);
     record(remote_ask, "Response from %s was %t", host.c_str(), result);
 
-    close(sock);
-
     return result;
 }
 
@@ -353,14 +1333,16 @@ Tree_p xl_invoke(Scope *scope, text host, Tree *code)
 {
     Context context(scope);
     record(remote_invoke, "Invoking %s: %t", host.c_str(), code);
-    int sock = xl_send(context, host, code);
-    if (sock < 0)
+    ulong request = 0;
+    RemoteConnection *connection = xl_send(context, host, code, &request);
+    if (!connection)
         return xl_nil;
 
     Tree_p result = xl_nil;
-    while (true)
+    frame_kind kind = FRAME_REPLY;
+    while (kind != FRAME_RESULT)
     {
-        Tree_p response = xl_read_tree(sock);
+        Tree_p response = connection->Receive(request, kind);
         if (response == nullptr)
             break;
 
@@ -373,12 +1355,210 @@ Tree_p xl_invoke(Scope *scope, text host, Tree *code)
         if (result == xl_nil)
             break;
     }
-    close(sock);
 
+    // If we stopped early, the rest of the replies will not be read
+    if (kind != FRAME_RESULT)
+        xl_disconnect(host);
+
+    return result;
+}
+
+
+
+ulong xl_ask_async(Scope *scope, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to the target, return a handle to wait for the result
+// ----------------------------------------------------------------------------
+{
+    Context context(scope);
+    record(remote_ask, "Asking %s asynchronously: %t", host.c_str(), code);
+    ulong request = 0;
+    RemoteConnection *connection = xl_send(context, host, code, &request);
+
+    ulong handle = ++lastFuture;
+    RemoteFuture &future = futures[handle];
+    future.connection = connection;
+    future.request = request;
+    future.scope = scope;
+    future.result = connection ? nullptr : xl_nil;
+    record(remote_ask, "Handle %lu for request %lu to %s",
+           handle, request, host.c_str());
+    return handle;
+}
+
+
+static bool xl_future_done(RemoteFuture &future)
+// ----------------------------------------------------------------------------
+//   Check if the result of a future is known, and collect it if it is
+// ----------------------------------------------------------------------------
+{
+    RemoteConnection *connection = future.connection;
+    if (!connection)
+        return true;
+    if (!connection->Ready(future.request))
+        return false;
+    frame_kind kind;
+    future.result = connection->Receive(future.request, kind);
+    future.connection = nullptr;
+    if (!future.result)
+        future.result = xl_nil;
+    return true;
+}
+
+
+static ulong xl_wait_futures(const std::vector<ulong> &handles, bool all)
+// ----------------------------------------------------------------------------
+//   Wait until all or any of the futures is done, return one that is done
+// ----------------------------------------------------------------------------
+//   All the connections with pending results are polled together, so that
+//   requests sent to different hosts are evaluated concurrently
+{
+    std::vector<pollfd> fds;
+    std::vector<RemoteConnection *> polled;
+    while (true)
+    {
+        ulong done = 0;
+        bool pending = false;
+        fds.clear();
+        polled.clear();
+        for (ulong handle : handles)
+        {
+            auto found = futures.find(handle);
+            if (found == futures.end())
+                continue;
+            RemoteFuture &future = found->second;
+            if (xl_future_done(future))
+            {
+                if (!done)
+                    done = handle;
+                continue;
+            }
+            pending = true;
+            RemoteConnection *connection = future.connection;
+            if (std::find(polled.begin(), polled.end(), connection) ==
+                polled.end())
+            {
+                pollfd fd = { connection->sock, POLLIN, 0 };
+                fds.push_back(fd);
+                polled.push_back(connection);
+            }
+        }
+        if (!pending || (done && !all))
+            return done;
+
+        record(remote_ask, "Waiting for %u connections", (uint) fds.size());
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+        {
+            record(remote_error, "Error waiting for results: %s (%d)",
+                   strerror(errno), errno);
+            for (RemoteConnection *connection : polled)
+                xl_disconnect(connection->host);
+            continue;
+        }
+        for (uint i = 0; i < fds.size(); i++)
+            if (fds[i].revents && !polled[i]->Poll())
+                xl_disconnect(polled[i]->host);
+    }
+}
+
+
+static Tree *xl_future_result(ulong handle)
+// ----------------------------------------------------------------------------
+//   Return the result of a future that is done, and forget the future
+// ----------------------------------------------------------------------------
+{
+    auto found = futures.find(handle);
+    if (found == futures.end())
+    {
+        record(remote_error, "Invalid handle %lu", handle);
+        return xl_nil;
+    }
+    RemoteFuture &future = found->second;
+    Context context(future.scope);
+    Tree_p result = xl_merge_context(context, future.result);
+    futures.erase(found);
+    record(remote_ask, "Result for handle %lu was %t", handle, result);
+    return result;
+}
+
+
+static void xl_handles(Scope *scope, Tree *tree, std::vector<ulong> &handles)
+// ----------------------------------------------------------------------------
+//   Evaluate a comma-separated list of handles
+// ----------------------------------------------------------------------------
+{
+    Infix *infix = tree->AsInfix();
+    if (infix && infix->name == ",")
+    {
+        xl_handles(scope, infix->left, handles);
+        xl_handles(scope, infix->right, handles);
+        return;
+    }
+
+    Tree_p value = xl_evaluate(scope, tree);
+    if (Natural *natural = value->AsNatural())
+        handles.push_back(natural->value);
+    else if (value != tree && value->AsInfix())
+        xl_handles(scope, value, handles);
+    else
+        record(remote_error, "Invalid handle %t", value.Pointer());
+}
+
+
+Tree_p xl_wait(Scope *scope, ulong handle)
+// ----------------------------------------------------------------------------
+//   Wait for the result of an asynchronous request
+// ----------------------------------------------------------------------------
+{
+    std::vector<ulong> handles(1, handle);
+    xl_wait_futures(handles, true);
+    return xl_future_result(handle);
+}
+
+
+Tree_p xl_wait_all(Scope *scope, Tree *list)
+// ----------------------------------------------------------------------------
+//   Wait for all the given requests, return the list of their results
+// ----------------------------------------------------------------------------
+{
+    std::vector<ulong> handles;
+    xl_handles(scope, list, handles);
+    xl_wait_futures(handles, true);
+
+    Tree_p result = nullptr;
+    Tree_p *last = &result;
+    for (ulong handle : handles)
+    {
+        Tree_p value = xl_future_result(handle);
+        if (*last)
+        {
+            Infix *infix = new Infix(",", *last, value, list->Position());
+            *last = infix;
+            last = &infix->right;
+        }
+        else
+        {
+            *last = value;
+        }
+    }
+    if (!result)
+        result = xl_nil;
     return result;
 }
 
 
+ulong xl_wait_any(Scope *scope, Tree *list)
+// ----------------------------------------------------------------------------
+//   Wait for any of the given requests, return its handle
+// ----------------------------------------------------------------------------
+//   The result remains available with 'wait'
+{
+    std::vector<ulong> handles;
+    xl_handles(scope, list, handles);
+    return xl_wait_futures(handles, false);
+}
+
+
 
 // ============================================================================
 //
@@ -456,13 +1636,11 @@ Tree_p xl_listen_hook(Tree *newHook)
 }
 
 
-int xl_listen(Scope *scope, uint forking, uint port)
+static int xl_listen_socket(uint port)
 // ----------------------------------------------------------------------------
-//    Listen on the given port for sockets, evaluate programs when received
+//    Open a socket listening on the given port
 // ----------------------------------------------------------------------------
 {
-    // Open the socket
-    Context context(scope);
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0)
     {
@@ -485,11 +1663,66 @@ int xl_listen(Scope *scope, uint forking, uint port)
     {
         record(remote_error, "Error binding to port %d: %s (%d)",
                port, strerror(errno), errno);
+        close(sock);
         return -1;
     }
 
     // Listen to socket
     listen(sock, 5);
+    return sock;
+}
+
+
+static bool xl_serve(Scope *scope, Context &context, int insock,
+                     RemoteScopes &scopes)
+// ----------------------------------------------------------------------------
+//    Read a program from the socket, evaluate it and send the result back
+// ----------------------------------------------------------------------------
+//    Return false if the connexion can no longer be used.
+//    A result is always sent, so that the client does not wait for it.
+{
+    // Read data from client
+    frame_kind kind;
+    Tree_p code = xl_read_tree(insock, kind);
+    if (!code || kind != FRAME_REQUEST)
+        return false;
+    code = xl_receive_context(code, scopes);
+    if (!code)
+        return false;
+
+    // Evaluate resulting code
+    record(remote_listen, "Received code: %t", code);
+    received = code;
+    Tree_p hookResult = xl_evaluate(scope, hook);
+    Tree_p result = xl_nil;
+    if (hookResult != xl_nil)
+    {
+        Save<int> saveReply(reply_socket, insock);
+        code = xl_merge_context(context, code, true);
+        result = xl_evaluate(scope, code);
+        record(remote_listen, "Evaluated as %t", result);
+    }
+    if (hookResult == xl_false || hookResult == xl_nil)
+    {
+        listening = false;
+    }
+    if (!xl_write_tree(insock, result, FRAME_RESULT))
+        return false;
+    record(remote_listen, "Response sent");
+    return true;
+}
+
+
+int xl_listen(Scope *scope, uint forking, uint port)
+// ----------------------------------------------------------------------------
+//    Listen on the given port for sockets, evaluate programs when received
+// ----------------------------------------------------------------------------
+{
+    // Open the socket
+    Context context(scope);
+    int sock = xl_listen_socket(port);
+    if (sock < 0)
+        return -1;
 
     // Make sure we get notified when a child dies
     signal(SIGCHLD, child_died);
@@ -519,6 +1752,7 @@ int xl_listen(Scope *scope, uint forking, uint port)
             continue;
         }
         record(remote_listen, "Got incoming connexion");
+        xl_no_delay(insock);
 
         // Fork child for incoming connexion
         int pid = forking ? fork() : 0;
@@ -534,29 +1768,10 @@ int xl_listen(Scope *scope, uint forking, uint port)
         }
         else
         {
-            // Read data from client
-            Tree_p code = xl_read_tree(insock);
-
-            // Evaluate resulting code
-            if (code)
-            {
-                record(remote_listen, "Received code: %t", code);
-                received = code;
-                Tree_p hookResult = xl_evaluate(scope, hook);
-                if (hookResult != xl_nil)
-                {
-                    Save<int> saveReply(reply_socket, insock);
-                    code = xl_merge_context(context, code);
-                    Tree_p result = xl_evaluate(scope, code);
-                    record(remote_listen, "Evaluated as %t", result);
-                    xl_write_tree(insock, result);
-                    record(remote_listen, "Response sent");
-                }
-                if (hookResult == xl_false || hookResult == xl_nil)
-                {
-                    listening = false;
-                }
-            }
+            // Serve requests until the client closes the connexion
+            RemoteScopes scopes;
+            while (xl_serve(scope, context, insock, scopes) && listening)
+                /* Loop */;
             close(insock);
 
             if (forking)
@@ -572,6 +1787,164 @@ int xl_listen(Scope *scope, uint forking, uint port)
 }
 
 
+#ifdef HAVE_SYS_EPOLL_H
+static int xl_listen_worker(Scope *scope, int sock)
+// ----------------------------------------------------------------------------
+//    Serve the connexions of a pool worker until asked to stop listening
+// ----------------------------------------------------------------------------
+//    All workers wait for the listening socket, which is non-blocking so
+//    that a worker losing the race to accept a connexion goes back to
+//    waiting. Connexions remain open until the client closes them.
+//    Returns the exit code for the worker process
+{
+    Context context(scope);
+    int events = epoll_create1(EPOLL_CLOEXEC);
+    if (events < 0)
+    {
+        record(remote_error, "Error creating epoll instance: %s (%d)",
+               strerror(errno), errno);
+        return 1;
+    }
+
+    epoll_event event = { 0 };
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    event.events |= EPOLLEXCLUSIVE;     // Do not wake up all workers
+#endif // EPOLLEXCLUSIVE
+    event.data.fd = sock;
+    if (epoll_ctl(events, EPOLL_CTL_ADD, sock, &event) < 0)
+    {
+        record(remote_error, "Error waiting for port: %s (%d)",
+               strerror(errno), errno);
+        close(events);
+        return 1;
+    }
+
+    const int MAX_EVENTS = 16;
+    epoll_event ready[MAX_EVENTS];
+    std::map<int, RemoteScopes> scopes;
+    while (listening)
+    {
+        int count = epoll_wait(events, ready, MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR)
+        {
+            record(remote_error, "Error waiting for input: %s (%d)",
+                   strerror(errno), errno);
+            close(events);
+            return 1;
+        }
+
+        for (int i = 0; i < count && listening; i++)
+        {
+            int fd = ready[i].data.fd;
+            if (fd == sock)
+            {
+                int insock = accept(sock, nullptr, nullptr);
+                if (insock < 0)
+                    continue;
+                record(remote_listen, "Worker %d got incoming connexion %d",
+                       getpid(), insock);
+                xl_no_delay(insock);
+                event.events = EPOLLIN;
+                event.data.fd = insock;
+                if (epoll_ctl(events, EPOLL_CTL_ADD, insock, &event) < 0)
+                    close(insock);
+            }
+            else if (!xl_serve(scope, context, fd, scopes[fd]))
+            {
+                record(remote_listen, "Worker %d closing connexion %d",
+                       getpid(), fd);
+                epoll_ctl(events, EPOLL_CTL_DEL, fd, nullptr);
+                scopes.erase(fd);
+                close(fd);
+            }
+        }
+    }
+
+    close(events);
+    return 42;
+}
+#endif // HAVE_SYS_EPOLL_H
+
+
+int xl_listen_pool(Scope *scope, uint workers, uint port)
+// ----------------------------------------------------------------------------
+//    Listen on the given port with a fixed number of worker processes
+// ----------------------------------------------------------------------------
+//    Workers are forked once and serve requests until one of them is
+//    asked to stop listening. A worker that dies is replaced.
+{
+#ifdef HAVE_SYS_EPOLL_H
+    int sock = xl_listen_socket(port);
+    if (sock < 0)
+        return -1;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    // Workers are waited for below, not by the SIGCHLD handler
+    signal(SIGCHLD, SIG_DFL);
+
+    std::vector<pid_t> pids(workers, 0);
+    int rc = 0;
+    listening = true;
+    while (listening)
+    {
+        // Start missing workers
+        for (pid_t &pid : pids)
+        {
+            if (pid)
+                continue;
+            pid = fork();
+            if (pid == 0)
+                exit(xl_listen_worker(scope, sock));
+            if (pid < 0)
+            {
+                std::cerr << "xl_listen: Error forking worker\n";
+                pid = 0;
+                listening = false;
+                rc = -1;
+                break;
+            }
+            record(remote_listen, "Forked worker %d", pid);
+        }
+
+        // Wait for a worker to exit
+        int status = 0;
+        pid_t dead = listening ? waitpid(-1, &status, 0) : 0;
+        if (dead < 0 && errno != EINTR)
+            break;
+        for (pid_t &pid : pids)
+        {
+            if (dead <= 0 || pid != dead)
+                continue;
+            pid = 0;
+            record(remote_listen, "Worker %d died, status %d", dead, status);
+            if (WIFEXITED(status))
+            {
+                listening = false;
+                if (WEXITSTATUS(status) != 42)
+                    rc = -1;
+            }
+        }
+    }
+
+    // Stop the remaining workers
+    for (pid_t pid : pids)
+        if (pid)
+            kill(pid, SIGTERM);
+    for (pid_t pid : pids)
+        if (pid)
+            waitpid(pid, nullptr, 0);
+
+    close(sock);
+    return rc;
+#else // !HAVE_SYS_EPOLL_H
+    record(remote_listen, "No worker pool, forking up to %u children",
+           workers);
+    return xl_listen(scope, workers, port);
+#endif // HAVE_SYS_EPOLL_H
+}
+
+
 int xl_reply(Scope *scope, Tree *code)
 // ----------------------------------------------------------------------------
 //   Send code back to whoever invoked us
@@ -587,7 +1960,8 @@ int xl_reply(Scope *scope, Tree *code)
     record(remote_reply, "Replying: %t", code);
     code = xl_attach_context(context, code);
     record(remote_reply, "After replacement: %t", code);
-    xl_write_tree(reply_socket, code);
+    if (!xl_write_tree(reply_socket, code, FRAME_REPLY))
+        return -1;
     return 0;
 }
 
@@ -62,7 +62,9 @@
 #include <iostream>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
 #include <sstream>
+#include <vector>
 #include <iostream>
 #include <errno.h>
 #include <sys/stat.h>
@@ -196,7 +198,7 @@ Natural *xl_new_natural(TreePosition pos, ulonglong value)
 //    Called by generated code to build a new Natural
 // ----------------------------------------------------------------------------
 {
-    Natural *result = new Natural(value, pos);
+    Natural *result = Natural::Make(value, pos);
     return result;
 }
 
@@ -650,6 +652,30 @@ struct LoadDataInfo : Info
 };
 
 
+static Tree *DataField(kstring data, size_t size)
+// ----------------------------------------------------------------------------
+//   Convert a field read from a data file to a number or a text
+// ----------------------------------------------------------------------------
+//   The data must be followed by a null character.
+//   Surrounding quotes are removed from texts.
+{
+    if (isdigit(data[0]) ||
+        ((data[0] == '-' || data[0] == '+') && isdigit(data[1])))
+    {
+        char *end = nullptr;
+        longlong l = strtoll(data, &end, 10);
+        if (end == data + size)
+            return new Natural(l);
+        double d = strtod(data, &end);
+        if (end == data + size)
+            return new Real(d);
+    }
+    if (data[0] == '"' && size > 1 && data[size-1] == '"')
+        return new Text(text(data + 1, size - 2));
+    return new Text(text(data, size));
+}
+
+
 Tree *xl_load_data(Scope *scope, Tree *self,
                    text name, text prefix, text fieldSeps, text recordSeps,
                    Tree *body)
@@ -786,33 +812,7 @@ Tree *xl_load_data(Scope *scope, Tree *self, text inputName,
 
         if (!c)
         {
-            text token;
-            Tree *child = nullptr;
-
-            if (isdigit(buffer[0]) ||
-                ((buffer[0] == '-' || buffer[0] == '+') && isdigit(buffer[1])))
-            {
-                char *ptr2 = nullptr;
-                longlong l = strtoll(buffer, &ptr2, 10);
-                if (ptr2 == ptr-1)
-                {
-                    child = new Natural(l);
-                }
-                else
-                {
-                    double d = strtod (buffer, &ptr2);
-                    if (ptr2 == ptr-1)
-                        child = new Real(d);
-                }
-            }
-            if (child == nullptr)
-            {
-                if (buffer[0] == '"' && ptr > buffer+2 && ptr[-2] == '"')
-                    token = text(buffer+1, ptr - buffer - 3);
-                else
-                    token = text(buffer, ptr - buffer - 1);
-                child = new Text(token);
-            }
+            Tree *child = DataField(buffer, ptr - buffer - 1);
 
             // Combine data that we just read to current line
             if (hasPrefix)
@@ -884,6 +884,198 @@ Tree *xl_load_data(Scope *scope, Tree *self, text inputName,
 }
 
 
+struct DataReader
+// ----------------------------------------------------------------------------
+//   Split a data stream into fields and records, reading it in large blocks
+// ----------------------------------------------------------------------------
+//   Fields follow the same rules as in xl_load_data, except that they are
+//   not truncated, and that an unterminated last record is kept.
+//   Only the current block and the current field are kept in memory.
+{
+    enum { BLOCK_SIZE = 64 * 1024 };
+    enum { END, FIELD, RECORD };                        // Result of Read()
+    enum { FIELD_SEP = 1, RECORD_SEP = 2, QUOTE = 4, SPACE = 8 };
+
+    DataReader(std::istream &input, text fieldSeps, text recordSeps)
+        : input(input), block(BLOCK_SIZE), ptr(nullptr), end(nullptr),
+          inRecord(false)
+    {
+        for (uint c = 0; c < 256; c++)
+            kinds[c] = (c != '\n' && isspace(c)) ? SPACE : 0;
+        for (char c : fieldSeps)
+            kinds[(byte) c] |= FIELD_SEP;
+        for (char c : recordSeps)
+            kinds[(byte) c] |= RECORD_SEP;
+        if (!(kinds[(byte) '"'] & (FIELD_SEP | RECORD_SEP)))
+            kinds[(byte) '"'] |= QUOTE;
+    }
+
+    uint Read(text &field);
+
+private:
+    bool Fill();
+
+    std::istream &      input;
+    std::vector<char>   block;
+    kstring             ptr;            // Next byte in the block
+    kstring             end;            // End of the bytes read in the block
+    bool                inRecord;       // Fields were read in the record
+    byte                kinds[256];     // Classification of input bytes
+};
+
+
+bool DataReader::Fill()
+// ----------------------------------------------------------------------------
+//   Read the next block, return false at end of input
+// ----------------------------------------------------------------------------
+{
+    if (!input.good())
+        return false;
+    input.read(block.data(), block.size());
+    ptr = block.data();
+    end = ptr + input.gcount();
+    return ptr < end;
+}
+
+
+uint DataReader::Read(text &field)
+// ----------------------------------------------------------------------------
+//   Read the next field, return what ends it
+// ----------------------------------------------------------------------------
+//   Runs of plain bytes are located with the classification table, and
+//   quoted text with memchr, then appended to the field at once
+{
+    bool quoted = false;
+    field.clear();
+    for (;;)
+    {
+        if (ptr == end && !Fill())
+        {
+            if (!inRecord && field.empty())
+                return END;
+            inRecord = false;
+            return RECORD;
+        }
+
+        if (quoted)
+        {
+            kstring quote = (kstring) memchr(ptr, '"', end - ptr);
+            kstring stop = quote ? quote : end;
+            field.append(ptr, stop - ptr);
+            ptr = stop;
+            if (!quote)
+                continue;
+
+            // A doubled quote stands for a quote in quoted text
+            field += '"';
+            ptr++;
+            if (ptr == end && !Fill())
+                continue;
+            if (*ptr == '"')
+                ptr++;
+            else
+                quoted = false;
+            continue;
+        }
+
+        // Skip spaces at the beginning of a field
+        if (field.empty())
+            while (ptr < end && (kinds[(byte) *ptr] & SPACE))
+                ptr++;
+
+        kstring start = ptr;
+        while (ptr < end && !(kinds[(byte) *ptr] & ~SPACE))
+            ptr++;
+        field.append(start, ptr - start);
+        if (ptr == end)
+            continue;
+
+        byte kind = kinds[(byte) *ptr++];
+        if (kind & RECORD_SEP)
+        {
+            inRecord = false;
+            return RECORD;
+        }
+        if (kind & FIELD_SEP)
+        {
+            inRecord = true;
+            return FIELD;
+        }
+        field += '"';
+        quoted = true;
+    }
+}
+
+
+Tree *xl_stream_data(Scope *scope, Tree *self,
+                     text name, text prefix, text fieldSeps, text recordSeps,
+                     Tree *body)
+// ----------------------------------------------------------------------------
+//    Pass the records of a data file to a prefix without keeping them
+// ----------------------------------------------------------------------------
+{
+    text path = MAIN->SearchFile(name);
+    if (path == "")
+    {
+        Ooops("CSV file $2 not found in $1", self).Arg(name);
+        return XL::xl_false;
+    }
+
+    utf8_ifstream input(path.c_str(), std::ifstream::in);
+    if (!input.good())
+    {
+        Ooops("Unable to load data for $1.\n"
+                     "(Accessing $2 resulted in the following error: $3)",
+              self).Arg(path).Arg(strerror(errno));
+        return XL::xl_nil;
+    }
+
+    return xl_stream_data(scope, self, path, input,
+                          prefix, fieldSeps, recordSeps, body);
+}
+
+
+Tree *xl_stream_data(Scope *scope, Tree *self, text inputName,
+                     std::istream &input,
+                     text prefix, text fieldSeps, text recordSeps,
+                     Tree *body)
+// ----------------------------------------------------------------------------
+//   Variant reading from a stream directly
+// ----------------------------------------------------------------------------
+//   Unlike xl_load_data, nothing is cached, and the memory used does not
+//   depend on the size of the input, only on the size of a record.
+//   The result is the value returned for the last record.
+{
+    if (prefix.empty())
+    {
+        Ooops("No prefix to receive the data from $2 in $1", self)
+            .Arg(inputName);
+        return XL::xl_false;
+    }
+
+    DataReader reader(input, fieldSeps, recordSeps);
+    Tree_p     result = xl_false;
+    TreeList   args;
+    text       field;
+    ulonglong  records = 0;
+    while (uint read = reader.Read(field))
+    {
+        args.push_back(DataField(field.c_str(), field.size()));
+        if (read == DataReader::RECORD)
+        {
+            if (body)
+                args.push_back(body);
+            result = xl_call(scope, prefix, args);
+            args.clear();
+            records++;
+        }
+    }
+    record(fileload, "Streamed %llu records from %s",
+           records, inputName.c_str());
+    return result;
+}
+
+
 
 // ============================================================================
 //
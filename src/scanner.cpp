@@ -43,9 +43,17 @@
 #include "utf8_fileutils.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif // HAVE_SYS_MMAN_H
 
 
 XL_BEGIN
@@ -107,25 +115,63 @@ public:
         base64_value[0 + '+'] = 62;
         base64_value[0 + '/'] = 63;
 
-        // Select regular bases by default
-        select_base(10);
     }
 
-    void select_base(uint base)
+    struct Table
     {
-        value = base == 64 ? base64_value : based_value;
-    }
+        uint operator[] (uint8_t c) const
+        {
+            return value[c];
+        }
+        const uint *value;
+    };
 
-    uint operator[] (uint8_t c)
+    Table select_base(uint base) const
     {
-        return value[c];
+        return Table { base == 64 ? base64_value : based_value };
     }
 
 private:
     uint based_value[SIZE];
     uint base64_value[SIZE];
-    const uint *value;
-} digits;
+} digitValues;
+
+
+class CharClass
+// ----------------------------------------------------------------------------
+//   A table classifying input characters, including EOF
+// ----------------------------------------------------------------------------
+{
+public:
+    enum { SPACE = 1, DIGIT = 2, NAME = 4, PUNCT = 8 };
+
+public:
+    CharClass()
+    {
+        table[0] = 0;           // EOF
+        for (int c = 0; c < 0x100; c++)
+        {
+            uint bits = 0;
+            if (isspace(c))
+                bits |= SPACE;
+            if (isdigit(c))
+                bits |= DIGIT;
+            if (isalnum(c) || c == '_' || IS_UTF8_FIRST(c) || IS_UTF8_NEXT(c))
+                bits |= NAME;
+            if (ispunct(c))
+                bits |= PUNCT;
+            table[c + 1] = bits;
+        }
+    }
+
+    bool IsSpace(int c)         { return table[c + 1] & SPACE; }
+    bool IsDigit(int c)         { return table[c + 1] & DIGIT; }
+    bool IsName(int c)          { return table[c + 1] & NAME; }
+    bool IsPunct(int c)         { return table[c + 1] & PUNCT; }
+
+private:
+    uint8_t table[0x101];
+} chars;
 
 
 
@@ -140,29 +186,38 @@ Scanner::Scanner(kstring name, Syntax &stx, Positions &pos, Errors &err)
 //   Open the file and make sure it's readable
 // ----------------------------------------------------------------------------
     : syntax(stx),
-      input(*new utf8_ifstream(name)),
+      cursor(""), limit(cursor), contents(), mappedSize(0),
+      hitEOF(false),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(), indent(0), indentChar(0),
       position(0), lineStart(0),
       positions(pos), errors(err),
       checkingIndent(false), settingIndent(false),
-      hadSpaceBefore(false), hadSpaceAfter(false),
-      mustDeleteInput(true)
+      hadSpaceBefore(false), hadSpaceAfter(false)
 {
     indents.push_back(0);       // We start with an indent of 0
-    position = positions.OpenFile(name);
-    if (input.fail())
+    bool failed = false;
+    int  error = 0;
+    if (!MapFile(name))
+    {
+        utf8_ifstream input(name, std::ios::in | std::ios::binary);
+        failed = input.fail();
+        error = errno;
+        if (!failed)
+            ReadStream(input);
+    }
+    position = positions.OpenFile(name, limit - cursor, cursor);
+    if (failed)
         err.Log(Error("File $1 cannot be read: $2", position).
-                Arg(name).Arg(strerror(errno), ""));
+                Arg(name).Arg(strerror(error), ""));
 
     // Skip UTF-8 BOM if present
-    if (input.get() != 0xEF)
-        input.unget();
-    else if (input.get() != 0xBB)
-        input.unget(), input.unget();
-    else if(input.get() != 0xBF)
-        input.unget(), input.unget(), input.unget();
+    if (limit - cursor >= 3 &&
+        byte(cursor[0]) == 0xEF &&
+        byte(cursor[1]) == 0xBB &&
+        byte(cursor[2]) == 0xBF)
+        cursor += 3;
 }
 
 
@@ -170,34 +225,40 @@ Scanner::Scanner(std::istream &input,
                  Syntax &stx, Positions &pos, Errors &err,
                  kstring fileName)
 // ----------------------------------------------------------------------------
-//   Open the file and make sure it's readable
+//   Read the input stream and make sure it's readable
 // ----------------------------------------------------------------------------
     : syntax(stx),
-      input(input),
+      cursor(""), limit(cursor), contents(), mappedSize(0),
+      hitEOF(false),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(), indent(0), indentChar(0),
       position(0), lineStart(0),
       positions(pos), errors(err),
       checkingIndent(false), settingIndent(false),
-      hadSpaceBefore(false), hadSpaceAfter(false),
-      mustDeleteInput(false)
+      hadSpaceBefore(false), hadSpaceAfter(false)
 {
     indents.push_back(0);       // We start with an indent of 0
-    position = positions.OpenFile(fileName);
-    if (input.fail())
+    bool failed = input.fail();
+    int  error = errno;
+    if (!failed)
+        ReadStream(input);
+    position = positions.OpenFile(fileName, limit - cursor, cursor);
+    if (failed)
         err.Log(Error("Input stream $1 cannot be read: $2", position)
                 .Arg(fileName)
-                .Arg(strerror(errno)));
+                .Arg(strerror(error)));
 }
 
 
 Scanner::Scanner(const Scanner &parent)
 // ----------------------------------------------------------------------------
-//   Open the file and make sure it's readable
+//   Create a scanner reading the same buffer as its parent
 // ----------------------------------------------------------------------------
+//   The parent resumes reading where the child stopped using SetPosition
     : syntax(parent.syntax),
-      input(parent.input),
+      cursor(parent.cursor), limit(parent.limit), contents(), mappedSize(0),
+      hitEOF(parent.hitEOF),
       tokenText(""),
       textValue(""), realValue(0.0), intValue(0), base(10),
       indents(parent.indents),
@@ -207,22 +268,110 @@ Scanner::Scanner(const Scanner &parent)
       positions(parent.positions), errors(parent.errors),
       checkingIndent(false), settingIndent(false),
       hadSpaceBefore(parent.hadSpaceBefore),
-      hadSpaceAfter(parent.hadSpaceAfter),
-      mustDeleteInput(false)
+      hadSpaceAfter(parent.hadSpaceAfter)
 {}
 
 
 Scanner::~Scanner()
 // ----------------------------------------------------------------------------
-//   Scanner destructor closes the file
+//   Scanner destructor releases the mapped file
 // ----------------------------------------------------------------------------
 {
-    if (mustDeleteInput)
-        delete &input;
+#ifdef HAVE_SYS_MMAN_H
+    if (mappedSize)
+        munmap((void *) (limit - mappedSize), mappedSize);
+#endif // HAVE_SYS_MMAN_H
     positions.CloseFile(position);
 }
 
 
+void Scanner::SetPosition(ulong pos)
+// ----------------------------------------------------------------------------
+//   Move to a new position in the same buffer, e.g. after a child scanner
+// ----------------------------------------------------------------------------
+{
+    cursor += pos - position;
+    position = pos;
+}
+
+
+void Scanner::ReadStream(std::istream &input)
+// ----------------------------------------------------------------------------
+//   Read a whole input stream into the buffer, one block at a time
+// ----------------------------------------------------------------------------
+{
+    char block[4096];
+    while (input.read(block, sizeof(block)) || input.gcount())
+        contents.append(block, input.gcount());
+    cursor = contents.data();
+    limit = cursor + contents.length();
+    record(scanner, "Read %lu bytes from stream", contents.length());
+}
+
+
+bool Scanner::MapFile(kstring name)
+// ----------------------------------------------------------------------------
+//   Map a source file in memory if possible
+// ----------------------------------------------------------------------------
+{
+#ifdef HAVE_SYS_MMAN_H
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+
+    mappedSize = st.st_size;
+    cursor = (kstring) addr;
+    limit = cursor + mappedSize;
+    record(scanner, "Mapped %lu bytes from %s", mappedSize, name);
+    return true;
+#else // !HAVE_SYS_MMAN_H
+    return false;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+inline int Scanner::Get()
+// ----------------------------------------------------------------------------
+//   Return the next character in the buffer, or EOF
+// ----------------------------------------------------------------------------
+//   Reading past the end still advances, so that Unget remains symmetric
+{
+    if (cursor < limit)
+        return byte(*cursor++);
+    cursor++;
+    hitEOF = true;
+    return EOF;
+}
+
+
+inline void Scanner::Unget()
+// ----------------------------------------------------------------------------
+//   Move back one character in the buffer
+// ----------------------------------------------------------------------------
+{
+    cursor--;
+}
+
+
+inline int Scanner::Peek()
+// ----------------------------------------------------------------------------
+//   Return the next character without consuming it
+// ----------------------------------------------------------------------------
+{
+    if (cursor < limit)
+        return byte(*cursor);
+    return EOF;
+}
+
+
 static inline char xlcase(char c)
 // ----------------------------------------------------------------------------
 //   Change the case following XL rules
@@ -240,16 +389,7 @@ static inline char xlcase(char c)
     do {                                        \
         tokenText += c;                         \
         textValue += c;                         \
-        c = input.get();                        \
-        position++;                             \
-    } while(0)
-
-
-#define NEXT_LOWER_CHAR(c)                      \
-    do {                                        \
-        tokenText += xlcase(c);                 \
-        textValue += c;                         \
-        c = input.get();                        \
+        c = Get();                              \
         position++;                             \
     } while(0)
 
@@ -257,7 +397,7 @@ static inline char xlcase(char c)
 #define IGNORE_CHAR(c)                          \
     do {                                        \
         textValue += c;                         \
-        c = input.get();                        \
+        c = Get();                              \
         position++;                             \
     } while (0)
 
@@ -273,8 +413,8 @@ token_t Scanner::NextToken(bool hungry)
     realValue = 0.0;
     base = 0;
 
-    // Check if input was opened correctly
-    if (!input.good())
+    // Check if we already reached the end of input
+    if (hitEOF)
     {
         record(scanner, "End of file at position %lu", position);
         return tokEOF;
@@ -290,12 +430,12 @@ token_t Scanner::NextToken(bool hungry)
     }
 
     // Read next character
-    int c = input.get();
+    int c = Get();
     position++;
 
     // Skip spaces and check indendation
     hadSpaceBefore = false;
-    while (isspace(c) && c != EOF)
+    while (chars.IsSpace(c))
     {
         hadSpaceBefore = true;
         if (c == '\n')
@@ -320,14 +460,14 @@ token_t Scanner::NextToken(bool hungry)
         // Keep looking for more spaces
         if (c == '\n')
             textValue += c;
-        c = input.get();
+        c = Get();
         position++;
     } // End of space testing
 
     // Stop counting indentation
     if (checkingIndent)
     {
-        input.unget();
+        Unget();
         position--;
         checkingIndent = false;
         ulong column = position - lineStart;
@@ -386,7 +526,7 @@ token_t Scanner::NextToken(bool hungry)
     }
 
     // Report end of input if that's what we've got
-    if (input.eof())
+    if (c == EOF)
     {
         record(scanner, "End of file after skipping at position %lu", position);
 	return tokEOF;
@@ -396,14 +536,14 @@ token_t Scanner::NextToken(bool hungry)
     textValue = "";
 
     // Look for numbers
-    if (isdigit(c))
+    if (chars.IsDigit(c))
     {
         bool floating_point = false;
         bool basedNumber = false;
 
         base = 10;
         intValue = 0;
-        digits.select_base(base);
+        DigitValue::Table digits = digitValues.select_base(base);
 
         // Take integral part (or base)
         do
@@ -431,7 +571,7 @@ token_t Scanner::NextToken(bool hungry)
                     errors.Log(Error("The base $1 is not valid (2..36 or 64)",
                                      position).Arg(textValue));
                 }
-                digits.select_base(base);
+                digits = digitValues.select_base(base);
                 NEXT_CHAR(c);
                 intValue = 0;
                 basedNumber = true;
@@ -446,11 +586,11 @@ token_t Scanner::NextToken(bool hungry)
         realValue = intValue;
         if (c == '.')
         {
-            int nextDigit = input.peek();
+            int nextDigit = Peek();
             if (digits[nextDigit] >= base)
             {
                 // This is something else following an natural: 1..3, 1.(3)
-                input.unget();
+                Unget();
                 position--;
                 hadSpaceAfter = false;
                 record(scanner, "Natural %ld ending in '.' at position %lu",
@@ -533,9 +673,9 @@ token_t Scanner::NextToken(bool hungry)
         }
 
         // Return the token
-        input.unget();
+        Unget();
         position--;
-        hadSpaceAfter = isspace(c);
+        hadSpaceAfter = chars.IsSpace(c);
         if (floating_point)
             record(scanner, "Real %g at position %lu",
                    realValue, position);
@@ -548,16 +688,30 @@ token_t Scanner::NextToken(bool hungry)
     // Look for names
     else if (IS_UTF8_OR_ALPHA(c))
     {
-        while (isalnum(c) || c == '_' || IS_UTF8_FIRST(c) || IS_UTF8_NEXT(c))
+        // Find the whole name in the buffer, then copy it at once
+        kstring start = cursor - 1;
+        kstring end = cursor;
+        bool    plain = true;
+        while (end < limit && chars.IsName(byte(*end)))
+            plain &= *end++ != '_';
+        position += end - cursor;
+        cursor = end;
+        c = Get();
+        Unget();
+
+        textValue.assign(start, end - start);
+        if (plain && Opt::caseSensitive)
         {
-            if (c == '_')
-                IGNORE_CHAR(c);
-            else
-                NEXT_LOWER_CHAR(c);
+            tokenText = textValue;
         }
-        input.unget();
-        position--;
-        hadSpaceAfter = isspace(c);
+        else
+        {
+            tokenText.reserve(end - start);
+            for (kstring p = start; p < end; p++)
+                if (*p != '_')
+                    tokenText += xlcase(*p);
+        }
+        hadSpaceAfter = chars.IsSpace(c);
         if (syntax.IsBlock(textValue, endMarker))
         {
             bool closing = endMarker == "";
@@ -575,21 +729,36 @@ token_t Scanner::NextToken(bool hungry)
     {
         char eos = c;
         tokenText = c;
-        c = input.get();
+        c = Get();
         position++;
         for(;;)
         {
+            // Copy characters up to the next quote or end of line at once
+            if (c != eos && c != '\n' && c != EOF)
+            {
+                kstring start = cursor - 1;
+                kstring end = cursor;
+                while (end < limit && *end != eos && *end != '\n')
+                    end++;
+                tokenText.append(start, end - start);
+                textValue.append(start, end - start);
+                position += end - cursor;
+                cursor = end;
+                c = Get();
+                position++;
+            }
+
             // Check end of text
             if (c == eos)
             {
                 tokenText += c;
-                c = input.get();
+                c = Get();
                 position++;
                 if (c != eos)
                 {
-                    input.unget();
+                    Unget();
                     position--;
-                    hadSpaceAfter = isspace(c);
+                    hadSpaceAfter = chars.IsSpace(c);
                     record(scanner, "Text %s at position %lu",
                            tokenText.c_str(), position);
                     return eos == '"' ? tokSTRING : tokQUOTE;
@@ -604,7 +773,7 @@ token_t Scanner::NextToken(bool hungry)
                 hadSpaceAfter = false;
                 if (c == '\n')
                 {
-                    input.unget();
+                    Unget();
                     position--;
                 }
                 record(scanner, "Truncated text %s at position %lu",
@@ -630,7 +799,7 @@ token_t Scanner::NextToken(bool hungry)
 
     // Look for other symbols
     bool hadChar = false;
-    while (ispunct(c) && c != '\'' && c != '"' && c != EOF &&
+    while (chars.IsPunct(c) && c != '\'' && c != '"' &&
            !syntax.IsBlock(c, endMarker))
     {
         hadChar = true;
@@ -640,7 +809,7 @@ token_t Scanner::NextToken(bool hungry)
     }
     if (hadChar)
     {
-        input.unget();
+        Unget();
         position--;
     }
     else
@@ -654,11 +823,11 @@ token_t Scanner::NextToken(bool hungry)
         {
             tokenText.erase(tokenText.length() - 1, 1);
             textValue.erase(textValue.length() - 1, 1);
-            input.unget();
+            Unget();
             position--;
         }
     }
-    hadSpaceAfter = isspace(c);
+    hadSpaceAfter = chars.IsSpace(c);
     if (syntax.IsBlock(textValue, endMarker))
     {
         bool closing = endMarker == "";
@@ -686,7 +855,7 @@ text Scanner::Comment(text EOC, bool stripIndent)
 
     while (*match && c != EOF)
     {
-        c = input.get();
+        c = Get();
         position++;
         skip = false;
 
@@ -698,7 +867,7 @@ text Scanner::Comment(text EOC, bool stripIndent)
         }
         else if (checkingIndent)
         {
-            if (isspace(c))
+            if (chars.IsSpace(c))
             {
                 skip = ((position - lineStart) < column);
             }
@@ -770,102 +939,219 @@ void Scanner::CloseParen(uint oldIndent)
 //
 // ============================================================================
 
-ulong Positions::OpenFile(text name)
+Positions::Positions()
+// ----------------------------------------------------------------------------
+//    Create an empty set of positions
+// ----------------------------------------------------------------------------
+    : segments(), count(0), closed(0)
+{}
+
+
+Positions::~Positions()
 // ----------------------------------------------------------------------------
-//    Open a new file
+//    Delete the files and the table
 // ----------------------------------------------------------------------------
 {
-    positions.push_back(Range(current_position, name));
-    return current_position;
+    uint max = count;
+    for (uint i = 0; i < max; i++)
+        delete SlotAt(i)->Get();
+    for (uint s = 0; s < SEGMENTS; s++)
+        delete[] segments[s].Get();
+}
+
+
+Positions::Slot *Positions::SlotAt(uint index, bool create)
+// ----------------------------------------------------------------------------
+//    Return the slot for a file, creating the segment holding it if needed
+// ----------------------------------------------------------------------------
+//    Segments are never moved, so readers can access published slots while
+//    another thread adds a file
+{
+    uint segment = 0;
+    uint size = FIRST_SEGMENT;
+    while (index >= size)
+    {
+        index -= size;
+        size *= 2;
+        segment++;
+    }
+
+    Slot *slots = segments[segment];
+    if (!slots && create)
+    {
+        Slot *created = new Slot[size];
+        if (segments[segment].SetQ(nullptr, created))
+            slots = created;
+        else
+            delete[] created;
+        slots = segments[segment];
+    }
+    return slots + index;
+}
+
+
+ulong Positions::OpenFile(text name, ulong size, kstring data)
+// ----------------------------------------------------------------------------
+//    Open a new file, reserving positions up to one past its end
+// ----------------------------------------------------------------------------
+//    A file can only be added right after the last published one, so that
+//    the table remains ordered by start position
+{
+    File *file = new File(name, size, data ? LineStarts(data, size) : nullptr);
+    while (true)
+    {
+        uint index = count;
+        ulong start = closed;
+        if (index)
+        {
+            File *last = SlotAt(index - 1)->Get();
+            if (start < last->start + last->size + 1)
+                start = last->start + last->size + 1;
+        }
+        file->start = start;
+
+        Slot *slot = SlotAt(index, true);
+        bool added = slot->SetQ(nullptr, file);
+
+        // Publish the file, or help the thread that added one
+        count.SetQ(index, index + 1);
+        if (added)
+            return start;
+    }
 }
 
 
 void Positions::CloseFile (ulong pos)
 // ----------------------------------------------------------------------------
-//    Remember the end position for a file
+//    Remember the end position for a file, if it went past its reservation
 // ----------------------------------------------------------------------------
 {
-    current_position = pos;
+    closed.Maximize(pos);
 }
 
 
-void Positions::GetFile(ulong pos, text *file, ulong *offset)
+Positions::File *Positions::Find(ulong pos)
 // ----------------------------------------------------------------------------
-//    Return the file and the offset in the file
+//    Return the last file starting at or before the position
 // ----------------------------------------------------------------------------
 {
-    std::vector<Range>::iterator i;
-    for (i = positions.begin(); i != positions.end(); i++)
-        if (pos < (*i).start)
-            break;
-    if (i != positions.begin())
+    uint low = 0, high = count;
+    while (low < high)
     {
-        i--;
-        if (file)
-            *file = (*i).file;
-        if (offset)
-            *offset = pos - (*i).start;
+        uint mid = (low + high) / 2;
+        if (pos < SlotAt(mid)->Get()->start)
+            high = mid;
+        else
+            low = mid + 1;
     }
-    else
+    return low ? SlotAt(low - 1)->Get() : nullptr;
+}
+
+
+Positions::Lines *Positions::LineStarts(kstring data, ulong size)
+// ----------------------------------------------------------------------------
+//    Build the index of line starts for the given file contents
+// ----------------------------------------------------------------------------
+{
+    Lines *lines = new Lines;
+    lines->size = size;
+    kstring end = data + size;
+    for (kstring p = data; p < end; p++)
     {
-        if (file)
-            *file = "";
-        if (offset)
-            *offset = pos;
+        p = (kstring) memchr(p, '\n', end - p);
+        if (!p)
+            break;
+        lines->starts.push_back(p + 1 - data);
     }
+    return lines;
+}
+
+
+Positions::Lines *Positions::LinesOf(File *file)
+// ----------------------------------------------------------------------------
+//    Return the line starts for a file, reading the file if necessary
+// ----------------------------------------------------------------------------
+//    This happens for files that were not scanned, e.g. read from a cache.
+//    Threads racing to build the index keep the first one published.
+{
+    if (Lines *lines = file->lines)
+        return lines;
+
+    text contents;
+    utf8_ifstream input(file->name.c_str(), std::ios::in | std::ios::binary);
+    if (input.fail())
+        return nullptr;
+    char block[4096];
+    while (input.read(block, sizeof(block)) || input.gcount())
+        contents.append(block, input.gcount());
+
+    Lines *lines = LineStarts(contents.data(), contents.length());
+    if (!file->lines.SetQ(nullptr, lines))
+    {
+        delete lines;
+        lines = file->lines;
+    }
+    return lines;
+}
+
+
+void Positions::GetFile(ulong pos, text *file, ulong *offset)
+// ----------------------------------------------------------------------------
+//    Return the file and the offset in the file
+// ----------------------------------------------------------------------------
+{
+    File *found = Find(pos);
+    if (file)
+        *file = found ? found->name : "";
+    if (offset)
+        *offset = found ? pos - found->start : pos;
 }
 
 
 void Positions::GetInfo(ulong pos, text *out_file, ulong *out_line,
                         ulong *out_column, text *out_source)
 // ----------------------------------------------------------------------------
-//   Scan the input files to find the location of the error
+//   Find the file, line and column of a position, and the source line
 // ----------------------------------------------------------------------------
+//   The column counts the characters before the position on its line
 {
-    ulong  offset = 0;
     ulong  line   = 1;
     ulong  column = 0;
     text   source = "";
-    text   name = "";
-    FILE  *file;
-    char   c;
+    text   name   = "";
 
-    GetFile (pos, &name, &offset);
-    if (name != "")
+    File *file = Find(pos);
+    Lines *lines = file ? LinesOf(file) : nullptr;
+    if (file)
+        name = file->name;
+    if (lines)
     {
-        file = fopen(name.c_str(), "r");
-        if (file)
+        // Count the characters up to the one before the position
+        ulong offset = pos - file->start;
+        if (offset > 1)
+            offset--;
+        if (offset > lines->size)
+            offset = lines->size;
+
+        // Find the line that contains them
+        std::vector<uint> &starts = lines->starts;
+        auto next = std::upper_bound(starts.begin(), starts.end(), offset);
+        ulong first = next == starts.begin() ? 0 : *(next - 1);
+        line = 1 + (next - starts.begin());
+        column = offset - first;
+
+        // Read the source line if requested
+        if (out_source)
         {
-            while (!feof(file))
+            FILE *input = fopen(name.c_str(), "r");
+            if (input)
             {
-                c = fgetc(file);
-                if (c == EOF)
-                    break;
-                if (c == '\n')
-                {
-                    line++;
-                    column = 0;
-                    source = "";
-                }
-                else
-                {
-                    column++;
+                fseek(input, first, SEEK_SET);
+                int c;
+                while ((c = fgetc(input)) != EOF && c != '\n')
                     source += c;
-                }
-                offset--;
-                if (offset <= 1)
-                    break;
-            }
-
-            // Read rest of line
-            while(!feof(file))
-            {
-                c = fgetc(file);
-                if (c == '\n' || c == EOF)
-                    break;
-                source += c;
+                fclose(input);
             }
-            fclose(file);
         }
     }
 
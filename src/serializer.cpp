@@ -93,13 +93,37 @@ Serializer::Serializer(std::ostream &out)
 // ----------------------------------------------------------------------------
 //   Constructor sends the magic and version number
 // ----------------------------------------------------------------------------
-    : out (out)
+    : out(&out), local(), buffer(local)
 {
     WriteUnsigned(serialMAGIC);
     WriteUnsigned(serialVERSION);
 }
 
 
+Serializer::Serializer(text &buffer)
+// ----------------------------------------------------------------------------
+//   Constructor appending to a buffer in memory
+// ----------------------------------------------------------------------------
+    : out(nullptr), local(), buffer(buffer)
+{
+    WriteUnsigned(serialMAGIC);
+    WriteUnsigned(serialVERSION);
+}
+
+
+void Serializer::Flush()
+// ----------------------------------------------------------------------------
+//   Write what was buffered to the output stream, if any
+// ----------------------------------------------------------------------------
+{
+    if (out && buffer.size())
+    {
+        out->write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+}
+
+
 Tree *Serializer::Do(Tree *what)
 // ----------------------------------------------------------------------------
 //   The default is to write an invalid tree, we should not be here
@@ -219,7 +243,7 @@ void Serializer::WriteSigned(longlong value)
         value >>= 7;
         if ((value != 0 && value != -1) || (value & 0x40) != (b & 0x40))
             b |= 0x80;
-        out << b;
+        buffer += char(b);
     } while (b & 0x80);
 }
 
@@ -236,7 +260,7 @@ void Serializer::WriteUnsigned(ulonglong value)
         value >>= 7;
         if (value != 0)
             b |= 0x80;
-        out << b;
+        buffer += char(b);
     } while (b & 0x80);
 }
 
@@ -258,23 +282,24 @@ void Serializer::WriteReal(double value)
 }
 
 
-void Serializer::WriteText(text value)
+void Serializer::WriteText(const text &value)
 // ----------------------------------------------------------------------------
 //   Write the length followed by data bytes
 // ----------------------------------------------------------------------------
+//   Texts already written are replaced with their negated number,
+//   starting at 1
 {
-    // texts[value] is created with value 0 if not existing,
-    // and then it increases texts.size by 1.
-    longlong exists = texts[value];
-    if (exists)
+    auto exists = texts.find(value);
+    if (exists != texts.end())
     {
-        WriteSigned(-exists);
+        WriteSigned(-exists->second);
     }
     else
     {
         WriteSigned(value.length());
-        out.write(value.data(), value.length());
-        texts[value] = texts.size();
+        buffer.append(value.data(), value.length());
+        longlong id = texts.size() + 1;
+        texts.emplace(value, id);
     }
 }
 
@@ -288,6 +313,8 @@ void Serializer::WriteChild(Tree *child)
         child->Do(this);
     else
         WriteUnsigned(serialNULL);
+    if (out && buffer.size() >= FLUSH_SIZE)
+        Flush();
 }
 
 
@@ -302,17 +329,33 @@ Deserializer::Deserializer(std::istream &in, TreePosition pos)
 // ----------------------------------------------------------------------------
 //   Read a few bytes from the stream, check version and magic value
 // ----------------------------------------------------------------------------
-    : in(in), pos(pos)
+    : in(&in), next(nullptr), last(nullptr), valid(in.good()), pos(pos)
 {
     if (ReadUnsigned() != serialMAGIC ||
         ReadUnsigned() != serialVERSION)
     {
         // Error on input: close the stream
         in.setstate(in.failbit);
+        valid = false;
     }
 }
 
 
+Deserializer::Deserializer(kstring data, size_t size, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Read from memory, check version and magic value
+// ----------------------------------------------------------------------------
+//   The data must remain valid while reading trees
+    : in(nullptr),
+      next((const byte *) data), last((const byte *) data + size),
+      valid(true), pos(pos)
+{
+    if (ReadUnsigned() != serialMAGIC ||
+        ReadUnsigned() != serialVERSION)
+        valid = false;
+}
+
+
 Deserializer::~Deserializer()
 // ----------------------------------------------------------------------------
 //   No-op destructor
@@ -326,7 +369,7 @@ Tree *Deserializer::ReadTree()
 // ----------------------------------------------------------------------------
 {
     // If it's bad to start with, stop reading further...
-    if (!in.good())
+    if (!valid)
         return nullptr;
 
     SerializationTag tag = SerializationTag(ReadUnsigned());
@@ -387,7 +430,7 @@ Tree *Deserializer::ReadTree()
         break;
 
     default:
-        in.setstate(in.failbit);
+        valid = false;
     }
 
     return result;
@@ -399,7 +442,7 @@ longlong Deserializer::ReadSigned()
 //   Read values from input stream, checking that it fits local longlong
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!valid)
         return 0;
 
     byte     b;
@@ -408,14 +451,14 @@ longlong Deserializer::ReadSigned()
     uint     shift = 0;
     do
     {
-        b = in.get();
+        b = ReadByte();
         shifted = longlong(b & 0x7f) << shift;
         value |= shifted;
         if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+            valid = false;
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (valid && (b & 0x80));
 
     if (b & 0x40)
         value |= ~0ULL << shift;
@@ -429,7 +472,7 @@ ulonglong Deserializer::ReadUnsigned()
 //   Read unsigned values from input stream, checking that it fits local ull
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!valid)
         return 0;
 
     byte      b;
@@ -438,14 +481,14 @@ ulonglong Deserializer::ReadUnsigned()
     uint      shift   = 0;
     do
     {
-        b = in.get();
+        b = ReadByte();
         shifted = ulonglong(b & 0x7f) << shift;
         value |= shifted;
         if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+            valid = false;
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (valid && (b & 0x80));
 
     return value;
 }
@@ -456,7 +499,7 @@ double Deserializer::ReadReal()
 //   Read a real number from the input stream
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!valid)
         return 0;
 
     ieee754_double cvt;
@@ -484,7 +527,7 @@ text Deserializer::ReadText()
 //   Read a text from the input stream
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!valid)
         return "";
 
     text      result;
@@ -492,19 +535,49 @@ text Deserializer::ReadText()
 
     if (length < 0)
     {
-        result = texts[-length];
+        ulonglong id = -length;
+        if (id <= texts.size())
+            result = texts[id - 1];
+    }
+    else if (!in)
+    {
+        if (length > last - next)
+        {
+            valid = false;
+            return "";
+        }
+        result.assign((kstring) next, length);
+        next += length;
+        texts.push_back(result);
     }
     else
     {
         char *    buffer = new char[length];
-        in.read(buffer, length);
+        in->read(buffer, length);
+        valid = in->good();
         result.insert(0, buffer, length);
         delete[] buffer;
 
-        texts[texts.size()+1] = result;
+        texts.push_back(result);
     }
 
     return result;
 }
 
+
+byte Deserializer::ReadByteFromStream()
+// ----------------------------------------------------------------------------
+//   Read a byte from the input stream, the end of memory is an error
+// ----------------------------------------------------------------------------
+{
+    if (in)
+    {
+        int c = in->get();
+        if (in->good())
+            return c;
+    }
+    valid = false;
+    return 0;
+}
+
 XL_END
@@ -0,0 +1,211 @@
+// *****************************************************************************
+// snapshot.cpp                                                       XL project
+// *****************************************************************************
+//
+// File description:
+//
+//     Snapshot of the global scope once builtins have been loaded
+//
+//     The snapshot is a flat tree image with shared nodes, with a root of
+//     the form (Scope; Source) \n (Kinds; Globals), where Kinds records
+//     Context::hasRewritesForKind and Globals lists the enclosing scope
+//     and the named opcode trees in the snapshot, separated by commas.
+//     The enclosing scope is only written as a name, since it is rebuilt
+//     by entering the opcodes.
+// *****************************************************************************
+// This software is licensed under the GNU General Public License v3+
+// (C) 2020, Christophe de Dinechin <christophe@dinechin.org>
+// *****************************************************************************
+// This file is part of XL
+//
+// XL is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License,
+// or (at your option) any later version.
+//
+// XL is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with XL, in a file named COPYING.
+// If not, see <https://www.gnu.org/licenses/>.
+// *****************************************************************************
+
+#include "snapshot.h"
+#include "flat.h"
+#include "cache.h"
+#include "opcodes.h"
+#include "main.h"
+
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+
+RECORDER(snapshot, 16, "Snapshot of the global scope");
+
+XL_BEGIN
+
+// Name standing for the enclosing scope in a snapshot
+static kstring SNAPSHOT_PARENT = "<parent scope>";
+
+
+static std::vector<NameOpcode *> NameOpcodes()
+// ----------------------------------------------------------------------------
+//   List the opcodes defining global names such as 'nil' or 'natural'
+// ----------------------------------------------------------------------------
+{
+    std::vector<NameOpcode *> result;
+    for (Opcode *opcode : *Opcode::opcodes)
+        if (NameOpcode *named = dynamic_cast<NameOpcode *>(opcode))
+            result.push_back(named);
+    return result;
+}
+
+
+bool Snapshot::Write(text file, ulonglong stamp, Positions &positions,
+                     Scope *scope, Tree *source)
+// ----------------------------------------------------------------------------
+//   Write the given scope and the source evaluated in it
+// ----------------------------------------------------------------------------
+//   The enclosing scope holds the opcodes, and is written as a name
+{
+    // List the global names in reverse order, to bind them back in order
+    TreePosition pos = source->Position();
+    Tree_p globals = xl_nil;
+    for (NameOpcode *named : NameOpcodes())
+        globals = new Infix(",", named->toDefine, globals, pos);
+    Scope *parent = Enclosing(scope);
+    if (!parent)
+        return false;
+    globals = new Infix(",", parent, globals, pos);
+
+    Natural *kinds = new Natural(Context::hasRewritesForKind, pos);
+    Tree_p root = new Infix("\n",
+                            new Infix(";", scope, source, pos),
+                            new Infix(";", kinds, globals, pos),
+                            pos);
+
+    FlatTree flat(true);
+    flat.Alias(parent, new Name(SNAPSHOT_PARENT, pos));
+    flat.SetRoot(flat.Add(root));
+    if (flat.Root() == FlatTree::NONE)
+        return false;
+
+    char pid[32];
+    snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+    text temp = file + pid;
+    bool ok;
+    {
+        std::ofstream out(temp.c_str(), std::ios::out | std::ios::binary);
+        ok = out.good() && flat.Write(out, positions, stamp);
+        out.close();
+        ok = ok && out.good();
+    }
+    ok = ok && rename(temp.c_str(), file.c_str()) == 0;
+    if (!ok)
+        unlink(temp.c_str());
+    record(snapshot, "%s %s, %u nodes",
+           ok ? "Wrote" : "Failed to write", file.c_str(), flat.NodeCount());
+    return ok;
+}
+
+
+bool Snapshot::Read(text file, ulonglong stamp, Positions &positions,
+                    Scope *parent, Scope_p &scope, Tree_p &source)
+// ----------------------------------------------------------------------------
+//   Restore a scope and source from a snapshot, if it has the right stamp
+// ----------------------------------------------------------------------------
+//   The parent scope must hold the opcodes, and replaces the enclosing scope
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+        return false;
+
+    FlatTree *flat = FlatTree::Map(file, positions);
+    if (!flat)
+    {
+        record(snapshot, "Invalid snapshot %s", file.c_str());
+        return false;
+    }
+    if (flat->Stamp() != stamp || !flat->IsShared())
+    {
+        record(snapshot, "Outdated snapshot %s", file.c_str());
+        delete flat;
+        return false;
+    }
+
+    // Check the shape of the root, then bind globals before materializing
+    uint root  = flat->Root();
+    uint pair  = flat->Left(root);
+    uint info  = flat->Right(root);
+    uint kinds = flat->Left(info);
+    bool ok = flat->Kind(root) == INFIX && flat->Kind(pair) == INFIX &&
+        flat->Kind(info) == INFIX && flat->Kind(kinds) == NATURAL;
+    uint globals = ok ? flat->Right(info) : FlatTree::NONE;
+    std::vector<Tree *> bound;
+    for (NameOpcode *named : NameOpcodes())
+        bound.push_back(named->toDefine);
+    bound.push_back(parent);
+    for (auto b = bound.rbegin(); ok && b != bound.rend(); b++)
+    {
+        ok = flat->Kind(globals) == INFIX;
+        if (!ok)
+            break;
+        uint global = flat->Left(globals);
+        text name = *b == parent
+            ? text(SNAPSHOT_PARENT)
+            : text(((Name *) *b)->value);
+        ok = flat->Kind(global) == NAME && flat->Value(global) == name;
+        if (ok)
+            flat->Bind(global, *b);
+        globals = flat->Right(globals);
+    }
+    if (!ok)
+    {
+        record(snapshot, "Unexpected snapshot contents in %s", file.c_str());
+        delete flat;
+        return false;
+    }
+
+    // Build all the trees
+    Infix *top = flat->Materialize()->AsInfix();
+    Infix *left = top->left->AsInfix();
+    Infix *right = top->right->AsInfix();
+    scope = left->left->As<Scope>();
+    source = left->right;
+    delete flat;
+    if (!scope || Enclosing(scope) != parent)
+        return false;
+    Context::hasRewritesForKind |= right->left->AsNatural()->value;
+
+    // Restore the hash index of the scope
+    if (ScopeRewrites(scope) && !scope->GetInfo<ScopeIndex>())
+        scope->SetInfo<ScopeIndex>(new ScopeIndex(scope));
+
+    record(snapshot, "Restored %s", file.c_str());
+    return true;
+}
+
+
+ulonglong Snapshot::Stamp(text builtins)
+// ----------------------------------------------------------------------------
+//   Identify the builtins file and the program that evaluated it
+// ----------------------------------------------------------------------------
+{
+    ulonglong stamp = ModuleCache::BuildStamp();
+    stamp = ModuleCache::Mix(stamp, builtins);
+    stamp = ModuleCache::Mix(stamp, ulonglong(Opt::optimize));
+    struct stat st;
+    if (stat(builtins.c_str(), &st) == 0)
+    {
+        stamp = ModuleCache::Mix(stamp, ulonglong(st.st_mtime));
+        stamp = ModuleCache::Mix(stamp, ulonglong(st.st_size));
+    }
+    return stamp;
+}
+
+XL_END
@@ -41,6 +41,8 @@
 #include "errors.h"
 #include "main.h"
 
+#include <mutex>
+
 XL_BEGIN
 
 // ============================================================================
@@ -450,7 +452,11 @@ void Syntax::ReadSyntaxFile (text filename, uint indents)
 // ----------------------------------------------------------------------------
 //   Read a syntax directly from a syntax file
 // ----------------------------------------------------------------------------
+//   Parser threads may read child syntax files, and errors are stacked.
+//   A syntax file can itself refer to child syntax files.
 {
+    static std::recursive_mutex lock;
+    std::lock_guard<std::recursive_mutex> guard(lock);
     Syntax    baseSyntax;
     Positions basePositions;
     Errors    errors;
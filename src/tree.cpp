@@ -65,6 +65,30 @@ kstring Tree::KindName[KIND_COUNT] =
 };
 
 
+static Natural_p smallNaturals[Natural::SMALL_COUNT];
+
+Natural *Natural::Make(value_t value, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Return a shared node for small values, or allocate a new one
+// ----------------------------------------------------------------------------
+//   Trees computed by opcodes are never modified, so like 'true' and
+//   'false', small naturals can be shared instead of allocated for each
+//   arithmetic result. Shared nodes have no source position.
+{
+    value_t index = value + SMALL_NEGATIVE;
+    if (index >= SMALL_COUNT)
+        return new Natural(value, pos);
+
+    Natural *result = smallNaturals[index];
+    if (!result)
+    {
+        result = new Natural(value);
+        smallNaturals[index] = result;
+    }
+    return result;
+}
+
+
 Tree::~Tree()
 // ----------------------------------------------------------------------------
 //   Delete the tree and associated data
@@ -238,9 +262,9 @@ void Tree::SetPosition(TreePosition pos, bool recurse)
 }
 
 
-text Block::indent   = "I+";
-text Block::unindent = "I-";
-text Text::textQuote = "\"";
-text Text::charQuote = "'";
+Atom Block::indent   = "I+";
+Atom Block::unindent = "I-";
+Atom Text::textQuote = "\"";
+Atom Text::charQuote = "'";
 
 XL_END